@@ -0,0 +1,34 @@
+# crc32: bitwise reflected CRC-32 over 16384 words, result in $s7.
+# Short data-dependent branches in the inner loop.
+	lui	$s0, 0x1001		# buffer 0x10010000
+	addiu	$s1, $0, 16384
+	addiu	$t0, $0, 0
+	move	$t2, $s0
+fill:	sll	$t3, $t0, 16		# buf[i] = (i << 16) ^ i ^ 0x5a5a
+	xor	$t3, $t3, $t0
+	xori	$t3, $t3, 0x5a5a
+	sw	$t3, 0($t2)
+	addiu	$t2, $t2, 4
+	addiu	$t0, $t0, 1
+	bne	$t0, $s1, fill
+
+	lui	$s2, 0xedb8
+	ori	$s2, $s2, 0x8320	# polynomial
+	addiu	$s7, $0, -1
+	move	$t2, $s0
+	move	$t0, $s1
+word:	lw	$t3, 0($t2)
+	addiu	$t2, $t2, 4
+	addiu	$t1, $0, 32
+	xor	$s7, $s7, $t3
+bit:	andi	$t4, $s7, 1
+	srl	$s7, $s7, 1
+	beq	$t4, $0, next
+	xor	$s7, $s7, $s2
+next:	addiu	$t1, $t1, -1
+	bgtz	$t1, bit
+	addiu	$t0, $t0, -1
+	bgtz	$t0, word
+	nor	$s7, $s7, $0
+	addiu	$v0, $0, 10
+	syscall
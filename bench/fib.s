@@ -0,0 +1,29 @@
+# fib: recursive Fibonacci, fib(26) = 121393 left in $s0.
+# Exercises JAL/JR call and return, stack loads/stores and
+# load-use dependences.
+	lui	$sp, 0x1010		# stack below 0x10100000
+	addiu	$a0, $0, 26
+	jal	fib
+	move	$s0, $v0
+	addiu	$v0, $0, 10
+	syscall
+
+fib:	slti	$t0, $a0, 2
+	beq	$t0, $0, recurse
+	move	$v0, $a0
+	jr	$ra
+recurse:
+	addiu	$sp, $sp, -12
+	sw	$ra, 0($sp)
+	sw	$a0, 4($sp)
+	addiu	$a0, $a0, -1
+	jal	fib
+	sw	$v0, 8($sp)
+	lw	$a0, 4($sp)
+	addiu	$a0, $a0, -2
+	jal	fib
+	lw	$t1, 8($sp)
+	addu	$v0, $v0, $t1
+	lw	$ra, 0($sp)
+	addiu	$sp, $sp, 12
+	jr	$ra
@@ -0,0 +1,47 @@
+# isort: insertion sort of 1500 xorshift32 values (31 bits, so signed
+# and unsigned compares agree), then count out-of-order pairs into
+# $s7 (0 expected).
+	lui	$s0, 0x1001		# array 0x10010000
+	addiu	$s1, $0, 1500		# n
+	lui	$t9, 0x2545
+	ori	$t9, $t9, 0xf491	# seed
+	addiu	$t0, $0, 0
+	move	$t2, $s0
+fill:	sll	$t3, $t9, 13
+	xor	$t9, $t9, $t3
+	srl	$t3, $t9, 17
+	xor	$t9, $t9, $t3
+	sll	$t3, $t9, 5
+	xor	$t9, $t9, $t3
+	srl	$t4, $t9, 1
+	sw	$t4, 0($t2)
+	addiu	$t2, $t2, 4
+	addiu	$t0, $t0, 1
+	bne	$t0, $s1, fill
+
+	addiu	$t0, $0, 1		# i
+outer:	sll	$t1, $t0, 2
+	addu	$t1, $t1, $s0		# q = &a[i]
+	lw	$t5, 0($t1)		# key
+inner:	lw	$t6, -4($t1)
+	slt	$t7, $t5, $t6
+	beq	$t7, $0, place
+	sw	$t6, 0($t1)
+	addiu	$t1, $t1, -4
+	bne	$t1, $s0, inner
+place:	sw	$t5, 0($t1)
+	addiu	$t0, $t0, 1
+	bne	$t0, $s1, outer
+
+	addiu	$s7, $0, 0
+	addiu	$t0, $0, 1
+	addiu	$t1, $s0, 4
+check:	lw	$t5, -4($t1)
+	lw	$t6, 0($t1)
+	slt	$t7, $t6, $t5
+	addu	$s7, $s7, $t7
+	addiu	$t1, $t1, 4
+	addiu	$t0, $t0, 1
+	bne	$t0, $s1, check
+	addiu	$v0, $0, 10
+	syscall
@@ -0,0 +1,60 @@
+# matmul: C = A * B for 64x64 word matrices, then sum C into $s7.
+# MFLO is scheduled four instructions after MULTU.
+	lui	$s0, 0x1001		# A 0x10010000
+	lui	$s1, 0x1001
+	ori	$s1, $s1, 0x4000	# B 0x10014000
+	lui	$s2, 0x1001
+	ori	$s2, $s2, 0x8000	# C 0x10018000
+	addiu	$t0, $0, 0
+	addiu	$t1, $0, 4096
+init:	sll	$t2, $t0, 2
+	addu	$t3, $s0, $t2
+	andi	$t4, $t0, 15		# A[i] = (i & 15) + 1
+	addiu	$t4, $t4, 1
+	sw	$t4, 0($t3)
+	addu	$t3, $s1, $t2
+	xori	$t4, $t0, 5		# B[i] = (i ^ 5) & 31
+	andi	$t4, $t4, 31
+	sw	$t4, 0($t3)
+	addiu	$t0, $t0, 1
+	bne	$t0, $t1, init
+
+	addiu	$s3, $0, 0		# i
+iloop:	addiu	$s4, $0, 0		# j
+jloop:	sll	$t1, $s3, 8
+	addu	$t1, $t1, $s0		# &A[i][0]
+	sll	$t2, $s4, 2
+	addu	$t2, $t2, $s1		# &B[0][j]
+	addiu	$t3, $0, 0
+	addiu	$t0, $0, 64
+kloop:	lw	$t4, 0($t1)
+	lw	$t5, 0($t2)
+	multu	$t4, $t5
+	addiu	$t1, $t1, 4
+	addiu	$t2, $t2, 256
+	addiu	$t0, $t0, -1
+	mflo	$t6
+	addu	$t3, $t3, $t6
+	bgtz	$t0, kloop
+	sll	$t1, $s3, 8
+	sll	$t2, $s4, 2
+	addu	$t1, $t1, $t2
+	addu	$t1, $t1, $s2
+	sw	$t3, 0($t1)
+	addiu	$s4, $s4, 1
+	slti	$t7, $s4, 64
+	bne	$t7, $0, jloop
+	addiu	$s3, $s3, 1
+	slti	$t7, $s3, 64
+	bne	$t7, $0, iloop
+
+	addiu	$s7, $0, 0
+	move	$t1, $s2
+	addiu	$t0, $0, 4096
+sum:	lw	$t4, 0($t1)
+	addiu	$t1, $t1, 4
+	addiu	$t0, $t0, -1
+	addu	$s7, $s7, $t4
+	bgtz	$t0, sum
+	addiu	$v0, $0, 10
+	syscall
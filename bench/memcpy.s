@@ -0,0 +1,45 @@
+# memcpy: copy a 4KB block 1000 times, four words per iteration,
+# then sum the destination into $s7 (1578496 expected).
+	lui	$s0, 0x1001		# src 0x10010000
+	lui	$s1, 0x1001
+	ori	$s1, $s1, 0x2000	# dst 0x10012000
+	addiu	$t0, $0, 0
+	addiu	$t1, $0, 1024
+	move	$t2, $s0
+init:	sll	$t3, $t0, 1		# src[i] = 3i + 7
+	addu	$t3, $t3, $t0
+	addiu	$t3, $t3, 7
+	sw	$t3, 0($t2)
+	addiu	$t2, $t2, 4
+	addiu	$t0, $t0, 1
+	bne	$t0, $t1, init
+
+	addiu	$s2, $0, 1000
+rep:	move	$t2, $s0
+	move	$t4, $s1
+	addiu	$t0, $0, 256
+copy:	lw	$t5, 0($t2)
+	lw	$t6, 4($t2)
+	lw	$t7, 8($t2)
+	lw	$t8, 12($t2)
+	sw	$t5, 0($t4)
+	sw	$t6, 4($t4)
+	sw	$t7, 8($t4)
+	sw	$t8, 12($t4)
+	addiu	$t2, $t2, 16
+	addiu	$t4, $t4, 16
+	addiu	$t0, $t0, -1
+	bgtz	$t0, copy
+	addiu	$s2, $s2, -1
+	bgtz	$s2, rep
+
+	addiu	$s7, $0, 0
+	move	$t4, $s1
+	addiu	$t0, $0, 1024
+sum:	lw	$t5, 0($t4)
+	addiu	$t4, $t4, 4
+	addiu	$t0, $t0, -1
+	addu	$s7, $s7, $t5
+	bgtz	$t0, sum
+	addiu	$v0, $0, 10
+	syscall
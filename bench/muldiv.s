@@ -0,0 +1,27 @@
+# muldiv: hash-like mix of MULT/MULTU/DIV/DIVU for i = 1 .. 131071,
+# result in $s7. Every MFHI/MFLO reads the HI/LO just written.
+	lui	$s2, 0x9e37
+	ori	$s2, $s2, 0x79b1	# golden ratio multiplier
+	addiu	$s3, $0, -7
+	lui	$s1, 0x2
+	addiu	$s7, $0, 0
+	addiu	$t0, $0, 1		# i
+loop:	multu	$t0, $s2
+	mflo	$t1
+	mfhi	$t2
+	ori	$t3, $t0, 1
+	divu	$t1, $t3
+	mflo	$t4			# quotient
+	mfhi	$t5			# remainder
+	mult	$t4, $t5
+	mflo	$t6
+	div	$t6, $s3
+	mflo	$t7
+	mfhi	$t8
+	addu	$s7, $s7, $t7
+	xor	$s7, $s7, $t2
+	subu	$s7, $s7, $t8
+	addiu	$t0, $t0, 1
+	bne	$t0, $s1, loop
+	addiu	$v0, $0, 10
+	syscall
@@ -0,0 +1,139 @@
+#!/bin/sh
+# Run every workload in bench/ in pipelined and functional mode, report
+# host time, simulated instructions/s and cycles/s, and compare against
+# the baselines.
+#
+# usage: bench/run.sh [-u | -r]
+#	-u	rewrites bench/baseline.txt with this run's simulated counts
+#	-r	records this machine's host rates in HOST_BASELINE
+#
+# SIM            simulator binary (./mu-mips)
+# REPS           runs per workload and mode, the fastest is kept (5)
+# TOLERANCE      allowed slowdown against HOST_BASELINE, in percent (10)
+# HOST_BASELINE  host rates of this machine (bench/host-baseline.txt)
+#
+# bench/baseline.txt holds what the simulator computes, which is the same
+# on every host: instructions, cycles and stalls. A workload is flagged
+# CHANGED when any of them differs. Host speed is only compared against
+# rates recorded on the same machine (make bench-baseline); without
+# HOST_BASELINE the rates are printed but not checked. A workload is
+# flagged SLOWER when its instructions/s drop by more than TOLERANCE.
+# Either makes the script exit with status 1.
+
+SIM=${SIM:-./mu-mips}
+REPS=${REPS:-5}
+TOLERANCE=${TOLERANCE:-10}
+DIR=$(dirname "$0")
+BASELINE=$DIR/baseline.txt
+HOST_BASELINE=${HOST_BASELINE:-$DIR/host-baseline.txt}
+
+update=
+case "$1" in
+	-u|-r)
+		update=$1
+		;;
+esac
+
+json=$(mktemp)
+results=$(mktemp)
+trap 'rm -f "$json" "$results"' EXIT
+
+for workload in "$DIR"/*.in; do
+	name=$(basename "$workload" .in)
+	for mode in pipeline functional; do
+		rep=0
+		while [ $rep -lt "$REPS" ]; do
+			if ! "$SIM" -b -q -j "$json" -o mode=$mode -o forwarding=1 "$workload" > /dev/null; then
+				echo "$name ($mode): simulator failed" >&2
+				exit 1
+			fi
+			awk -v name="$name" -v mode="$mode" -F '[:,]' '
+				/"instructions"/ { instructions = $2 + 0 }
+				/"cycles"/ { cycles = $2 + 0 }
+				/"stalls_data"/ { data = $2 + 0 }
+				/"stalls_load_use"/ { load_use = $2 + 0 }
+				/"stalls_control"/ { control = $2 + 0 }
+				/"host_seconds"/ { seconds = $2 + 0 }
+				END { printf "%s %s %d %d %d %d %d %.6f\n", name, mode, instructions, cycles, data, load_use, control, seconds }
+			' "$json" >> "$results"
+			rep=$((rep + 1))
+		done
+	done
+done
+
+if [ "$update" = "-u" ]; then
+	{
+		echo "# workload mode instructions cycles stalls_data stalls_load_use stalls_control"
+		awk '!(($1 " " $2) in seen) { seen[$1 " " $2] = 1; print $1, $2, $3, $4, $5, $6, $7 }' "$results" | sort
+	} > "$BASELINE"
+	echo "Baseline written to $BASELINE"
+fi
+if [ "$update" = "-r" ]; then
+	{
+		echo "# workload mode instructions_per_second, on $(uname -n)"
+		awk '
+			{ key = $1 " " $2; if (!(key in best) || $8 < best[key]) { best[key] = $8; rate[key] = $3 / ($8 > 0 ? $8 : 1e-9) } }
+			END { for (key in rate) printf "%s %.0f\n", key, rate[key] }
+		' "$results" | sort
+	} > "$HOST_BASELINE"
+	echo "Host rates written to $HOST_BASELINE"
+fi
+
+touch "$BASELINE"
+[ -f "$HOST_BASELINE" ] || HOST_BASELINE=/dev/null
+awk -v tolerance="$TOLERANCE" '
+	FILENAME == ARGV[1] {
+		if ($1 !~ /^#/) {
+			base_counts[$1 " " $2] = $3 " " $4 " " $5 " " $6 " " $7
+		}
+		next
+	}
+	FILENAME == ARGV[2] {
+		if ($1 !~ /^#/) {
+			base_rate[$1 " " $2] = $3
+		}
+		next
+	}
+	{
+		key = $1 " " $2
+		if (!(key in seconds) || $8 < seconds[key]) {
+			seconds[key] = $8
+			instructions[key] = $3
+			cycles[key] = $4
+			counts[key] = $3 " " $4 " " $5 " " $6 " " $7
+			stalls[key] = $5 + $6 + $7
+		}
+		if (!(key in seen)) {
+			seen[key] = 1
+			order[n++] = key
+		}
+	}
+	END {
+		printf "%-10s %-10s %10s %10s %10s %9s %9s %9s %8s  %s\n", "workload", "mode", "instrs", "cycles", "stalls", "host(s)", "MIPS", "Mcyc/s", "vs host", "status"
+		failed = 0
+		for (i = 0; i < n; i++) {
+			key = order[i]
+			split(key, f, " ")
+			t = seconds[key] > 0 ? seconds[key] : 1e-9
+			rate = instructions[key] / t
+			change = "-"
+			status = "new"
+			if (key in base_counts) {
+				status = "ok"
+				if (counts[key] != base_counts[key]) {
+					status = "CHANGED"
+					failed = 1
+				}
+			}
+			if (key in base_rate) {
+				change = sprintf("%+.1f%%", (rate / base_rate[key] - 1) * 100)
+				if (rate < base_rate[key] * (1 - tolerance / 100) && status != "CHANGED") {
+					status = "SLOWER"
+					failed = 1
+				}
+			}
+			printf "%-10s %-10s %10d %10d %10d %9.4f %9.2f %9.2f %8s  %s\n", f[1], f[2], instructions[key], cycles[key], stalls[key], t, rate / 1e6, cycles[key] / t / 1e6, change, status
+		}
+		exit failed
+	}
+' "$BASELINE" "$HOST_BASELINE" "$results"
@@ -0,0 +1,60 @@
+#ifndef MU_MIPS_STATS_H
+#define MU_MIPS_STATS_H
+
+#include <stdint.h>
+#include <string.h>
+
+/***************************************************************/
+/* Live statistics shared between the simulator and mu-mips-top                */
+/* through a memory-mapped file. The simulator is the only writer; a        */
+/* sequence lock lets readers take consistent snapshots without ever        */
+/* blocking it: seq is odd while an update is in progress.                    */
+/***************************************************************/
+#define LIVE_MAGIC		0x564C554D	/* "MULV" */
+#define LIVE_VERSION	1
+#define LIVE_DEFAULT	100000		/* cycles between updates */
+
+typedef struct Live_Stats_Struct {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t seq;
+	uint32_t pid;				/* simulator process */
+	uint32_t running;			/* 0 once the program has exited */
+	uint32_t pc;				/* PC being fetched */
+	uint64_t cycles;
+	uint64_t instructions;
+	uint64_t data_stalls;
+	uint64_t load_use_stalls;
+	uint64_t control_stalls;
+	uint64_t flushes;
+	uint64_t forwards;
+	char program[256];
+} Live_Stats;
+
+/***************************************************************/
+/* writer: bracket every update of the fields after seq                            */
+/***************************************************************/
+static inline void live_write_begin(Live_Stats *live) {
+	__atomic_store_n(&live->seq, live->seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static inline void live_write_end(Live_Stats *live) {
+	__atomic_store_n(&live->seq, live->seq + 1, __ATOMIC_RELEASE);
+}
+
+/***************************************************************/
+/* reader: copy a consistent snapshot, retrying while a write overlaps  */
+/***************************************************************/
+static inline void live_read(Live_Stats *live, Live_Stats *snapshot) {
+	uint32_t before, after;
+
+	do {
+		before = __atomic_load_n(&live->seq, __ATOMIC_ACQUIRE);
+		memcpy(snapshot, live, sizeof(*snapshot));
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		after = __atomic_load_n(&live->seq, __ATOMIC_RELAXED);
+	} while ((before & 1) || before != after);
+}
+
+#endif
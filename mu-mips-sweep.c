@@ -0,0 +1,423 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+/***************************************************************/
+/* MU-MIPS design-space exploration driver                                                         */
+/*                                                                                                                                      */
+/* Runs the cartesian product of a parameter grid over a list of                */
+/* workloads, each run on its own batch-mode simulator process, and       */
+/* writes one table row per run. Finished runs are cached by a hash of   */
+/* the workload contents, the configuration and the simulator binary.    */
+/***************************************************************/
+
+#define MAX_PARAMS		16
+#define MAX_VALUES		32
+#define MAX_FIELDS		64
+
+typedef struct {
+	char *key;
+	char *values[MAX_VALUES];
+	int num_values;
+} param_t;
+
+typedef struct {
+	char *key;
+	char *value;
+	int quoted;				/* string in the result file, keep it a string */
+} field_t;
+
+typedef struct {
+	char *workload;
+	int config;				/* index into the parameter grid */
+	char result_file[512];
+	pid_t pid;
+	int cached;
+	int failed;
+	field_t fields[MAX_FIELDS];
+	int num_fields;
+} run_t;
+
+param_t PARAMS[MAX_PARAMS];
+int NUM_PARAMS;
+char *SIMULATOR = "./mu-mips";
+char *CACHE_DIR = NULL;
+
+/***************************************************************/
+/* Print usage                                                                                                                   */
+/***************************************************************/
+void usage(char *name) {
+	printf("Usage: %s [-s <simulator>] [-j <jobs>] [-c <cache dir>] [-f csv|json] [-o <output>]\n", name);
+	printf("\t\t-p key=v1,v2,... [-p ...] <workload>...\n\n");
+	printf("\t-s\tsimulator binary (default ./mu-mips)\n");
+	printf("\t-j\tnumber of simulator instances run in parallel (default: online CPUs)\n");
+	printf("\t-c\tdirectory caching results of previous runs\n");
+	printf("\t-f\toutput format (default csv)\n");
+	printf("\t-o\toutput file (default stdout)\n");
+	printf("\t-p\tparameter axis, passed to the simulator as -o key=value\n\n");
+	exit(1);
+}
+
+/***************************************************************/
+/* Value of parameter p in grid configuration <config>                             */
+/***************************************************************/
+char *config_value(int config, int p) {
+	int i;
+	for (i = NUM_PARAMS - 1; i > p; i--) {
+		config /= PARAMS[i].num_values;
+	}
+	return PARAMS[p].values[config % PARAMS[p].num_values];
+}
+
+/***************************************************************/
+/* FNV-1a over a buffer                                                                                          */
+/***************************************************************/
+uint64_t fnv1a(uint64_t hash, const void *data, size_t len) {
+	const uint8_t *p = data;
+	while (len--) {
+		hash ^= *p++;
+		hash *= 0x100000001B3ULL;
+	}
+	return hash;
+}
+
+/***************************************************************/
+/* Cache key: workload contents + configuration + simulator build     */
+/***************************************************************/
+uint64_t cache_key(run_t *run) {
+	uint64_t hash = 0xCBF29CE484222325ULL;
+	char buffer[4096];
+	struct stat st;
+	size_t n;
+	int p;
+	FILE *fp;
+
+	fp = fopen(run->workload, "rb");
+	if (fp != NULL) {
+		while ((n = fread(buffer, 1, sizeof(buffer), fp)) > 0) {
+			hash = fnv1a(hash, buffer, n);
+		}
+		fclose(fp);
+	}
+	for (p = 0; p < NUM_PARAMS; p++) {
+		hash = fnv1a(hash, PARAMS[p].key, strlen(PARAMS[p].key) + 1);
+		hash = fnv1a(hash, config_value(run->config, p), strlen(config_value(run->config, p)) + 1);
+	}
+	if (stat(SIMULATOR, &st) == 0) {
+		hash = fnv1a(hash, &st.st_size, sizeof(st.st_size));
+		hash = fnv1a(hash, &st.st_mtime, sizeof(st.st_mtime));
+	}
+	return hash;
+}
+
+/***************************************************************/
+/* Start one batch-mode simulator process                                                       */
+/***************************************************************/
+pid_t launch(run_t *run) {
+	char *argv[8 + 2 * MAX_PARAMS];
+	char options[MAX_PARAMS][256];
+	char tmp_file[520];
+	int argc = 0, p, fd;
+	pid_t pid;
+
+	snprintf(tmp_file, sizeof(tmp_file), "%s.tmp", run->result_file);
+	argv[argc++] = SIMULATOR;
+	argv[argc++] = "-b";
+	argv[argc++] = "-q";
+	argv[argc++] = "-j";
+	argv[argc++] = tmp_file;
+	for (p = 0; p < NUM_PARAMS; p++) {
+		snprintf(options[p], sizeof(options[p]), "%s=%s", PARAMS[p].key, config_value(run->config, p));
+		argv[argc++] = "-o";
+		argv[argc++] = options[p];
+	}
+	argv[argc++] = run->workload;
+	argv[argc] = NULL;
+
+	pid = fork();
+	if (pid == 0) {
+		fd = open("/dev/null", O_WRONLY);
+		if (fd >= 0) {
+			dup2(fd, STDOUT_FILENO);
+			dup2(fd, STDERR_FILENO);
+			close(fd);
+		}
+		execv(SIMULATOR, argv);
+		_exit(127);
+	}
+	return pid;
+}
+
+/***************************************************************/
+/* Parse the flat JSON object written by mu-mips -j                                      */
+/***************************************************************/
+int parse_result(run_t *run) {
+	char line[1024];
+	char *key, *end, *value;
+	FILE *fp;
+
+	fp = fopen(run->result_file, "r");
+	if (fp == NULL) {
+		return -1;
+	}
+	while (fgets(line, sizeof(line), fp) != NULL && run->num_fields < MAX_FIELDS) {
+		key = strchr(line, '"');
+		if (key == NULL) {
+			continue;
+		}
+		end = strchr(++key, '"');
+		if (end == NULL || strncmp(key, "program", end - key) == 0) {
+			continue;
+		}
+		*end = '\0';
+		value = end + 1;
+		value += strspn(value, ": \t");
+		run->fields[run->num_fields].quoted = *value == '"';
+		value += *value == '"';
+		value[strcspn(value, ",\"\r\n")] = '\0';
+		run->fields[run->num_fields].key = strdup(key);
+		run->fields[run->num_fields].value = strdup(value);
+		run->num_fields++;
+	}
+	fclose(fp);
+	return 0;
+}
+
+/***************************************************************/
+/* Result column of a run, or NULL                                                                      */
+/***************************************************************/
+field_t *find_field(run_t *run, char *key) {
+	int i;
+	for (i = 0; i < run->num_fields; i++) {
+		if (strcmp(run->fields[i].key, key) == 0) {
+			return &run->fields[i];
+		}
+	}
+	return NULL;
+}
+
+/***************************************************************/
+/* JSON numbers go out bare, anything else as a string                           */
+/***************************************************************/
+int json_number(field_t *field) {
+	char *end;
+	if (field->quoted || field->value[0] == '\0') {
+		return 0;
+	}
+	strtod(field->value, &end);
+	return *end == '\0' && strspn(field->value, "+-0123456789.eE") == strlen(field->value);
+}
+
+/***************************************************************/
+/* Write the result table                                                                                        */
+/***************************************************************/
+void write_table(FILE *out, int json, run_t *runs, int num_runs) {
+	char *columns[MAX_FIELDS];
+	int num_columns = 0;
+	int r, i, c, p;
+	field_t *field;
+
+	/* union of the result columns, in order of first appearance */
+	for (r = 0; r < num_runs; r++) {
+		for (i = 0; i < runs[r].num_fields; i++) {
+			for (c = 0; c < num_columns && strcmp(columns[c], runs[r].fields[i].key); c++);
+			for (p = 0; p < NUM_PARAMS && strcmp(PARAMS[p].key, runs[r].fields[i].key); p++);
+			if (c == num_columns && p == NUM_PARAMS && num_columns < MAX_FIELDS) {
+				columns[num_columns++] = runs[r].fields[i].key;
+			}
+		}
+	}
+
+	if (json) {
+		fprintf(out, "[\n");
+	}else {
+		fprintf(out, "workload");
+		for (p = 0; p < NUM_PARAMS; p++) {
+			fprintf(out, ",%s", PARAMS[p].key);
+		}
+		for (c = 0; c < num_columns; c++) {
+			fprintf(out, ",%s", columns[c]);
+		}
+		fprintf(out, ",status\n");
+	}
+
+	for (r = 0; r < num_runs; r++) {
+		char *status = runs[r].failed ? "failed" : (runs[r].cached ? "cached" : "ok");
+		if (json) {
+			fprintf(out, "\t{\"workload\": \"%s\"", runs[r].workload);
+			for (p = 0; p < NUM_PARAMS; p++) {
+				fprintf(out, ", \"%s\": \"%s\"", PARAMS[p].key, config_value(runs[r].config, p));
+			}
+			for (c = 0; c < num_columns; c++) {
+				field = find_field(&runs[r], columns[c]);
+				if (field != NULL) {
+					fprintf(out, json_number(field) ? ", \"%s\": %s" : ", \"%s\": \"%s\"", columns[c], field->value);
+				}
+			}
+			fprintf(out, ", \"status\": \"%s\"}%s\n", status, r + 1 < num_runs ? "," : "");
+		}else {
+			fprintf(out, "%s", runs[r].workload);
+			for (p = 0; p < NUM_PARAMS; p++) {
+				fprintf(out, ",%s", config_value(runs[r].config, p));
+			}
+			for (c = 0; c < num_columns; c++) {
+				field = find_field(&runs[r], columns[c]);
+				fprintf(out, ",%s", field ? field->value : "");
+			}
+			fprintf(out, ",%s\n", status);
+		}
+	}
+	if (json) {
+		fprintf(out, "]\n");
+	}
+}
+
+/***************************************************************/
+/* main                                                                                                                                   */
+/***************************************************************/
+int main(int argc, char *argv[]) {
+	char tmp_dir[] = "/tmp/mu-mips-sweep.XXXXXX";
+	char *output = NULL;
+	int jobs = sysconf(_SC_NPROCESSORS_ONLN);
+	int json = 0;
+	int num_configs = 1, num_runs, running = 0, next = 0, done = 0;
+	int opt, r, status;
+	run_t *runs;
+	pid_t pid;
+	FILE *out;
+
+	while ((opt = getopt(argc, argv, "s:j:c:f:o:p:")) != -1) {
+		switch (opt) {
+			case 's':
+				SIMULATOR = optarg;
+				break;
+			case 'j':
+				jobs = atoi(optarg);
+				break;
+			case 'c':
+				CACHE_DIR = optarg;
+				break;
+			case 'f':
+				json = strcmp(optarg, "json") == 0;
+				break;
+			case 'o':
+				output = optarg;
+				break;
+			case 'p':
+				if (NUM_PARAMS == MAX_PARAMS || strchr(optarg, '=') == NULL) {
+					usage(argv[0]);
+				}
+				PARAMS[NUM_PARAMS].key = optarg;
+				*strchr(optarg, '=') = '\0';
+				for (char *v = strtok(optarg + strlen(optarg) + 1, ","); v && PARAMS[NUM_PARAMS].num_values < MAX_VALUES; v = strtok(NULL, ",")) {
+					PARAMS[NUM_PARAMS].values[PARAMS[NUM_PARAMS].num_values++] = v;
+				}
+				if (PARAMS[NUM_PARAMS].num_values == 0) {
+					usage(argv[0]);
+				}
+				num_configs *= PARAMS[NUM_PARAMS].num_values;
+				NUM_PARAMS++;
+				break;
+			default:
+				usage(argv[0]);
+		}
+	}
+	if (optind >= argc) {
+		usage(argv[0]);
+	}
+	if (jobs < 1) {
+		jobs = 1;
+	}
+
+	if (CACHE_DIR == NULL) {
+		if (mkdtemp(tmp_dir) == NULL) {
+			printf("Error: can't create %s\n", tmp_dir);
+			exit(1);
+		}
+	}else if (mkdir(CACHE_DIR, 0777) != 0 && errno != EEXIST) {
+		printf("Error: can't create cache directory %s\n", CACHE_DIR);
+		exit(1);
+	}
+
+	num_runs = (argc - optind) * num_configs;
+	runs = calloc(num_runs, sizeof(run_t));
+	for (r = 0; r < num_runs; r++) {
+		runs[r].workload = argv[optind + r / num_configs];
+		runs[r].config = r % num_configs;
+		if (CACHE_DIR != NULL) {
+			snprintf(runs[r].result_file, sizeof(runs[r].result_file), "%s/%016llx.json", CACHE_DIR, (unsigned long long)cache_key(&runs[r]));
+			runs[r].cached = access(runs[r].result_file, R_OK) == 0;
+		}else {
+			snprintf(runs[r].result_file, sizeof(runs[r].result_file), "%s/run%d.json", tmp_dir, r);
+		}
+	}
+
+	/* keep <jobs> simulator instances busy until every run has finished */
+	while (done < num_runs) {
+		while (running < jobs && next < num_runs) {
+			if (runs[next].cached) {
+				done++;
+			}else if ((runs[next].pid = launch(&runs[next])) > 0) {
+				running++;
+			}else {
+				runs[next].failed = 1;
+				done++;
+			}
+			next++;
+		}
+		if (running == 0) {
+			continue;
+		}
+		pid = wait(&status);
+		if (pid < 0) {
+			break;
+		}
+		for (r = 0; r < num_runs && runs[r].pid != pid; r++);
+		if (r == num_runs) {
+			continue;
+		}
+		running--;
+		done++;
+		char tmp_file[520];
+		snprintf(tmp_file, sizeof(tmp_file), "%s.tmp", runs[r].result_file);
+		if (WIFEXITED(status) && WEXITSTATUS(status) == 0 && rename(tmp_file, runs[r].result_file) == 0) {
+			fprintf(stderr, "[%d/%d] %s done\n", done, num_runs, runs[r].workload);
+		}else {
+			unlink(tmp_file);
+			runs[r].failed = 1;
+			fprintf(stderr, "[%d/%d] %s failed\n", done, num_runs, runs[r].workload);
+		}
+	}
+
+	for (r = 0; r < num_runs; r++) {
+		if (!runs[r].failed && parse_result(&runs[r]) != 0) {
+			runs[r].failed = 1;
+		}
+	}
+
+	out = output ? fopen(output, "w") : stdout;
+	if (out == NULL) {
+		printf("Error: can't open %s\n", output);
+		exit(1);
+	}
+	write_table(out, json, runs, num_runs);
+	if (out != stdout) {
+		fclose(out);
+	}
+
+	if (CACHE_DIR == NULL) {
+		for (r = 0; r < num_runs; r++) {
+			unlink(runs[r].result_file);
+		}
+		rmdir(tmp_dir);
+	}
+	for (r = 0; r < num_runs && !runs[r].failed; r++);
+	return r == num_runs ? 0 : 1;
+}
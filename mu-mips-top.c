@@ -0,0 +1,126 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <errno.h>
+#include <signal.h>
+#include <sys/mman.h>
+
+#include "mu-mips-stats.h"
+
+/***************************************************************/
+/* MU-MIPS live monitor                                                                                                */
+/*                                                                                                                                      */
+/* Polls the statistics file a simulator started with -o live=<file>      */
+/* (or the live command) keeps up to date, and prints one line per poll    */
+/* with the rates since the previous one. Reading never stalls the          */
+/* simulator.                                                                                                                     */
+/***************************************************************/
+
+/***************************************************************/
+/* Print usage                                                                                                                   */
+/***************************************************************/
+void usage(char *name) {
+	printf("Usage: %s [-i <ms>] [-n <polls>] [-s <polls>] <stats file>\n\n", name);
+	printf("\t-i\tpoll interval in milliseconds (default 1000)\n");
+	printf("\t-n\tstop after <polls> lines (default: until the program exits)\n");
+	printf("\t-s\tstop after <polls> polls without an update (default 30, 0 = never)\n\n");
+	exit(1);
+}
+
+/***************************************************************/
+/* Monotonic host time in seconds                                                                     */
+/***************************************************************/
+double now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+int main(int argc, char *argv[]) {
+	int interval = 1000, polls = -1, lines = 0, stale_limit = 30, stale = 0, opt, fd;
+	Live_Stats *live, snapshot, last;
+	double poll_time, last_time, seconds;
+
+	while ((opt = getopt(argc, argv, "i:n:s:")) != -1) {
+		switch (opt) {
+			case 'i':
+				interval = atoi(optarg);
+				break;
+			case 'n':
+				polls = atoi(optarg);
+				break;
+			case 's':
+				stale_limit = atoi(optarg);
+				break;
+			default:
+				usage(argv[0]);
+		}
+	}
+	if (optind >= argc || interval <= 0) {
+		usage(argv[0]);
+	}
+
+	fd = open(argv[optind], O_RDONLY);
+	if (fd < 0) {
+		printf("Error: Can't open %s\n", argv[optind]);
+		exit(1);
+	}
+	live = mmap(NULL, sizeof(Live_Stats), PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (live == MAP_FAILED) {
+		printf("Error: Can't map %s\n", argv[optind]);
+		exit(1);
+	}
+	live_read(live, &last);
+	if (last.magic != LIVE_MAGIC || last.version != LIVE_VERSION) {
+		printf("Error: %s is not a MU-MIPS live statistics file\n", argv[optind]);
+		exit(1);
+	}
+	last.program[sizeof(last.program) - 1] = '\0';
+	printf("%s (pid %u)\n", last.program, last.pid);
+	last_time = now();
+
+	while (polls < 0 || lines < polls) {
+		if (last.running) {
+			usleep(interval * 1000);
+		}
+		live_read(live, &snapshot);
+		poll_time = now();
+		seconds = poll_time - last_time > 0 ? poll_time - last_time : 1e-9;
+
+		if (lines % 20 == 0) {
+			printf("%14s %14s %10s %7s %9s %9s %12s %12s %12s %12s\n", "cycles", "instrs", "PC", "CPI",
+				"MIPS", "Mcyc/s", "data", "load-use", "control", "flushes");
+		}
+		printf("%14lu %14lu 0x%08x %7.4f %9.2f %9.2f %12lu %12lu %12lu %12lu%s\n", (unsigned long)snapshot.cycles,
+			(unsigned long)snapshot.instructions, snapshot.pc,
+			snapshot.instructions ? (double)snapshot.cycles / snapshot.instructions : 0.0,
+			(snapshot.instructions - last.instructions) / seconds / 1e6,
+			(snapshot.cycles - last.cycles) / seconds / 1e6,
+			(unsigned long)snapshot.data_stalls, (unsigned long)snapshot.load_use_stalls,
+			(unsigned long)snapshot.control_stalls, (unsigned long)snapshot.flushes, snapshot.running ? "" : "  (exited)");
+		fflush(stdout);
+		lines++;
+		if (!snapshot.running) {
+			break;
+		}
+		/* a killed simulator never clears running */
+		if (kill(snapshot.pid, 0) != 0 && errno == ESRCH) {
+			printf("Simulator (pid %u) is gone\n", snapshot.pid);
+			break;
+		}
+		stale = snapshot.seq == last.seq ? stale + 1 : 0;
+		if (stale_limit > 0 && stale >= stale_limit) {
+			printf("No update in %d polls, giving up\n", stale);
+			break;
+		}
+		last = snapshot;
+		last_time = poll_time;
+	}
+	munmap(live, sizeof(Live_Stats));
+	return 0;
+}
@@ -1,8 +1,27 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <ctype.h>
 #include <stdint.h>
 #include <assert.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <poll.h>
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#if defined(HOST_PROFILE) && (defined(__x86_64__) || defined(__i386__))
+#include <x86intrin.h>
+#endif
 
 #include "mu-mips.h"
 
@@ -14,6 +33,16 @@ void help() {
 	printf("\t**********MU-MIPS Help MENU**********\n\n");
 	printf("sim\t-- simulate program to completion \n");
 	printf("run <n>\t-- simulate program for <n> instructions\n");
+	printf("run until <condition>\t-- simulate until e.g. $2 == 10 && cycles > 500 (==, !=, <, <=, >, >=, &&, ||;\n\t\t$<n>, pc, hi, lo, cycles, instructions)\n");
+	printf("break <address>\t-- stop before the instruction at <address> retires\n");
+	printf("break off\t-- remove all breakpoints\n");
+	printf("watch <address> <bytes> r|w|rw\t-- stop after a load (r) or store (w) touches [<address>, <address> + <bytes>)\n");
+	printf("watch off\t-- remove all watchpoints\n");
+	printf("checkpoint <n> [<MB>]\t-- checkpoint every <n> cycles for reverse execution, keeping up to <MB> of history\n");
+	printf("checkpoint off\t-- stop checkpointing and drop the history\n");
+	printf("rstep [<n>]\t-- go back <n> cycles (default 1)\n");
+	printf("rcontinue\t-- run backwards to the previous breakpoint or watchpoint stop\n");
+	printf("gdb <port>\t-- wait for gdb on localhost:<port> (target remote :<port>) and serve it until it detaches\n");
 	printf("rdump\t-- dump register values\n");
 	printf("reset\t-- clears all registers/memory and re-loads the program\n");
 	printf("input <reg> <val>\t-- set GPR <reg> to <val>\n");
@@ -22,28 +51,226 @@ void help() {
 	printf("low <val>\t-- set the LO register to <val>\n");
 	printf("print\t-- print the program loaded into memory\n");
 	printf("show\t-- print the current content of the pipeline registers\n");
-	printf("f x\t -- Turn forwarding flag ON: x = 1, Turn forwarding flag OFF: x = 0");
+	printf("trace record <file>\t-- record the retired instruction stream to <file>\n");
+	printf("trace replay <file>\t-- timing-only run of the pipeline driven by <file>\n");
+	printf("trace off\t-- stop recording/replaying\n");
+	printf("memtrace <file>\t-- record every fetch, load and store (cycle, PC, address, size) to <file>\n");
+	printf("memtrace replay <file>\t-- run a memory access trace through the L1 cache model\n");
+	printf("memtrace off\t-- stop recording memory accesses\n");
+	printf("batch <lanes> <out>\t-- run one instance per line of <lanes> in lockstep, results to <out>\n");
+	printf("mode pipeline|functional\t-- cycle-accurate pipeline or one instruction per cycle (select before running)\n");
+	printf("f x\t -- Turn forwarding flag ON: x = 1, Turn forwarding flag OFF: x = 0\n");
+	printf("stats\t-- print CPI and stall statistics\n");
+	printf("profile\t-- print host time per simulator stage (make PROFILE=1 builds)\n");
+	printf("hotspot on|off\t-- count retired instructions, stalls and flushes per guest PC\n");
+	printf("hotspot <n>\t-- print the <n> hottest instructions and basic blocks\n");
+	printf("hotspot dump <file>\t-- write folded stacks (block;pc cycles) for flamegraph.pl\n");
+	printf("cpi\t-- print the whole-program CPI stack\n");
+	printf("cpi on|off\t-- charge every cycle to its cause and guest PC\n");
+	printf("cpi <start> <stop>\t-- print the CPI stack of the instructions in [<start>, <stop>]\n");
+	printf("cpi func\t-- print a CPI stack per function (entry point and JAL targets)\n");
+	printf("interval <n> <file>\t-- write counter deltas every <n> cycles to <file> (CSV, binary if *.bin)\n");
+	printf("interval off\t-- write the last partial interval and close the file\n");
+	printf("live <file>\t-- publish live statistics to <file> for mu-mips-top\n");
+	printf("live off\t-- stop publishing\n");
+	printf("map <file> <address> [ro|cow]\t-- map <file> into guest data memory at <address>, read-only or copy-on-write\n");
+	printf("map off\t-- remove all file mappings\n");
+	printf("tlb <table> [<entries> <ways> <walk>]\t-- translate kseg2 (0xC0000000 up) through the page table at <table>\n");
+	printf("tlb off\t-- direct addressing everywhere\n");
+	printf("export <file> [<start> <stop>]\t-- write memory [<start>, <stop>], or every touched page, to an image\n");
+	printf("import <file>\t-- load an image into memory\n");
+	printf("diff <file> [<file2>]\t-- print the words that differ between an image and memory, or two images\n");
+	printf("intercept <routine> <address>\t-- run memcpy, memset or strlen at <address> on the host, returning to $ra\n");
+	printf("intercept off\t-- execute every routine as guest code\n");
+	printf("device <name> <address>\t-- map the uart, timer or counter at the page <address>, e.g. 0xffff0000\n");
+	printf("device off\t-- remove all devices\n");
 	printf("?\t-- display help menu\n");
 	printf("quit\t-- exit the simulator\n\n");
 	printf("------------------------------------------------------------------\n\n");
 }
 
+static const char *CPI_NAMES[NUM_STALL] = {
+	"base", "data", "load_use", "control", "structural", "memory", "fill"
+};
+
+static const char *MIX_NAMES[NUM_MIX] = {
+	"alu", "muldiv", "load", "store", "branch", "jump", "syscall"
+};
+
+#ifdef HOST_PROFILE
+static const char *PROF_NAMES[NUM_PROF] = {
+	"run", "wb", "mem", "ex", "id", "if", "functional", "decode", "mem_read", "mem_write", "trace"
+};
+
+#if defined(__x86_64__) || defined(__i386__)
+#define PROF_UNIT "TSC ticks"
+#else
+#define PROF_UNIT "ns"
+#endif
+
+/***************************************************************/
+/* Host timestamp for the profiling counters (TSC ticks or ns)               */
+/***************************************************************/
+static inline uint64_t prof_ticks() {
+#if defined(__x86_64__) || defined(__i386__)
+	return __rdtsc();
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
+#endif
+
+
+/***************************************************************/
+/* Fill the decode tables from the instruction list                                  */
+/***************************************************************/
+void decode_init() {
+	static const struct { int opcode, function; } encodings[NUM_INSTRUCTIONS] = {
+#define INSTRUCTION_ENCODING(name, op, fn, format, dest, reads, mix, kind, value)	[INS_##name] = { op, fn },
+		MIPS_INSTRUCTIONS(INSTRUCTION_ENCODING)
+#undef INSTRUCTION_ENCODING
+	};
+	int id;
+
+	for (id = INS_INVALID + 1; id < NUM_INSTRUCTIONS; id++) {
+		if (encodings[id].opcode == 0x00) {
+			DECODE_SPECIAL[encodings[id].function] = id;
+		}else if (encodings[id].opcode == 0x01) {
+			DECODE_REGIMM[encodings[id].function] = id;
+		}else {
+			DECODE_PRIMARY[encodings[id].opcode] = id;
+		}
+	}
+}
+
+/***************************************************************/
+/* INS_* id of an instruction word                                                                        */
+/***************************************************************/
+static inline uint32_t decode(uint32_t instruction) {
+	uint32_t opcode = instruction >> 26;
+
+	if (opcode == 0x00) {
+		return DECODE_SPECIAL[instruction & 0x3F];
+	}
+	if (opcode == 0x01) {
+		return DECODE_REGIMM[(instruction >> 16) & 0x1F];
+	}
+	return DECODE_PRIMARY[opcode];
+}
+
+/***************************************************************/
+/* DIV/DIVU as HI:LO (remainder:quotient); unchanged on divide by zero */
+/* or overflow                                                                                                           */
+/***************************************************************/
+static inline uint64_t mips_div(uint32_t a, uint32_t b, uint32_t hi, uint32_t lo) {
+	if (b == 0 || ((int32_t)a == INT32_MIN && (int32_t)b == -1)) {
+		return (uint64_t)hi << 32 | lo;
+	}
+	return (uint64_t)(uint32_t)((int32_t)a % (int32_t)b) << 32 | (uint32_t)((int32_t)a / (int32_t)b);
+}
+
+static inline uint64_t mips_divu(uint32_t a, uint32_t b, uint32_t hi, uint32_t lo) {
+	if (b == 0) {
+		return (uint64_t)hi << 32 | lo;
+	}
+	return (uint64_t)(a % b) << 32 | (a / b);
+}
+
+/***************************************************************/
+/* write an instruction's result to its DEST_* register(s); HILO takes  */
+/* HI in the upper word. Writes to $zero are dropped.                           */
+/***************************************************************/
+static inline void write_dest(int dest, uint32_t instruction, uint64_t value) {
+	uint32_t rd = (instruction & 0xF800) >> 11, rt = (instruction & 0x1F0000) >> 16;
+
+	switch (dest) {
+		case DEST_RD:
+			if (rd) {
+				NEXT_STATE.REGS[rd] = value;
+				STATE_DIRTY |= 1u << rd;
+			}
+			break;
+		case DEST_RT:
+			if (rt) {
+				NEXT_STATE.REGS[rt] = value;
+				STATE_DIRTY |= 1u << rt;
+			}
+			break;
+		case DEST_RA:
+			NEXT_STATE.REGS[31] = value;
+			STATE_DIRTY |= 1u << 31;
+			break;
+		case DEST_HI:
+			NEXT_STATE.HI = value;
+			break;
+		case DEST_LO:
+			NEXT_STATE.LO = value;
+			break;
+		case DEST_HILO:
+			NEXT_STATE.HI = value >> 32;
+			NEXT_STATE.LO = value;
+			break;
+	}
+}
+
+/***************************************************************/
+/* does a store of size bytes touch a read-only file mapping; the host    */
+/* mapping, and so the range, runs to the end of the file's last page   */
+/***************************************************************/
+static int mem_store_dropped(uint32_t address, uint32_t size)
+{
+	int i;
+	for (i = 0; i < NUM_MAPPINGS; i++) {
+		if (MAPPINGS[i].mode == MAP_READONLY && address <= (MAPPINGS[i].end | (MAP_PAGE - 1)) &&
+			address + size - 1 >= MAPPINGS[i].begin) {
+			if (!MAPPINGS[i].warned) {
+				printf("Warning: store to read-only mapping of %s at 0x%08x dropped\n", MAPPINGS[i].file, address);
+				MAPPINGS[i].warned = TRUE;
+			}
+			return TRUE;
+		}
+	}
+	return FALSE;
+}
+
+/***************************************************************/
+/* note the page a store is about to change, and save it for reverse     */
+/* execution                                                                                                          */
+/***************************************************************/
+static inline void mem_store_page(uint32_t address)
+{
+	MEM_TOUCHED[address >> MMU_PAGE_SHIFT] = 1;
+	if (CHECKPOINT_PAGES != NULL && !CHECKPOINT_PAGES[address >> MMU_PAGE_SHIFT]) {
+		checkpoint_page(address);
+	}
+}
+
 /***************************************************************/
 /* Read a 32-bit word from memory                                                                            */
 /***************************************************************/
 uint32_t mem_read_32(uint32_t address)
 {
 	int i;
+	uint32_t value = 0;
+	PROF_START();
 	for (i = 0; i < NUM_MEM_REGION; i++) {
 		if ( (address >= MEM_REGIONS[i].begin) &&  ( address <= MEM_REGIONS[i].end) ) {
 			uint32_t offset = address - MEM_REGIONS[i].begin;
-			return (MEM_REGIONS[i].mem[offset+3] << 24) |
+			value = (MEM_REGIONS[i].mem[offset+3] << 24) |
 					(MEM_REGIONS[i].mem[offset+2] << 16) |
 					(MEM_REGIONS[i].mem[offset+1] <<  8) |
 					(MEM_REGIONS[i].mem[offset+0] <<  0);
+			break;
 		}
 	}
-	return 0;
+	/* only an address no region holds can be a device */
+	if (i == NUM_MEM_REGION && DEVICE_PAGES != NULL) {
+		value = device_read(address);
+	}
+	PROF_STOP(PROF_MEM_READ);
+	return value;
 }
 
 /***************************************************************/
@@ -53,6 +280,11 @@ void mem_write_32(uint32_t address, uint32_t value)
 {
 	int i;
 	uint32_t offset;
+	if (READONLY_MAPPINGS && mem_store_dropped(address, 4)) {
+		return;
+	}
+	mem_store_page(address);
+	PROF_START();
 	for (i = 0; i < NUM_MEM_REGION; i++) {
 		if ( (address >= MEM_REGIONS[i].begin) && (address <= MEM_REGIONS[i].end) ) {
 			offset = address - MEM_REGIONS[i].begin;
@@ -61,17 +293,415 @@ void mem_write_32(uint32_t address, uint32_t value)
 			MEM_REGIONS[i].mem[offset+2] = (value >> 16) & 0xFF;
 			MEM_REGIONS[i].mem[offset+1] = (value >>  8) & 0xFF;
 			MEM_REGIONS[i].mem[offset+0] = (value >>  0) & 0xFF;
+			break;
+		}
+	}
+	if (i == NUM_MEM_REGION && DEVICE_PAGES != NULL) {
+		device_write(address, value);
+	}
+	PROF_STOP(PROF_MEM_WRITE);
+}
+
+/***************************************************************/
+/* Host byte backing a guest address, NULL if it is not mapped             */
+/***************************************************************/
+static inline uint8_t *mem_host(uint32_t address)
+{
+	int i;
+	for (i = 0; i < NUM_MEM_REGION; i++) {
+		if ( (address >= MEM_REGIONS[i].begin) && (address <= MEM_REGIONS[i].end) ) {
+			return &MEM_REGIONS[i].mem[address - MEM_REGIONS[i].begin];
+		}
+	}
+	return NULL;
+}
+
+/***************************************************************/
+/* Read a byte / halfword from memory                                                                   */
+/***************************************************************/
+uint8_t mem_read_8(uint32_t address)
+{
+	uint8_t value = 0;
+	PROF_START();
+	uint8_t *host = mem_host(address);
+	if (host != NULL) {
+		value = host[0];
+	}else if (DEVICE_PAGES != NULL) {
+		value = device_read(address);
+	}
+	PROF_STOP(PROF_MEM_READ);
+	return value;
+}
+
+uint16_t mem_read_16(uint32_t address)
+{
+	uint16_t value = 0;
+	PROF_START();
+	/* the second byte may fall past the end of the region, or in the next one */
+	uint8_t *host = mem_host(address), *next = mem_host(address + 1);
+	if (host != NULL) {
+		value = host[0] | (next != NULL ? next[0] << 8 : 0);
+	}else if (DEVICE_PAGES != NULL) {
+		value = device_read(address);
+	}
+	PROF_STOP(PROF_MEM_READ);
+	return value;
+}
+
+/***************************************************************/
+/* Write a byte / halfword to memory                                                                      */
+/***************************************************************/
+void mem_write_8(uint32_t address, uint8_t value)
+{
+	if (READONLY_MAPPINGS && mem_store_dropped(address, 1)) {
+		return;
+	}
+	mem_store_page(address);
+	PROF_START();
+	uint8_t *host = mem_host(address);
+	if (host != NULL) {
+		host[0] = value;
+	}else if (DEVICE_PAGES != NULL) {
+		device_write(address, value);
+	}
+	PROF_STOP(PROF_MEM_WRITE);
+}
+
+void mem_write_16(uint32_t address, uint16_t value)
+{
+	if (READONLY_MAPPINGS && mem_store_dropped(address, 2)) {
+		return;
+	}
+	mem_store_page(address);
+	PROF_START();
+	uint8_t *host = mem_host(address), *next = mem_host(address + 1);
+	if (host != NULL) {
+		host[0] = value & 0xFF;
+		if (next != NULL) {
+			next[0] = value >> 8;
+		}
+	}else if (DEVICE_PAGES != NULL) {
+		device_write(address, value);
+	}
+	PROF_STOP(PROF_MEM_WRITE);
+}
+
+/***************************************************************/
+/* Guest console output, written in CONSOLE_BUFFER sized chunks          */
+/***************************************************************/
+static char CONSOLE[CONSOLE_BUFFER];
+static uint32_t CONSOLE_LENGTH;
+
+void console_flush() {
+	if (CONSOLE_LENGTH) {
+		fwrite(CONSOLE, 1, CONSOLE_LENGTH, stdout);
+		CONSOLE_LENGTH = 0;
+	}
+	fflush(stdout);
+}
+
+static void console_write(const char *data, uint32_t length) {
+	/* replaying history repeats output the user has already seen */
+	if (REPLAYING) {
+		return;
+	}
+	if (CONSOLE_LENGTH + length > CONSOLE_BUFFER) {
+		console_flush();
+	}
+	if (length >= CONSOLE_BUFFER) {
+		fwrite(data, 1, length, stdout);
+	}else {
+		memcpy(CONSOLE + CONSOLE_LENGTH, data, length);
+		CONSOLE_LENGTH += length;
+	}
+	/* keep guest output in order with the retired instruction trace */
+	if (TRACE_LEVEL) {
+		console_flush();
+	}
+}
+
+/***************************************************************/
+/* host fd behind a guest fd, -1 if it is not open                                       */
+/***************************************************************/
+static int guest_file(uint32_t fd) {
+	return fd < MAX_GUEST_FILES ? GUEST_FILES[fd] : -1;
+}
+
+static void sys_print_int() {
+	char text[16];
+
+	console_write(text, snprintf(text, sizeof(text), "%d", (int32_t)NEXT_STATE.REGS[4]));
+}
+
+static void sys_print_string() {
+	char text[256];
+	uint32_t address = NEXT_STATE.REGS[4];
+	uint32_t length = 0;
+	char c;
+
+	while ((c = mem_read_8(address++)) != '\0') {
+		text[length++] = c;
+		if (length == sizeof(text)) {
+			console_write(text, length);
+			length = 0;
 		}
 	}
+	console_write(text, length);
+}
+
+static void sys_read_int() {
+	int value = 0;
+
+	console_flush();
+	if (scanf("%d", &value) != 1) {
+		value = 0;
+	}
+	NEXT_STATE.REGS[2] = value;
+}
+
+static void sys_sbrk() {
+	/* keep the break word aligned */
+	int64_t increment = ((int64_t)(int32_t)NEXT_STATE.REGS[4] + 3) & ~(int64_t)3;
+	int64_t end = (int64_t)HEAP_BREAK + increment;
+
+	if (end < MEM_DATA_BEGIN || end > (int64_t)MEM_DATA_END + 1) {
+		NEXT_STATE.REGS[2] = (uint32_t)-1;
+		return;
+	}
+	NEXT_STATE.REGS[2] = HEAP_BREAK;
+	HEAP_BREAK = (uint32_t)end;
+}
+
+static void sys_exit() {
+	RUN_FLAG = FALSE;
+	console_flush();
+}
+
+static void sys_print_char() {
+	char c = NEXT_STATE.REGS[4] & 0xFF;
+
+	console_write(&c, 1);
+}
+
+static void sys_open() {
+	char path[256];
+	uint32_t address = NEXT_STATE.REGS[4];
+	uint32_t flags = NEXT_STATE.REGS[5];
+	uint32_t i, fd;
+	int host_flags;
+
+	for (i = 0; i < sizeof(path) - 1 && (path[i] = mem_read_8(address + i)) != '\0'; i++);
+	path[i] = '\0';
+	NEXT_STATE.REGS[2] = (uint32_t)-1;
+
+	for (fd = 3; fd < MAX_GUEST_FILES && GUEST_FILES[fd] >= 0; fd++);
+	if (fd == MAX_GUEST_FILES) {
+		return;
+	}
+	if (flags & 1) {
+		host_flags = O_WRONLY | O_CREAT | ((flags & 8) ? O_APPEND : O_TRUNC);
+	}else {
+		host_flags = O_RDONLY;
+	}
+	GUEST_FILES[fd] = open(path, host_flags, 0644);
+	if (GUEST_FILES[fd] >= 0) {
+		NEXT_STATE.REGS[2] = fd;
+	}
+}
+
+static void sys_read() {
+	char buffer[4096];
+	uint32_t fd = NEXT_STATE.REGS[4];
+	uint32_t address = NEXT_STATE.REGS[5];
+	uint32_t length = NEXT_STATE.REGS[6];
+	uint32_t total = 0, i;
+	int host = guest_file(fd), c;
+	ssize_t n;
+
+	if (host < 0) {
+		NEXT_STATE.REGS[2] = (uint32_t)-1;
+		return;
+	}
+	if (host == 0) {
+		/* console input goes through stdio, like the command line, one line at a time */
+		console_flush();
+		while (total < length && (c = getchar()) != EOF) {
+			mem_write_8(address + total++, c);
+			if (c == '\n') {
+				break;
+			}
+		}
+		NEXT_STATE.REGS[2] = total;
+		return;
+	}
+	while (total < length) {
+		n = read(host, buffer, length - total < sizeof(buffer) ? length - total : sizeof(buffer));
+		if (n < 0) {
+			NEXT_STATE.REGS[2] = (uint32_t)-1;
+			return;
+		}
+		for (i = 0; i < n; i++) {
+			mem_write_8(address + total + i, buffer[i]);
+		}
+		total += n;
+		if (n < sizeof(buffer)) {
+			break;
+		}
+	}
+	NEXT_STATE.REGS[2] = total;
+}
+
+static void sys_write() {
+	char buffer[4096];
+	uint32_t fd = NEXT_STATE.REGS[4];
+	uint32_t address = NEXT_STATE.REGS[5];
+	uint32_t length = NEXT_STATE.REGS[6];
+	uint32_t total = 0, chunk, i;
+	int host = guest_file(fd);
+
+	if (host < 0) {
+		NEXT_STATE.REGS[2] = (uint32_t)-1;
+		return;
+	}
+	if (host == 2) {
+		console_flush();
+	}
+	while (total < length) {
+		chunk = length - total < sizeof(buffer) ? length - total : sizeof(buffer);
+		for (i = 0; i < chunk; i++) {
+			buffer[i] = mem_read_8(address + total + i);
+		}
+		if (host == 1) {
+			console_write(buffer, chunk);
+		}else if (host == 2) {
+			if (!REPLAYING) {
+				fwrite(buffer, 1, chunk, stderr);
+			}
+		}else if (write(host, buffer, chunk) != chunk) {
+			NEXT_STATE.REGS[2] = (uint32_t)-1;
+			return;
+		}
+		total += chunk;
+	}
+	NEXT_STATE.REGS[2] = total;
+}
+
+static void sys_close() {
+	uint32_t fd = NEXT_STATE.REGS[4];
+
+	/* the console stays open */
+	if (fd < 3 || guest_file(fd) < 0) {
+		NEXT_STATE.REGS[2] = fd < 3 ? 0 : (uint32_t)-1;
+		return;
+	}
+	NEXT_STATE.REGS[2] = close(GUEST_FILES[fd]) == 0 ? 0 : (uint32_t)-1;
+	GUEST_FILES[fd] = -1;
+}
+
+typedef void (*Syscall_Handler)();
+
+static Syscall_Handler SYSCALL_TABLE[NUM_SYSCALLS] = {
+	[SYS_PRINT_INT] = sys_print_int,
+	[SYS_PRINT_STRING] = sys_print_string,
+	[SYS_READ_INT] = sys_read_int,
+	[SYS_SBRK] = sys_sbrk,
+	[SYS_EXIT] = sys_exit,
+	[SYS_PRINT_CHAR] = sys_print_char,
+	[SYS_OPEN] = sys_open,
+	[SYS_READ] = sys_read,
+	[SYS_WRITE] = sys_write,
+	[SYS_CLOSE] = sys_close,
+};
+
+/***************************************************************/
+/* Perform system call <number>; arguments and results are in NEXT_STATE */
+/***************************************************************/
+void syscall_execute(uint32_t number) {
+	/* host input and files can't be replayed: history starts over after them */
+	if (CHECKPOINT_CYCLES && !REPLAYING && (number == SYS_READ_INT || number == SYS_OPEN || number == SYS_READ ||
+		number == SYS_CLOSE || (number == SYS_WRITE && guest_file(NEXT_STATE.REGS[4]) > 2))) {
+		checkpoint_forget();
+	}
+	if (number < NUM_SYSCALLS && SYSCALL_TABLE[number] != NULL) {
+		SYSCALL_TABLE[number]();
+		STATE_DIRTY |= 1u << 2;	/* results come back in $v0 */
+	}else {
+		printf("Warning: unsupported syscall %u ignored\n", number);
+	}
+}
+
+/***************************************************************/
+/* Close guest files and empty the heap                                                           */
+/***************************************************************/
+void syscall_reset() {
+	int fd;
+
+	console_flush();
+	for (fd = 0; fd < MAX_GUEST_FILES; fd++) {
+		/* never the console: the table is all zero before the first reset */
+		if (fd >= 3 && GUEST_FILES[fd] > 2) {
+			close(GUEST_FILES[fd]);
+		}
+		GUEST_FILES[fd] = fd < 3 ? fd : -1;
+	}
+	HEAP_BREAK = MEM_DATA_BEGIN;
+}
+
+/***************************************************************/
+/* Cycle boundary: NEXT_STATE becomes CURRENT_STATE by swapping the      */
+/* buffers. The old current buffer is the new NEXT_STATE; it only lacks  */
+/* what was written this cycle: PC, HI, LO and the STATE_DIRTY registers. */
+/***************************************************************/
+static inline void state_commit() {
+	CPU_State *state = CURRENT_STATE_PTR;
+	uint32_t dirty = STATE_DIRTY;
+
+	CURRENT_STATE_PTR = NEXT_STATE_PTR;
+	NEXT_STATE_PTR = state;
+	state->PC = CURRENT_STATE.PC;
+	state->HI = CURRENT_STATE.HI;
+	state->LO = CURRENT_STATE.LO;
+	while (dirty) {
+		state->REGS[__builtin_ctz(dirty)] = CURRENT_STATE.REGS[__builtin_ctz(dirty)];
+		dirty &= dirty - 1;
+	}
+	STATE_DIRTY = 0;
 }
 
 /***************************************************************/
 /* Execute one cycle                                                                                                              */
 /***************************************************************/
 void cycle() {                                                
-	handle_pipeline();
-	CURRENT_STATE = NEXT_STATE;
+	if (SIM_MODE == MODE_FUNCTIONAL) {
+		PROF_START();
+		functional_step();
+		PROF_STOP(PROF_FUNCTIONAL);
+	}else {
+		PIPELINE_CYCLE();
+	}
+	state_commit();
 	CYCLE_COUNT++;
+	if (INTERVAL_FILE != NULL && --INTERVAL_LEFT == 0) {
+		interval_sample();
+	}
+	if (LIVE != NULL && --LIVE_LEFT == 0) {
+		live_publish();
+	}
+	if (CYCLE_COUNT >= DEVICE_NEXT) {
+		device_tick();
+	}
+	if (CHECKPOINT_CYCLES && --CHECKPOINT_LEFT == 0) {
+		checkpoint_take();
+	}
+}
+
+/***************************************************************/
+/* Host wall-clock time in seconds                                                                      */
+/***************************************************************/
+static double host_time() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
 }
 
 /***************************************************************/
@@ -85,13 +715,30 @@ void run(int num_cycles) {
 	}
 
 	printf("Running simulator for %d cycles...\n\n", num_cycles);
+	double start = host_time();
+	PROF_START();
 	int i;
 	for (i = 0; i < num_cycles; i++) {
 		if (RUN_FLAG == FALSE) {
 			printf("Simulation Stopped.\n\n");
 			break;
 		}
+		if (DEBUG_ARMED && debug_stop()) {
+			break;
+		}
+		if (MEMORY_WAIT > 1) {
+			i += cycle_skip(num_cycles - i - 1);
+		}
 		cycle();
+		if (SPIN_BRANCH) {
+			i += spin_skip(num_cycles - i - 1);
+		}
+	}
+	PROF_STOP(PROF_RUN);
+	STATS.HOST_SECONDS += host_time() - start;
+	console_flush();
+	if (LIVE != NULL) {
+		live_publish();
 	}
 }
 
@@ -105,10 +752,29 @@ void runAll() {
 	}
 
 	printf("Simulation Started...\n\n");
+	double start = host_time();
+	PROF_START();
 	while (RUN_FLAG){
+		if (DEBUG_ARMED && debug_stop()) {
+			break;
+		}
+		if (MEMORY_WAIT > 1) {
+			cycle_skip(UINT32_MAX);
+		}
 		cycle();
+		if (SPIN_BRANCH) {
+			spin_skip(UINT32_MAX);
+		}
+	}
+	PROF_STOP(PROF_RUN);
+	STATS.HOST_SECONDS += host_time() - start;
+	console_flush();
+	if (LIVE != NULL) {
+		live_publish();
+	}
+	if (!RUN_FLAG) {
+		printf("Simulation Finished.\n\n");
 	}
-	printf("Simulation Finished.\n\n");
 }
 
 /***************************************************************/ 
@@ -150,11 +816,118 @@ void rdump() {
 	printf("-------------------------------------\n");
 }
 
+/***************************************************************/
+/* Print CPI and stall statistics                                                                              */
+/***************************************************************/
+void print_stats() {
+	printf("-------------------------------------\n");
+	printf("Simulation Statistics\n");
+	printf("-------------------------------------\n");
+	printf("# Cycles\t\t: %u\n", CYCLE_COUNT);
+	printf("# Instructions\t\t: %u\n", INSTRUCTION_COUNT);
+	printf("CPI\t\t\t: %.4f\n", INSTRUCTION_COUNT ? (double)CYCLE_COUNT / INSTRUCTION_COUNT : 0.0);
+	printf("Data stalls\t\t: %lu\n", (unsigned long)STATS.DATA_STALLS);
+	printf("Load-use stalls\t\t: %lu\n", (unsigned long)STATS.LOAD_USE_STALLS);
+	printf("Control stalls\t\t: %lu\n", (unsigned long)STATS.CONTROL_STALLS);
+	printf("Forwarded operands\t: %lu\n", (unsigned long)STATS.FORWARDS);
+	printf("Flushes\t\t\t: %lu\n", (unsigned long)STATS.FLUSHES);
+	if (MMU.enabled) {
+		printf("TLB lookups\t\t: %lu\n", (unsigned long)STATS.TLB_LOOKUPS);
+		printf("TLB misses\t\t: %lu\n", (unsigned long)STATS.TLB_MISSES);
+		printf("TLB faults\t\t: %lu\n", (unsigned long)STATS.TLB_FAULTS);
+		printf("Memory stall cycles\t: %lu\n", (unsigned long)STATS.CPI_STACK[STALL_MEMORY]);
+	}
+	if (STATS.SKIPPED_CYCLES) {
+		printf("Fast-forwarded cycles\t: %lu\n", (unsigned long)STATS.SKIPPED_CYCLES);
+	}
+	if (STATS.SPIN_ITERATIONS) {
+		printf("Spin iterations skipped\t: %lu\n", (unsigned long)STATS.SPIN_ITERATIONS);
+	}
+	if (STATS.INTERCEPTED_CALLS) {
+		printf("Intercepted calls\t: %lu\n", (unsigned long)STATS.INTERCEPTED_CALLS);
+		printf("Intercepted bytes\t: %lu\n", (unsigned long)STATS.INTERCEPTED_BYTES);
+	}
+	printf("Host time (s)\t\t: %.6f\n", STATS.HOST_SECONDS);
+	printf("-------------------------------------\n");
+}
+
+/***************************************************************/
+/* Write the statistics as a flat JSON object (batch mode)                        */
+/***************************************************************/
+void print_stats_json(FILE *fp) {
+	char *c;
+	int i;
+
+	fprintf(fp, "{\n\t\"program\": \"");
+	for (c = prog_file; *c; c++) {
+		if (*c == '"' || *c == '\\') {
+			fputc('\\', fp);
+		}
+		fputc(*c, fp);
+	}
+	fprintf(fp, "\",\n");
+	fprintf(fp, "\t\"mode\": \"%s\",\n", SIM_MODE == MODE_FUNCTIONAL ? "functional" : "pipeline");
+	fprintf(fp, "\t\"forwarding\": %d,\n", ENABLE_FORWARDING);
+	fprintf(fp, "\t\"cycles\": %u,\n", CYCLE_COUNT);
+	fprintf(fp, "\t\"instructions\": %u,\n", INSTRUCTION_COUNT);
+	fprintf(fp, "\t\"cpi\": %.6f,\n", INSTRUCTION_COUNT ? (double)CYCLE_COUNT / INSTRUCTION_COUNT : 0.0);
+	fprintf(fp, "\t\"stalls_data\": %lu,\n", (unsigned long)STATS.DATA_STALLS);
+	fprintf(fp, "\t\"stalls_load_use\": %lu,\n", (unsigned long)STATS.LOAD_USE_STALLS);
+	fprintf(fp, "\t\"stalls_control\": %lu,\n", (unsigned long)STATS.CONTROL_STALLS);
+	fprintf(fp, "\t\"forwards\": %lu,\n", (unsigned long)STATS.FORWARDS);
+	fprintf(fp, "\t\"flushes\": %lu,\n", (unsigned long)STATS.FLUSHES);
+	fprintf(fp, "\t\"tlb_lookups\": %lu,\n", (unsigned long)STATS.TLB_LOOKUPS);
+	fprintf(fp, "\t\"tlb_misses\": %lu,\n", (unsigned long)STATS.TLB_MISSES);
+	fprintf(fp, "\t\"tlb_faults\": %lu,\n", (unsigned long)STATS.TLB_FAULTS);
+	fprintf(fp, "\t\"cycles_skipped\": %lu,\n", (unsigned long)STATS.SKIPPED_CYCLES);
+	fprintf(fp, "\t\"spin_iterations_skipped\": %lu,\n", (unsigned long)STATS.SPIN_ITERATIONS);
+	fprintf(fp, "\t\"intercepted_calls\": %lu,\n", (unsigned long)STATS.INTERCEPTED_CALLS);
+	fprintf(fp, "\t\"intercepted_bytes\": %lu,\n", (unsigned long)STATS.INTERCEPTED_BYTES);
+	for (i = 0; i < NUM_MIX; i++) {
+		fprintf(fp, "\t\"mix_%s\": %lu,\n", MIX_NAMES[i], (unsigned long)STATS.MIX[i]);
+	}
+	for (i = 0; i < NUM_STALL; i++) {
+		fprintf(fp, "\t\"cpi_stack_%s\": %lu,\n", CPI_NAMES[i], (unsigned long)STATS.CPI_STACK[i]);
+	}
+	fprintf(fp, "\t\"host_seconds\": %.6f", STATS.HOST_SECONDS);
+#ifdef HOST_PROFILE
+	for (i = 0; i < NUM_PROF; i++) {
+		fprintf(fp, ",\n\t\"prof_%s_ticks\": %lu", PROF_NAMES[i], (unsigned long)PROF[i].ticks);
+		fprintf(fp, ",\n\t\"prof_%s_calls\": %lu", PROF_NAMES[i], (unsigned long)PROF[i].calls);
+	}
+#endif
+	fprintf(fp, "\n}\n");
+}
+
+/***************************************************************/
+/* Print the host profiling counters                                                                      */
+/***************************************************************/
+void print_profile() {
+#ifdef HOST_PROFILE
+	int i;
+	double run = PROF[PROF_RUN].ticks ? (double)PROF[PROF_RUN].ticks : 1.0;
+
+	printf("-------------------------------------\n");
+	printf("Host Profile (%s)\n", PROF_UNIT);
+	printf("-------------------------------------\n");
+	printf("%-12s %12s %16s %12s %7s\n", "section", "calls", "ticks", "per call", "% run");
+	for (i = 0; i < NUM_PROF; i++) {
+		printf("%-12s %12lu %16lu %12.1f %6.1f%%\n", PROF_NAMES[i], (unsigned long)PROF[i].calls, (unsigned long)PROF[i].ticks,
+			PROF[i].calls ? (double)PROF[i].ticks / PROF[i].calls : 0.0, 100.0 * PROF[i].ticks / run);
+	}
+	printf("-------------------------------------\n");
+	printf("decode is part of id, mem_read/mem_write/trace of the stage calling them\n");
+#else
+	printf("Host profiling is not compiled in (rebuild with make PROFILE=1)\n");
+#endif
+}
+
 /***************************************************************/
 /* Read a command from standard input.                                                               */  
 /***************************************************************/
 void handle_command() {                         
 	char buffer[20];
+	char filename[256], buffer2[256];
 	uint32_t start, stop, cycles;
 	uint32_t register_no;
 	int register_value;
@@ -171,67 +944,281 @@ void handle_command() {
 		case 's':
 			if (buffer[1] == 'h' || buffer[1] == 'H'){
 				show_pipeline();
+			}else if (buffer[1] == 't' || buffer[1] == 'T'){
+				print_stats();
 			}else {
 				runAll(); 
 			}
 			break;
 		case 'M':
 		case 'm':
-			if (scanf("%x %x", &start, &stop) != 2){
-				break;
-			}
+			if (buffer[1] == 'o' || buffer[1] == 'O'){
+				if (scanf("%19s", buffer) != 1){
+					printf("Invalid Command.\n");
+					break;
+				}
+				if (set_option("mode", buffer) != OPTION_OK){
+					break;
+				}
+				SIM_MODE == MODE_FUNCTIONAL ? printf("Functional mode\n") : printf("Pipeline mode\n");
+				break;
+			}
+			if (buffer[1] == 'e' || buffer[1] == 'E'){
+				if (scanf("%255s", filename) != 1){
+					break;
+				}
+				if (strcmp(filename, "off") == 0){
+					access_stop();
+				}else if (strcmp(filename, "replay") == 0){
+					if (scanf("%255s", filename) == 1){
+						access_replay(filename);
+					}
+				}else {
+					access_start(filename);
+				}
+				break;
+			}
+			if (buffer[1] == 'a' || buffer[1] == 'A'){
+				if (scanf("%255s", filename) != 1){
+					break;
+				}
+				if (strcmp(filename, "off") == 0){
+					mem_unmap_all();
+					break;
+				}
+				if (scanf("%x", &start) != 1){
+					break;
+				}
+				buffer[0] = '\0';
+				if (getchar() != '\n' && scanf("%19s", buffer) != 1){
+					break;
+				}
+				mem_map_file(filename, start, strcmp(buffer, "cow") == 0 ? MAP_COPY : MAP_READONLY);
+				break;
+			}
+			if (scanf("%x %x", &start, &stop) != 2){
+				break;
+			}
 			mdump(start, stop);
 			break;
+		case 'E':
+		case 'e':
+			if (scanf("%255s", filename) != 1){
+				break;
+			}
+			start = stop = 0;
+			if (getchar() != '\n' && scanf("%x %x", &start, &stop) != 2){
+				break;
+			}
+			mem_export(filename, start, stop);
+			break;
+		case 'D':
+		case 'd':
+			if (buffer[1] == 'e' || buffer[1] == 'E'){
+				if (scanf("%19s", buffer) != 1){
+					break;
+				}
+				if (strcmp(buffer, "off") == 0){
+					device_clear();
+				}else if (scanf("%x", &start) == 1){
+					device_add(buffer, start);
+				}
+				break;
+			}
+			if (scanf("%255s", filename) != 1){
+				break;
+			}
+			if (getchar() != '\n' && scanf("%255s", buffer2) == 1){
+				mem_diff(filename, buffer2);
+			}else {
+				mem_diff(filename, NULL);
+			}
+			break;
 		case '?':
 			help();
 			break;
 		case 'Q':
 		case 'q':
+			interval_stop();
+			live_stop();
+			access_stop();
 			printf("**************************\n");
 			printf("Exiting MU-MIPS! Good Bye...\n");
 			printf("**************************\n");
 			exit(0);
 		case 'R':
 		case 'r':
+			if (buffer[1] == 's' || buffer[1] == 'S'){
+				cycles = 1;
+				if (getchar() != '\n' && scanf("%d", &cycles) != 1){
+					break;
+				}
+				if (cycles > 0){
+					reverse_step(cycles);
+				}
+				break;
+			}
+			if (buffer[1] == 'c' || buffer[1] == 'C'){
+				reverse_continue();
+				break;
+			}
 			if (buffer[1] == 'd' || buffer[1] == 'D'){
 				rdump();
 			}else if(buffer[1] == 'e' || buffer[1] == 'E'){
 				reset();
 			}
 			else {
-				if (scanf("%d", &cycles) != 1) {
+				if (scanf("%255s", buffer2) != 1) {
 					break;
 				}
-				run(cycles);
+				if (strcmp(buffer2, "until") == 0) {
+					if (fgets(buffer2, sizeof(buffer2), stdin) == NULL) {
+						break;
+					}
+					buffer2[strcspn(buffer2, "\n")] = '\0';
+					if (until_compile(buffer2) == 0) {
+						runAll();
+						until_clear();
+					}
+				}else if (sscanf(buffer2, "%d", &cycles) == 1) {
+					run(cycles);
+				}
 			}
 			break;
 		case 'I':
 		case 'i':
+			if (buffer[1] == 'm' || buffer[1] == 'M'){
+				if (scanf("%255s", filename) == 1){
+					mem_import(filename);
+				}
+				break;
+			}
+			if (strncmp(buffer, "interc", 6) == 0){
+				if (scanf("%19s", buffer) != 1){
+					break;
+				}
+				if (strcmp(buffer, "off") == 0){
+					intercept_clear();
+				}else if (scanf("%x", &start) == 1){
+					intercept_add(buffer, start);
+				}
+				break;
+			}
+			if (buffer[2] == 't' || buffer[2] == 'T'){
+				if (scanf("%19s", buffer) != 1){
+					break;
+				}
+				if (strcmp(buffer, "off") == 0){
+					interval_stop();
+				}else if (scanf("%255s", filename) == 1){
+					INTERVAL_CYCLES = strtoul(buffer, NULL, 0);
+					interval_start(filename);
+				}
+				break;
+			}
 			if (scanf("%u %i", &register_no, &register_value) != 2){
 				break;
 			}
 			CURRENT_STATE.REGS[register_no] = register_value;
 			NEXT_STATE.REGS[register_no] = register_value;
+			checkpoint_restart();
 			break;
 		case 'H':
 		case 'h':
+			if (buffer[1] == 'o' || buffer[1] == 'O'){
+				if (scanf("%19s", buffer) != 1){
+					break;
+				}
+				if (strcmp(buffer, "on") == 0){
+					hotspot_enable();
+					printf("Hotspot profiling ON\n");
+				}else if (strcmp(buffer, "off") == 0){
+					free(HOTSPOT);
+					HOTSPOT = NULL;
+					printf("Hotspot profiling OFF\n");
+				}else if (strcmp(buffer, "dump") == 0){
+					if (scanf("%255s", filename) == 1){
+						hotspot_dump(filename);
+					}
+				}else {
+					hotspot_report(atoi(buffer));
+				}
+				break;
+			}
 			if (scanf("%i", &hi_reg_value) != 1){
 				break;
 			}
 			CURRENT_STATE.HI = hi_reg_value; 
 			NEXT_STATE.HI = hi_reg_value; 
+			checkpoint_restart();
 			break;
 		case 'L':
 		case 'l':
+			if (buffer[1] == 'i' || buffer[1] == 'I'){
+				if (scanf("%255s", filename) != 1){
+					break;
+				}
+				if (strcmp(filename, "off") == 0){
+					live_stop();
+				}else {
+					live_start(filename);
+				}
+				break;
+			}
 			if (scanf("%i", &lo_reg_value) != 1){
 				break;
 			}
 			CURRENT_STATE.LO = lo_reg_value;
 			NEXT_STATE.LO = lo_reg_value;
+			checkpoint_restart();
 			break;
 		case 'P':
 		case 'p':
-			print_program(); 
+			if (buffer[2] == 'o' || buffer[2] == 'O'){
+				print_profile();
+			}else {
+				print_program();
+			}
+			break;
+		case 'C':
+		case 'c':
+			if (buffer[1] == 'h' || buffer[1] == 'H'){
+				if (scanf("%19s", buffer) != 1){
+					break;
+				}
+				if (strcmp(buffer, "off") == 0){
+					checkpoint_stop();
+					break;
+				}
+				if (getchar() != '\n' && scanf("%u", &stop) == 1){
+					CHECKPOINT_BUDGET = (uint64_t)stop << 20;
+				}
+				if (strtoul(buffer, NULL, 0) > 0){
+					checkpoint_start(strtoul(buffer, NULL, 0));
+				}
+				break;
+			}
+			if (getchar() == '\n'){
+				cpi_report(0, 0);
+				break;
+			}
+			if (scanf("%19s", buffer) != 1){
+				break;
+			}
+			if (strcmp(buffer, "on") == 0){
+				cpi_enable();
+				printf("CPI attribution ON\n");
+			}else if (strcmp(buffer, "off") == 0){
+				free(CPI_PC);
+				CPI_PC = NULL;
+				printf("CPI attribution OFF\n");
+			}else if (strcmp(buffer, "func") == 0){
+				cpi_functions();
+			}else if (sscanf(buffer, "%x", &start) == 1 && scanf("%x", &stop) == 1){
+				cpi_report(start, stop);
+			}else {
+				printf("Invalid Command.\n");
+			}
 			break;
 		case 'F':
 		case 'f':
@@ -239,8 +1226,86 @@ void handle_command() {
 			{	
 				break;
 			}
+			pipeline_select();
+			checkpoint_restart();
 			ENABLE_FORWARDING == 0 ? printf("Forwarding OFF\n") : printf("Forwarding ON\n");
 			break;
+		case 'B':
+		case 'b':
+			if (buffer[1] == 'r' || buffer[1] == 'R'){
+				if (scanf("%19s", buffer) != 1){
+					break;
+				}
+				if (strcmp(buffer, "off") == 0){
+					break_clear();
+				}else if (sscanf(buffer, "%x", &start) == 1){
+					break_add(start);
+				}
+				break;
+			}
+			if (scanf("%255s %19s", filename, buffer) != 2){
+				break;
+			}
+			if (batch_load(filename) == 0){
+				batch_run(0);
+				batch_dump(buffer);
+			}
+			break;
+		case 'G':
+		case 'g':
+			if (scanf("%d", &cycles) == 1){
+				gdb_serve(cycles);
+			}
+			break;
+		case 'T':
+		case 't':
+			if (buffer[1] == 'l' || buffer[1] == 'L'){
+				if (scanf("%19s", buffer) != 1){
+					break;
+				}
+				if (strcmp(buffer, "off") == 0){
+					mmu_disable();
+					break;
+				}
+				if (getchar() != '\n' && scanf("%u %u %u", &MMU.entries, &MMU.ways, &MMU.walk) != 3){
+					break;
+				}
+				mmu_enable(strtoul(buffer, NULL, 16));
+				break;
+			}
+			if (scanf("%19s", buffer) != 1){
+				break;
+			}
+			if (strcmp(buffer, "off") == 0){
+				trace_stop();
+				break;
+			}
+			if (scanf("%255s", filename) != 1){
+				break;
+			}
+			if (strcmp(buffer, "record") == 0){
+				trace_record(filename);
+			}else if (strcmp(buffer, "replay") == 0){
+				trace_replay(filename);
+			}else {
+				printf("Invalid Command.\n");
+			}
+			break;
+		case 'W':
+		case 'w':
+			if (scanf("%19s", buffer) != 1){
+				break;
+			}
+			if (strcmp(buffer, "off") == 0){
+				watch_clear();
+				break;
+			}
+			if (sscanf(buffer, "%x", &start) != 1 || scanf("%u %19s", &stop, buffer) != 2){
+				printf("Invalid Command.\n");
+				break;
+			}
+			watch_add(start, stop, (strchr(buffer, 'r') ? WATCH_READ : 0) | (strchr(buffer, 'w') ? WATCH_WRITE : 0));
+			break;
 		default:
 			printf("Invalid Command.\n");
 			break;
@@ -248,1192 +1313,4957 @@ void handle_command() {
 }
 
 /***************************************************************/
-/* reset registers/memory and reload program                                                    */
+/* host pages covering a mapping                                                                         */
 /***************************************************************/
-void reset() {   
+static uint32_t mapping_length(Guest_Mapping *mapping) {
+	return (mapping->end - mapping->begin + MAP_PAGE) & ~(MAP_PAGE - 1);
+}
+
+/***************************************************************/
+/* map the file over its guest range; the range follows the file size     */
+/***************************************************************/
+static int mapping_attach(Guest_Mapping *mapping) {
+	struct stat st;
+	void *host;
+	int fd;
+
+	fd = open(mapping->file, O_RDONLY);
+	if (fd < 0 || fstat(fd, &st) != 0 || st.st_size == 0 ||
+		(uint64_t)mapping->begin + st.st_size - 1 > MEM_DATA_END) {
+		if (fd >= 0) {
+			close(fd);
+		}
+		return -1;
+	}
+	mapping->end = mapping->begin + st.st_size - 1;
+	host = mmap(mem_host(mapping->begin), mapping_length(mapping), PROT_READ | (mapping->mode == MAP_COPY ? PROT_WRITE : 0),
+		MAP_PRIVATE | MAP_FIXED, fd, 0);
+	close(fd);
+	if (host == MAP_FAILED) {
+		return -1;
+	}
+#ifdef MADV_HUGEPAGE
+	madvise(host, mapping_length(mapping), MADV_HUGEPAGE);
+#endif
+	return 0;
+}
+
+/***************************************************************/
+/* put zero pages back under a mapping                                                               */
+/***************************************************************/
+static void mapping_detach(Guest_Mapping *mapping) {
+	mmap(mem_host(mapping->begin), mapping_length(mapping), PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED | MAP_NORESERVE, -1, 0);
+}
+
+/***************************************************************/
+/* Map a host file at a page-aligned guest data address                           */
+/***************************************************************/
+int mem_map_file(char *filename, uint32_t address, int mode) {
+	Guest_Mapping *mapping = &MAPPINGS[NUM_MAPPINGS];
+	struct stat st;
 	int i;
-	/*reset registers*/
-	for (i = 0; i < MIPS_REGS; i++){
-		CURRENT_STATE.REGS[i] = 0;
+
+	if (NUM_MAPPINGS == MAX_MAPPINGS) {
+		printf("Error: Can't map %s, at most %d mappings\n", filename, MAX_MAPPINGS);
+		return -1;
 	}
-	CURRENT_STATE.HI = 0;
-	CURRENT_STATE.LO = 0;
-	
-	for (i = 0; i < NUM_MEM_REGION; i++) {
-		uint32_t region_size = MEM_REGIONS[i].end - MEM_REGIONS[i].begin + 1;
-		memset(MEM_REGIONS[i].mem, 0, region_size);
+	if (strlen(filename) >= sizeof(mapping->file)) {
+		printf("Error: Can't map %s, file name longer than %d characters\n", filename, (int)sizeof(mapping->file) - 1);
+		return -1;
 	}
-	
-	/*load program*/
-	load_program();
-	
-	/*reset PC*/
-	INSTRUCTION_COUNT = 0;
-	CURRENT_STATE.PC =  MEM_TEXT_BEGIN;
-	NEXT_STATE = CURRENT_STATE;
-	RUN_FLAG = TRUE;
+	if (address < MEM_DATA_BEGIN || address > MEM_DATA_END || (address & (MAP_PAGE - 1))) {
+		printf("Error: mapping address 0x%08x is not a page in the data segment\n", address);
+		return -1;
+	}
+	memset(mapping, 0, sizeof(*mapping));
+	strcpy(mapping->file, filename);
+	mapping->begin = address;
+	mapping->mode = mode;
+	/* check the size before anything is replaced */
+	if (stat(filename, &st) != 0 || st.st_size == 0 || (uint64_t)address + st.st_size - 1 > MEM_DATA_END) {
+		printf("Error: Can't map %s at 0x%08x\n", filename, address);
+		return -1;
+	}
+	mapping->end = address + st.st_size - 1;
+	for (i = 0; i < NUM_MAPPINGS; i++) {
+		if (mapping->begin <= MAPPINGS[i].end + MAP_PAGE - 1 && MAPPINGS[i].begin <= mapping->end + MAP_PAGE - 1) {
+			printf("Error: %s would overlap the mapping of %s\n", filename, MAPPINGS[i].file);
+			return -1;
+		}
+	}
+	/* a failed attach has not replaced the range, whatever it holds stays */
+	if (mapping_attach(mapping) != 0) {
+		printf("Error: Can't map %s at 0x%08x\n", filename, address);
+		return -1;
+	}
+	NUM_MAPPINGS++;
+	if (mode == MAP_READONLY) {
+		READONLY_MAPPINGS++;
+	}
+	printf("Mapped %s at 0x%08x - 0x%08x (%s)\n", filename, mapping->begin, mapping->end,
+		mode == MAP_READONLY ? "read-only" : "copy-on-write");
+	checkpoint_restart();
+	return 0;
 }
 
 /***************************************************************/
-/* Allocate and set memory to zero                                                                            */
+/* Remove every file mapping                                                                               */
 /***************************************************************/
-void init_memory() {                                           
+void mem_unmap_all() {
 	int i;
+	for (i = 0; i < NUM_MAPPINGS; i++) {
+		mapping_detach(&MAPPINGS[i]);
+	}
+	NUM_MAPPINGS = 0;
+	READONLY_MAPPINGS = 0;
+	checkpoint_restart();
+}
+
+/***************************************************************/
+/* order pages by guest address                                                                           */
+/***************************************************************/
+static int image_page_order(const void *a, const void *b) {
+	uint32_t x = ((const Image_Page *)a)->address, y = ((const Image_Page *)b)->address;
+	return x < y ? -1 : x > y;
+}
+
+/***************************************************************/
+/* Touched pages of guest memory, in address order: pages stored to since */
+/* reset (MEM_TOUCHED) or under a file mapping that are not all zero.   */
+/* data points into memory.                                                                                */
+/***************************************************************/
+static Image_Page *mem_touched(uint32_t *count) {
+	static const uint8_t zero[MAP_PAGE];
+	Image_Page *pages = NULL;
+	uint32_t capacity = 0, page, num_pages, address;
+	int i, m;
+
+	*count = 0;
 	for (i = 0; i < NUM_MEM_REGION; i++) {
-		uint32_t region_size = MEM_REGIONS[i].end - MEM_REGIONS[i].begin + 1;
-		MEM_REGIONS[i].mem = malloc(region_size);
-		memset(MEM_REGIONS[i].mem, 0, region_size);
+		num_pages = (MEM_REGIONS[i].end - MEM_REGIONS[i].begin + 1) / MAP_PAGE;
+		for (page = 0; page < num_pages; page++) {
+			uint8_t *data = MEM_REGIONS[i].mem + (size_t)page * MAP_PAGE;
+			address = MEM_REGIONS[i].begin + page * MAP_PAGE;
+			for (m = 0; !MEM_TOUCHED[address >> MMU_PAGE_SHIFT] && m < NUM_MAPPINGS &&
+				(address < MAPPINGS[m].begin || address > MAPPINGS[m].end); m++);
+			if ((!MEM_TOUCHED[address >> MMU_PAGE_SHIFT] && m == NUM_MAPPINGS) || memcmp(data, zero, MAP_PAGE) == 0) {
+				continue;
+			}
+			if (*count == capacity) {
+				capacity = capacity ? capacity * 2 : 64;
+				pages = realloc(pages, capacity * sizeof(Image_Page));
+			}
+			pages[*count].address = address;
+			pages[*count].begin = 0;
+			pages[*count].end = MAP_PAGE;
+			pages[*count].data = data;
+			(*count)++;
+		}
 	}
+	qsort(pages, *count, sizeof(Image_Page), image_page_order);
+	return pages;
 }
 
-/**************************************************************/
-/* load program into memory                                                                                      */
-/**************************************************************/
-void load_program() {                   
-	FILE * fp;
-	int i, word;
-	uint32_t address;
+/***************************************************************/
+/* write one chunk of guest bytes                                                                         */
+/***************************************************************/
+static int image_write_chunk(FILE *fp, uint32_t address, uint32_t length, uint8_t *data) {
+	Image_Chunk chunk = { address, length };
+	return fwrite(&chunk, sizeof(chunk), 1, fp) == 1 && fwrite(data, 1, length, fp) == length ? 0 : -1;
+}
 
-	/* Open program file. */
-	fp = fopen(prog_file, "r");
+/***************************************************************/
+/* Export guest memory [start, stop] to an image, or every touched page   */
+/* when start and stop are both 0                                                                           */
+/***************************************************************/
+int mem_export(char *filename, uint32_t start, uint32_t stop) {
+	uint32_t header[2] = { IMAGE_MAGIC, IMAGE_VERSION };
+	uint32_t count, chunks = 0, i;
+	uint64_t address, next;
+	Image_Page *pages;
+	int error = 0;
+	FILE *fp;
+
+	fp = fopen(filename, "wb");
 	if (fp == NULL) {
-		printf("Error: Can't open program file %s\n", prog_file);
-		exit(-1);
+		printf("Error: Can't open %s\n", filename);
+		return -1;
+	}
+	error = fwrite(header, sizeof(header), 1, fp) != 1;
+	if (start == 0 && stop == 0) {
+		pages = mem_touched(&count);
+		for (i = 0; i < count && !error; i++) {
+			error = image_write_chunk(fp, pages[i].address, MAP_PAGE, pages[i].data);
+		}
+		chunks = count;
+		free(pages);
+	}else {
+		/* one chunk per page, skipping addresses outside every region */
+		for (address = start; address <= stop && !error; address = next) {
+			uint8_t *host = mem_host(address);
+			next = (address | (MAP_PAGE - 1)) + 1;
+			if (next > (uint64_t)stop + 1) {
+				next = (uint64_t)stop + 1;
+			}
+			if (host) {
+				error = image_write_chunk(fp, address, next - address, host);
+				chunks++;
+			}
+		}
+	}
+	if (fclose(fp) != 0 || error) {
+		printf("Error: Can't write %s\n", filename);
+		return -1;
 	}
+	printf("Exported %u chunks to %s\n", chunks, filename);
+	return 0;
+}
 
-	/* Read in the program. */
+/***************************************************************/
+/* Read an image into pages in address order; each page keeps the extent */
+/* its chunks cover, bytes outside the chunks are zero. Returns -1 if the  */
+/* file is not a valid image.                                                                                  */
+/***************************************************************/
+static int image_load(char *filename, Image_Page **image, uint32_t *count) {
+	uint32_t header[2], capacity = 0, offset, length;
+	Image_Page *pages = NULL;
+	Image_Chunk chunk;
+	int error = 0;
+	FILE *fp;
 
-	i = 0;
-	while( fscanf(fp, "%x\n", &word) != EOF ) {
-		address = MEM_TEXT_BEGIN + i;
-		mem_write_32(address, word);
-		printf("writing 0x%08x into address 0x%08x (%d)\n", word, address, address);
-		i += 4;
+	*count = 0;
+	fp = fopen(filename, "rb");
+	if (fp == NULL || fread(header, sizeof(header), 1, fp) != 1 ||
+		header[0] != IMAGE_MAGIC || header[1] != IMAGE_VERSION) {
+		printf("Error: %s is not a MU-MIPS memory image\n", filename);
+		if (fp) {
+			fclose(fp);
+		}
+		return -1;
+	}
+	while (!error && fread(&chunk, sizeof(chunk), 1, fp) == 1) {
+		if ((uint64_t)chunk.address + chunk.length > 0x100000000ULL) {
+			error = 1;
+			break;
+		}
+		while (chunk.length && !error) {
+			uint32_t page = chunk.address & ~(MAP_PAGE - 1);
+			if (*count == 0 || pages[*count - 1].address != page) {
+				if (*count && pages[*count - 1].address > page) {
+					error = 1;		/* chunks must be in address order */
+					break;
+				}
+				if (*count == capacity) {
+					capacity = capacity ? capacity * 2 : 64;
+					pages = realloc(pages, capacity * sizeof(Image_Page));
+				}
+				pages[*count].address = page;
+				pages[*count].begin = chunk.address - page;
+				pages[*count].data = calloc(1, MAP_PAGE);
+				(*count)++;
+			}else if (chunk.address - page < pages[*count - 1].end) {
+				error = 1;
+				break;
+			}
+			offset = chunk.address - page;
+			length = MAP_PAGE - offset < chunk.length ? MAP_PAGE - offset : chunk.length;
+			pages[*count - 1].end = offset + length;
+			error = fread(pages[*count - 1].data + offset, 1, length, fp) != length;
+			chunk.address += length;
+			chunk.length -= length;
+		}
 	}
-	PROGRAM_SIZE = i/4;
-	printf("Program loaded into memory.\n%d words written into memory.\n\n", PROGRAM_SIZE);
 	fclose(fp);
+	if (error) {
+		printf("Error: %s is truncated or out of order\n", filename);
+		while (*count) {
+			free(pages[--(*count)].data);
+		}
+		free(pages);
+		return -1;
+	}
+	*image = pages;
+	return 0;
 }
 
-/************************************************************/
-/* maintain the pipeline                                                                                           */ 
-/************************************************************/
-void handle_pipeline()
-{
-	/*INSTRUCTION_COUNT should be incremented when instruction is done*/
-	/*Since we do not have branch/jump instructions, INSTRUCTION_COUNT should be incremented in WB stage */
-	
-	WB();
-	MEM();
-	EX();
-	ID();
-	IF();
+/***************************************************************/
+/* free the pages of a loaded image                                                                     */
+/***************************************************************/
+static void image_free(Image_Page *pages, uint32_t count) {
+	uint32_t i;
+	for (i = 0; i < count; i++) {
+		free(pages[i].data);
+	}
+	free(pages);
 }
 
-/************************************************************/
-/* writeback (WB) pipeline stage:                                                                          */ 
-/************************************************************/
-void WB()
-{
-	if(CYCLE_COUNT < 5)
-	{
-		return;
-	}
-	
+/***************************************************************/
+/* Import an image into guest memory; only the bytes it covers are written, */
+/* read-only mappings are kept                                                                              */
+/***************************************************************/
+int mem_import(char *filename) {
+	uint32_t count, i, skipped = 0;
+	Image_Page *pages;
+
+	if (image_load(filename, &pages, &count) != 0) {
+		return -1;
+	}
+	for (i = 0; i < count; i++) {
+		uint32_t address = pages[i].address + pages[i].begin, length = pages[i].end - pages[i].begin;
+		uint8_t *host = mem_host(pages[i].address);
+		if (host == NULL || (READONLY_MAPPINGS && mem_store_dropped(address, length))) {
+			skipped++;
+			continue;
+		}
+		memcpy(host + pages[i].begin, pages[i].data + pages[i].begin, length);
+		MEM_TOUCHED[address >> MMU_PAGE_SHIFT] = 1;
+	}
+	image_free(pages, count);
+	printf("Imported %u pages from %s", count - skipped, filename);
+	skipped ? printf(" (%u outside writable memory)\n", skipped) : printf("\n");
+	checkpoint_restart();
+	return 0;
+}
+
+/***************************************************************/
+/* little-endian guest word at a byte offset of a page                                     */
+/***************************************************************/
+static inline uint32_t image_word(uint8_t *data, uint32_t offset) {
+	return data[offset] | (data[offset + 1] << 8) | (data[offset + 2] << 16) | ((uint32_t)data[offset + 3] << 24);
+}
+
+/***************************************************************/
+/* Compare an image with guest memory, or with another image, page by     */
+/* page; only the words of pages that differ are looked at and printed.   */
+/* Against memory only the bytes the image covers are compared; between */
+/* two images a byte one of them does not cover compares as zero.          */
+/* Returns the words that differ, -1 on error.                                              */
+/***************************************************************/
+long mem_diff(char *filename, char *other) {
+	static uint8_t zero[MAP_PAGE];
+	uint32_t count_a, count_b, a = 0, b = 0, offset, pages = 0;
+	Image_Page *image_a, *image_b = NULL;
+	long words = 0;
+
+	if (image_load(filename, &image_a, &count_a) != 0) {
+		return -1;
+	}
+	if (other != NULL && image_load(other, &image_b, &count_b) != 0) {
+		image_free(image_a, count_a);
+		return -1;
+	}
+	if (other == NULL) {
+		count_b = 0;
+	}
+
+	while (a < count_a || b < count_b) {
+		uint32_t address, begin = MAP_PAGE, end = 0;
+		uint8_t *data_a = zero, *data_b = zero;
+
+		if (b == count_b || (a < count_a && image_a[a].address <= image_b[b].address)) {
+			address = image_a[a].address;
+		}else {
+			address = image_b[b].address;
+		}
+		if (a < count_a && image_a[a].address == address) {
+			begin = image_a[a].begin;
+			end = image_a[a].end;
+			data_a = image_a[a++].data;
+		}
+		if (b < count_b && image_b[b].address == address) {
+			begin = image_b[b].begin < begin ? image_b[b].begin : begin;
+			end = image_b[b].end > end ? image_b[b].end : end;
+			data_b = image_b[b++].data;
+		}else if (other == NULL && mem_host(address)) {
+			data_b = mem_host(address);
+		}
+		if (memcmp(data_a + begin, data_b + begin, end - begin) == 0) {
+			continue;
+		}
+		pages++;
+		for (offset = begin & ~3; offset < end; offset += 4) {
+			uint32_t word_a = image_word(data_a, offset), word_b = image_word(data_b, offset);
+			/* bytes of the word outside the compared extent do not count */
+			uint32_t mask = 0xFFFFFFFF;
+			if (offset < begin) {
+				mask <<= 8 * (begin - offset);
+			}
+			if (offset + 4 > end) {
+				mask &= 0xFFFFFFFF >> 8 * (offset + 4 - end);
+			}
+			if ((word_a ^ word_b) & mask) {
+				printf("0x%08x: 0x%08x 0x%08x\n", address + offset, word_a & mask, word_b & mask);
+				words++;
+			}
+		}
+	}
+	printf("%ld words differ in %u pages (%s vs %s)\n", words, pages, filename, other ? other : "memory");
+
+	image_free(image_a, count_a);
+	if (other) {
+		image_free(image_b, count_b);
+	}
+	return words;
+}
+
+/***************************************************************/
+/* reset registers/memory and reload program                                                    */
+/***************************************************************/
+void reset() {   
+	int i;
+	/*reset registers*/
+	for (i = 0; i < MIPS_REGS; i++){
+		CURRENT_STATE.REGS[i] = 0;
+	}
+	CURRENT_STATE.HI = 0;
+	CURRENT_STATE.LO = 0;
+	
+	for (i = 0; i < NUM_MAPPINGS; i++) {
+		mapping_detach(&MAPPINGS[i]);
+	}
+	/* hand the pages back: they read as zero again and cost nothing until touched */
+	for (i = 0; i < NUM_MEM_REGION; i++) {
+		uint32_t region_size = MEM_REGIONS[i].end - MEM_REGIONS[i].begin + 1;
+		madvise(MEM_REGIONS[i].mem, region_size, MADV_DONTNEED);
+	}
+	memset(MEM_TOUCHED, 0, 1u << (32 - MMU_PAGE_SHIFT));
+	/* mapped files come back as they are on disk now, private copies are dropped */
+	for (i = 0; i < NUM_MAPPINGS; i++) {
+		if (mapping_attach(&MAPPINGS[i]) != 0) {
+			printf("Error: Can't map %s again, the range reads as zero\n", MAPPINGS[i].file);
+			mapping_detach(&MAPPINGS[i]);
+		}
+	}
+	
+	syscall_reset();
+
+	/*load program*/
+	load_program();
+	
+	/*reset PC*/
+	reset_pipeline();
+	CURRENT_STATE.PC =  MEM_TEXT_BEGIN;
+	NEXT_STATE = CURRENT_STATE;
+	RUN_FLAG = TRUE;
+	device_reset();
+	checkpoint_restart();
+}
+
+/***************************************************************/
+/* empty the pipeline registers and clear the hazard/stat counters          */
+/***************************************************************/
+void reset_pipeline() {
+	memset(&ID_IF, 0, sizeof(ID_IF));
+	memset(&EX_ID, 0, sizeof(EX_ID));
+	memset(&MEM_EX, 0, sizeof(MEM_EX));
+	memset(&WB_MEM, 0, sizeof(WB_MEM));
+	controlHazard = 0;
+	jumpStall = 0;
+	SYSCALL_PENDING = FALSE;
+	MEMORY_WAIT = 0;
+	SPIN_BRANCH = 0;
+	SPIN_LAST = 0;
+	BREAK_PC = 0;
+	WATCH_HIT.mode = 0;
+	memset(SPIN_LOOPS, 0, sizeof(SPIN_LOOPS));	/* a new program may sit at the same addresses */
+	mmu_flush();
+	INSTRUCTION_COUNT = 0;
+	CYCLE_COUNT = 0;
+	memset(&STATS, 0, sizeof(STATS));
+	memset(PROF, 0, sizeof(PROF));
+	if (HOTSPOT) {
+		hotspot_enable();
+	}
+	if (CPI_PC) {
+		cpi_enable();
+	}
+	/* a restarted run starts a new series of intervals in the same file */
+	memset(&INTERVAL_LAST, 0, sizeof(INTERVAL_LAST));
+	INTERVAL_LEFT = INTERVAL_CYCLES;
+	LIVE_LEFT = LIVE_CYCLES;
+}
+
+/***************************************************************/
+/* Allocate and set memory to zero                                                                            */
+/***************************************************************/
+void init_memory() {                                           
+	int i;
+	for (i = 0; i < NUM_MEM_REGION; i++) {
+		uint32_t region_size = MEM_REGIONS[i].end - MEM_REGIONS[i].begin + 1;
+		/* zero pages on demand, page aligned so files can be mapped over them */
+		MEM_REGIONS[i].mem = mmap(NULL, region_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+		if (MEM_REGIONS[i].mem == MAP_FAILED) {
+			printf("Error: Can't allocate %u bytes of guest memory\n", region_size);
+			exit(-1);
+		}
+	}
+	MEM_TOUCHED = calloc(1u << (32 - MMU_PAGE_SHIFT), 1);
+}
+
+
+/**************************************************************/
+/* load program into memory                                                                                      */
+/**************************************************************/
+void load_program() {                   
+	FILE * fp;
+	int i, word;
+	uint32_t address;
+
+	/* Open program file. */
+	fp = fopen(prog_file, "r");
+	if (fp == NULL) {
+		printf("Error: Can't open program file %s\n", prog_file);
+		exit(-1);
+	}
+
+	/* Read in the program. */
+
+	i = 0;
+	while( fscanf(fp, "%x\n", &word) != EOF ) {
+		address = MEM_TEXT_BEGIN + i;
+		mem_write_32(address, word);
+		if (TRACE_LEVEL)
+			printf("writing 0x%08x into address 0x%08x (%d)\n", word, address, address);
+		i += 4;
+	}
+	PROGRAM_SIZE = i/4;
+	printf("Program loaded into memory.\n%d words written into memory.\n\n", PROGRAM_SIZE);
+	fclose(fp);
+}
+
+/**************************************************************/
+/* LEB128 varints; signed deltas are zigzag encoded                                 */
+/**************************************************************/
+static inline uint8_t *varint_put(uint8_t *p, uint64_t value) {
+	while (value >= 0x80) {
+		*p++ = (uint8_t)value | 0x80;
+		value >>= 7;
+	}
+	*p++ = (uint8_t)value;
+	return p;
+}
+
+static inline uint8_t *varint_get(uint8_t *p, uint8_t *end, uint64_t *value) {
+	int shift = 0;
+
+	*value = 0;
+	while (p < end && shift < 64) {
+		*value |= (uint64_t)(*p & 0x7F) << shift;
+		if (!(*p++ & 0x80)) {
+			break;
+		}
+		shift += 7;
+	}
+	return p;
+}
+
+static inline uint32_t zigzag(uint32_t delta) {
+	return (delta << 1) ^ (uint32_t)((int32_t)delta >> 31);
+}
+
+static inline uint32_t unzigzag(uint32_t value) {
+	return (value >> 1) ^ (uint32_t)-(int32_t)(value & 1);
+}
+
+/**************************************************************/
+/* write the trace block being encoded and clear the delta bases          */
+/**************************************************************/
+static void trace_flush() {
+	Access_Block block = { TRACE_CODER.records, TRACE_CODER.bytes };
+
+	if (TRACE_CODER.records) {
+		fwrite(&block, sizeof(block), 1, TRACE_FILE);
+		fwrite(TRACE_CODER.block, 1, TRACE_CODER.bytes, TRACE_FILE);
+	}
+	TRACE_CODER.total += TRACE_CODER.records;
+	TRACE_CODER.bytes = TRACE_CODER.records = 0;
+	TRACE_CODER.pc = TRACE_CODER.addr = 0;
+	memset(TRACE_CODER.ir, 0, sizeof(TRACE_CODER.ir));
+}
+
+/**************************************************************/
+/* decode the next trace block into TRACE_BUFFER; TRACE_LENGTH is 0    */
+/* once the trace is exhausted                                                                 */
+/**************************************************************/
+static void trace_load() {
+	uint8_t *p = TRACE_CODER.block, *end;
+	uint32_t i, pc = 0, addr = 0, *slot;
+	Access_Block info;
+	uint64_t value;
+
+	TRACE_LENGTH = TRACE_CURSOR = 0;
+	if (TRACE_FILE == NULL || fread(&info, sizeof(info), 1, TRACE_FILE) != 1) {
+		return;
+	}
+	memset(TRACE_CODER.ir, 0, sizeof(TRACE_CODER.ir));
+	i = 0;
+	if (info.bytes <= TRACE_BLOCK && info.records <= TRACE_BLOCK_RECORDS &&
+		fread(p, 1, info.bytes, TRACE_FILE) == info.bytes) {
+		end = p + info.bytes;
+		for (; i < info.records && p < end; i++) {
+			Trace_Record *record = &TRACE_BUFFER[i];
+			uint8_t tag = *p++;
+
+			if (tag & TRACE_NEXT_PC) {
+				pc += 4;
+			}else {
+				p = varint_get(p, end, &value);
+				pc += unzigzag((uint32_t)value);
+			}
+			slot = &TRACE_CODER.ir[(pc >> 2) % TRACE_IR_SLOTS];
+			if (!(tag & TRACE_SAME_IR)) {
+				if (end - p < 4) {
+					break;
+				}
+				memcpy(slot, p, 4);
+				p += 4;
+			}
+			record->PC = pc;
+			record->IR = *slot;
+			record->addr = 0;
+			record->target = 0;
+			if (tag & TRACE_ADDR) {
+				p = varint_get(p, end, &value);
+				addr += unzigzag((uint32_t)value);
+				record->addr = addr;
+			}
+			if (tag & TRACE_TARGET) {
+				p = varint_get(p, end, &value);
+				record->target = pc + unzigzag((uint32_t)value);
+			}
+		}
+	}
+	if (i != info.records) {
+		printf("Error: trace is truncated or corrupt, replay stops here\n");
+		fclose(TRACE_FILE);
+		TRACE_FILE = NULL;
+		return;
+	}
+	TRACE_LENGTH = info.records;
+}
+
+/**************************************************************/
+/* start recording retired instructions into a trace file                           */
+/**************************************************************/
+void trace_record(char *filename) {
+	uint32_t header[2] = { TRACE_MAGIC, TRACE_VERSION };
+
+	trace_stop();
+	TRACE_FILE = fopen(filename, "wb");
+	if (TRACE_FILE == NULL) {
+		printf("Error: Can't open trace file %s\n", filename);
+		return;
+	}
+	fwrite(header, sizeof(header), 1, TRACE_FILE);
+	memset(&TRACE_CODER, 0, sizeof(TRACE_CODER));
+	TRACE_CODER.block = malloc(TRACE_BLOCK);
+	TRACE_MODE = TRACE_RECORD;
+	printf("Recording instruction trace to %s\n", filename);
+}
+
+/**************************************************************/
+/* open a trace and restart the pipeline in timing-only mode; the trace  */
+/* is decoded a block at a time as IF consumes it                                  */
+/**************************************************************/
+void trace_replay(char *filename) {
+	uint32_t header[2];
+
+	trace_stop();
+	TRACE_FILE = fopen(filename, "rb");
+	if (TRACE_FILE == NULL) {
+		printf("Error: Can't open trace file %s\n", filename);
+		return;
+	}
+	if (fread(header, sizeof(header), 1, TRACE_FILE) != 1 || header[0] != TRACE_MAGIC || header[1] != TRACE_VERSION) {
+		printf("Error: %s is not a MU-MIPS trace\n", filename);
+		fclose(TRACE_FILE);
+		TRACE_FILE = NULL;
+		return;
+	}
+	memset(&TRACE_CODER, 0, sizeof(TRACE_CODER));
+	TRACE_CODER.block = malloc(TRACE_BLOCK);
+	TRACE_BUFFER = malloc(TRACE_BLOCK_RECORDS * sizeof(Trace_Record));
+	TRACE_FETCHED = 0;
+	TRACE_RETIRED = 0;
+	trace_load();
+
+	reset_pipeline();
+	CURRENT_STATE.PC = TRACE_LENGTH ? TRACE_BUFFER[0].PC : MEM_TEXT_BEGIN;
+	NEXT_STATE = CURRENT_STATE;
+	RUN_FLAG = TRACE_LENGTH ? TRUE : FALSE;
+	TRACE_MODE = TRACE_REPLAY;
+	checkpoint_restart();
+	printf("Replaying trace %s (timing only)\n", filename);
+}
+
+/**************************************************************/
+/* close the active trace                                                                                      */
+/**************************************************************/
+void trace_stop() {
+	if (TRACE_MODE == TRACE_RECORD) {
+		trace_flush();
+		printf("Trace closed, %lu records written.\n", (unsigned long)TRACE_CODER.total);
+	}
+	else if (TRACE_MODE == TRACE_REPLAY) {
+		free(TRACE_BUFFER);
+		TRACE_BUFFER = NULL;
+	}
+	if (TRACE_FILE) {
+		fclose(TRACE_FILE);
+		TRACE_FILE = NULL;
+	}
+	free(TRACE_CODER.block);
+	TRACE_CODER.block = NULL;
+	TRACE_MODE = TRACE_OFF;
+}
+
+/**************************************************************/
+/* append a retired instruction to the trace                                          */
+/**************************************************************/
+static void trace_append(uint32_t pc, uint32_t instruction, uint32_t addr, uint32_t target) {
+	uint8_t *tag = TRACE_CODER.block + TRACE_CODER.bytes, *p = tag + 1;
+	uint32_t *slot = &TRACE_CODER.ir[(pc >> 2) % TRACE_IR_SLOTS];
+	PROF_START();
+
+	*tag = 0;
+	if (pc == TRACE_CODER.pc + 4) {
+		*tag |= TRACE_NEXT_PC;
+	}else {
+		p = varint_put(p, zigzag(pc - TRACE_CODER.pc));
+	}
+	if (instruction == *slot) {
+		*tag |= TRACE_SAME_IR;
+	}else {
+		memcpy(p, &instruction, 4);
+		p += 4;
+		*slot = instruction;
+	}
+	if (addr) {
+		*tag |= TRACE_ADDR;
+		p = varint_put(p, zigzag(addr - TRACE_CODER.addr));
+		TRACE_CODER.addr = addr;
+	}
+	if (target) {
+		*tag |= TRACE_TARGET;
+		p = varint_put(p, zigzag(target - pc));
+	}
+	TRACE_CODER.pc = pc;
+	TRACE_CODER.bytes = p - TRACE_CODER.block;
+	if (++TRACE_CODER.records == TRACE_BLOCK_RECORDS || TRACE_CODER.bytes > TRACE_BLOCK - TRACE_MAX_RECORD) {
+		trace_flush();
+	}
+	PROF_STOP(PROF_TRACE);
+}
+
+/**************************************************************/
+/* hand the next replayed record to IF, decoding the following block as  */
+/* soon as this one is used up; FALSE at the end of the trace                 */
+/**************************************************************/
+static inline int trace_next(Trace_Record *record) {
+	if (TRACE_CURSOR == TRACE_LENGTH) {
+		return FALSE;
+	}
+	*record = TRACE_BUFFER[TRACE_CURSOR++];
+	TRACE_FETCHED++;
+	if (TRACE_CURSOR == TRACE_LENGTH) {
+		trace_load();
+	}
+	return TRUE;
+}
+
+/**************************************************************/
+/* Set up an empty cache; size, ways and line must be powers of two      */
+/**************************************************************/
+int cache_init(Cache *cache, uint32_t size, uint32_t ways, uint32_t line) {
+	cache_free(cache);
+	if (size == 0 || ways == 0 || line < 4 || (size & (size - 1)) || (ways & (ways - 1)) ||
+		(line & (line - 1)) || size < ways * line) {
+		printf("Error: cache of %u bytes, %u ways, %u byte lines is not a power-of-two geometry\n", size, ways, line);
+		return -1;
+	}
+	cache->ways = ways;
+	cache->sets = size / (ways * line);
+	for (cache->line_shift = 0; (1u << cache->line_shift) < line; cache->line_shift++);
+	cache->tags = calloc(cache->sets * ways, sizeof(uint32_t));
+	cache->used = calloc(cache->sets * ways, sizeof(uint64_t));
+	return 0;
+}
+
+/**************************************************************/
+/* release a cache model                                                                                       */
+/**************************************************************/
+void cache_free(Cache *cache) {
+	free(cache->tags);
+	free(cache->used);
+	memset(cache, 0, sizeof(*cache));
+}
+
+/**************************************************************/
+/* look up the line holding address, filling it on a miss; 1 on a hit     */
+/**************************************************************/
+static inline int cache_access(Cache *cache, uint32_t address) {
+	uint32_t tag = (address >> cache->line_shift) + 1;
+	uint32_t first = ((tag - 1) & (cache->sets - 1)) * cache->ways;
+	uint32_t way, victim = first;
+
+	cache->accesses++;
+	cache->clock++;
+	for (way = first; way < first + cache->ways; way++) {
+		if (cache->tags[way] == tag) {
+			cache->used[way] = cache->clock;
+			return 1;
+		}
+		if (cache->used[way] < cache->used[victim]) {
+			victim = way;
+		}
+	}
+	cache->misses++;
+	cache->tags[victim] = tag;
+	cache->used[victim] = cache->clock;
+	return 0;
+}
+
+/**************************************************************/
+/* start recording every memory access into an access trace                    */
+/**************************************************************/
+void access_start(char *filename) {
+	uint32_t header[2] = { ACCESS_MAGIC, ACCESS_VERSION };
+
+	access_stop();
+	ACCESS_FILE = fopen(filename, "wb");
+	if (ACCESS_FILE == NULL) {
+		printf("Error: Can't open access trace %s\n", filename);
+		return;
+	}
+	setvbuf(ACCESS_FILE, NULL, _IOFBF, 1 << 20);
+	fwrite(header, sizeof(header), 1, ACCESS_FILE);
+	memset(&ACCESS, 0, sizeof(ACCESS));
+	ACCESS.block = malloc(ACCESS_BLOCK);
+	printf("Recording memory accesses to %s\n", filename);
+}
+
+/**************************************************************/
+/* write the pending block and clear the delta bases                                */
+/**************************************************************/
+static void access_flush() {
+	Access_Block block = { ACCESS.records, ACCESS.bytes };
+
+	if (ACCESS.records) {
+		fwrite(&block, sizeof(block), 1, ACCESS_FILE);
+		fwrite(ACCESS.block, 1, ACCESS.bytes, ACCESS_FILE);
+	}
+	ACCESS.total += ACCESS.records;
+	ACCESS.bytes = ACCESS.records = 0;
+	ACCESS.cycle = ACCESS.addr = 0;
+	memset(ACCESS.pc, 0, sizeof(ACCESS.pc));
+}
+
+/**************************************************************/
+/* close the access trace                                                                                     */
+/**************************************************************/
+void access_stop() {
+	if (ACCESS_FILE == NULL) {
+		return;
+	}
+	access_flush();
+	fclose(ACCESS_FILE);
+	ACCESS_FILE = NULL;
+	free(ACCESS.block);
+	printf("Access trace closed, %lu records written.\n", (unsigned long)ACCESS.total);
+}
+
+/**************************************************************/
+/* bytes moved by a load or store: LB/LBU/SB 1, LH/LHU/SH 2, LW/SW 4  */
+/**************************************************************/
+static inline uint32_t access_size(uint32_t instruction) {
+	uint32_t opcode = instruction >> 26;
+	return (opcode & 3) == 3 ? 4 : 1 << (opcode & 3);
+}
+
+/**************************************************************/
+/* Append one access at the current cycle; size is 1, 2 or 4 bytes          */
+/**************************************************************/
+static void access_append(int kind, uint32_t pc, uint32_t address, uint32_t size) {
+	uint8_t *tag = ACCESS.block + ACCESS.bytes, *p = tag + 1;
+	uint64_t cycle = CYCLE_COUNT;
+	PROF_START();
+
+	*tag = kind | (size == 4 ? 2 : size >> 1) << 2;
+	if (cycle == ACCESS.cycle) {
+		*tag |= ACCESS_SAME_CYCLE;
+	}else if (cycle == ACCESS.cycle + 1) {
+		*tag |= ACCESS_NEXT_CYCLE;
+	}else {
+		p = varint_put(p, cycle - ACCESS.cycle);
+	}
+	if (pc == ACCESS.pc[kind] + 4) {
+		*tag |= ACCESS_NEXT_PC;
+	}else {
+		p = varint_put(p, zigzag(pc - ACCESS.pc[kind]));
+	}
+	if (kind != ACCESS_FETCH) {
+		if (address == ACCESS.addr) {
+			*tag |= ACCESS_NEXT_ADDR;
+		}else {
+			p = varint_put(p, zigzag(address - ACCESS.addr));
+		}
+		ACCESS.addr = address + size;
+	}
+	ACCESS.cycle = cycle;
+	ACCESS.pc[kind] = pc;
+	ACCESS.bytes = p - ACCESS.block;
+	ACCESS.records++;
+	if (ACCESS.bytes > ACCESS_BLOCK - ACCESS_MAX_RECORD) {
+		access_flush();
+	}
+	PROF_STOP(PROF_TRACE);
+}
+
+/**************************************************************/
+/* Run an access trace through the cache model: fetches through the    */
+/* L1 instruction cache, loads and stores through the L1 data cache       */
+/**************************************************************/
+void access_replay(char *filename) {
+	static const char *names[NUM_ACCESS] = { "fetch", "read", "write" };
+	uint64_t count[NUM_ACCESS] = { 0 }, misses[NUM_ACCESS] = { 0 }, cycle = 0, value;
+	uint32_t header[2], pc[NUM_ACCESS], addr, i, kind, size;
+	uint8_t *block, *p, *end;
+	Access_Block info;
+	double seconds;
+	int error = 0;
+	FILE *fp;
+
+	fp = fopen(filename, "rb");
+	if (fp == NULL || fread(header, sizeof(header), 1, fp) != 1 || header[0] != ACCESS_MAGIC || header[1] != ACCESS_VERSION) {
+		printf("Error: %s is not a MU-MIPS access trace\n", filename);
+		if (fp) {
+			fclose(fp);
+		}
+		return;
+	}
+	if (cache_init(&ICACHE, CACHE_SIZE, CACHE_WAYS, CACHE_LINE) != 0 ||
+		cache_init(&DCACHE, CACHE_SIZE, CACHE_WAYS, CACHE_LINE) != 0) {
+		fclose(fp);
+		return;
+	}
+	block = malloc(ACCESS_BLOCK);
+	seconds = host_time();
+
+	while (!error && fread(&info, sizeof(info), 1, fp) == 1) {
+		if (info.bytes > ACCESS_BLOCK || fread(block, 1, info.bytes, fp) != info.bytes) {
+			error = 1;
+			break;
+		}
+		p = block;
+		end = block + info.bytes;
+		cycle = addr = 0;
+		memset(pc, 0, sizeof(pc));
+		for (i = 0; i < info.records && p < end; i++) {
+			uint8_t tag = *p++;
+			kind = tag & 3;
+			size = 1 << ((tag >> 2) & 3);
+			if (kind >= NUM_ACCESS) {
+				error = 1;
+				break;
+			}
+			if (tag & ACCESS_NEXT_CYCLE) {
+				cycle++;
+			}else if (!(tag & ACCESS_SAME_CYCLE)) {
+				p = varint_get(p, end, &value);
+				cycle += value;
+			}
+			if (tag & ACCESS_NEXT_PC) {
+				pc[kind] += 4;
+			}else {
+				p = varint_get(p, end, &value);
+				pc[kind] += unzigzag((uint32_t)value);
+			}
+			if (kind == ACCESS_FETCH) {
+				misses[kind] += !cache_access(&ICACHE, pc[kind]);
+			}else {
+				if (!(tag & ACCESS_NEXT_ADDR)) {
+					p = varint_get(p, end, &value);
+					addr += unzigzag((uint32_t)value);
+				}
+				misses[kind] += !cache_access(&DCACHE, addr);
+				addr += size;
+			}
+			count[kind]++;
+		}
+		error |= i != info.records;
+	}
+	seconds = host_time() - seconds;
+	fclose(fp);
+	free(block);
+	if (error) {
+		printf("Error: %s is truncated or corrupt\n", filename);
+	}
+
+	printf("Cache model: %u bytes, %u ways, %u byte lines (L1I and L1D)\n", CACHE_SIZE, CACHE_WAYS, CACHE_LINE);
+	printf("%-8s %14s %14s %9s\n", "access", "count", "misses", "miss %");
+	for (kind = 0; kind < NUM_ACCESS; kind++) {
+		printf("%-8s %14lu %14lu %8.3f%%\n", names[kind], (unsigned long)count[kind], (unsigned long)misses[kind],
+			count[kind] ? 100.0 * misses[kind] / count[kind] : 0.0);
+	}
+	printf("L1I %lu/%lu misses, L1D %lu/%lu misses, last cycle %lu\n", (unsigned long)ICACHE.misses,
+		(unsigned long)ICACHE.accesses, (unsigned long)DCACHE.misses, (unsigned long)DCACHE.accesses, (unsigned long)cycle);
+	printf("Replayed %lu accesses in %.3f s (%.2f M accesses/s)\n", (unsigned long)(ICACHE.accesses + DCACHE.accesses),
+		seconds, seconds > 0 ? (ICACHE.accesses + DCACHE.accesses) / seconds / 1e6 : 0.0);
+}
+
+/**************************************************************/
+/* Turn on translation of kseg2 through the page table at table               */
+/**************************************************************/
+int mmu_enable(uint32_t table) {
+	uint32_t entries = MMU.entries, ways = MMU.ways;
+
+	if (entries == 0 || ways == 0 || ways > entries || (entries & (entries - 1)) || (ways & (ways - 1))) {
+		printf("Error: a TLB of %u entries and %u ways is not a power-of-two geometry\n", entries, ways);
+		return -1;
+	}
+	if (table >= MMU_MAPPED_BEGIN || mem_host(table) == NULL || (table & 3)) {
+		printf("Error: page table address 0x%08x must be word aligned, outside kseg2\n", table);
+		return -1;
+	}
+	free(MMU.tlb);
+	MMU.tlb = calloc(entries, sizeof(TLB_Entry));
+	MMU.sets = entries / ways;
+	MMU.table = table;
+	MMU.enabled = TRUE;
+	checkpoint_restart();
+	printf("MMU on: page table at 0x%08x, %u entry %u-way TLB, %u cycle walks\n", table, entries, ways, MMU.walk);
+	return 0;
+}
+
+/**************************************************************/
+/* back to direct addressing everywhere                                                              */
+/**************************************************************/
+void mmu_disable() {
+	free(MMU.tlb);
+	MMU.tlb = NULL;
+	MMU.enabled = FALSE;
+	checkpoint_restart();
+}
+
+/**************************************************************/
+/* invalidate every TLB entry                                                                               */
+/**************************************************************/
+void mmu_flush() {
+	if (MMU.tlb) {
+		memset(MMU.tlb, 0, MMU.entries * sizeof(TLB_Entry));
+	}
+	MMU.clock = 0;
+}
+
+/**************************************************************/
+/* TLB lookup, walking the page table on a miss. In the pipeline a miss  */
+/* freezes every stage for the walk, charged to pc as memory stalls.     */
+/**************************************************************/
+static uint32_t mmu_lookup(uint32_t address, uint32_t pc) {
+	uint32_t vpn = address >> MMU_PAGE_SHIFT, offset = address & ((1 << MMU_PAGE_SHIFT) - 1), pte;
+	TLB_Entry *set = &MMU.tlb[(vpn & (MMU.sets - 1)) * MMU.ways], *victim = set;
+	uint32_t way;
+
+	STATS.TLB_LOOKUPS++;
+	MMU.clock++;
+	for (way = 0; way < MMU.ways; way++) {
+		if (set[way].vpn == vpn + 1) {
+			set[way].used = MMU.clock;
+			return set[way].pfn | offset;
+		}
+		if (set[way].used < victim->used) {
+			victim = &set[way];
+		}
+	}
+
+	STATS.TLB_MISSES++;
+	if (SIM_MODE == MODE_PIPELINE) {
+		MEMORY_WAIT += MMU.walk;
+		MEMORY_WAIT_PC = pc;
+	}
+	pte = mem_read_32(MMU.table + ((vpn - (MMU_MAPPED_BEGIN >> MMU_PAGE_SHIFT)) << 2));
+	if (!(pte & PTE_VALID)) {
+		STATS.TLB_FAULTS++;
+		return address;
+	}
+	victim->vpn = vpn + 1;
+	victim->pfn = pte & ~((1 << MMU_PAGE_SHIFT) - 1);
+	victim->used = MMU.clock;
+	return victim->pfn | offset;
+}
+
+/**************************************************************/
+/* physical address of a guest access; kseg0/1 and user addresses cost  */
+/* one compare                                                                                                           */
+/**************************************************************/
+static inline uint32_t mmu_translate(uint32_t address, uint32_t pc) {
+	if (address < MMU_MAPPED_BEGIN || !MMU.enabled) {
+		return address;
+	}
+	return mmu_lookup(address, pc);
+}
+
+/**************************************************************/
+/* the physical address a load or store at address would use now, for   */
+/* the debugger: no TLB update, statistics or walk time                              */
+/**************************************************************/
+static uint32_t mmu_peek(uint32_t address) {
+	uint32_t vpn = address >> MMU_PAGE_SHIFT, offset = address & ((1 << MMU_PAGE_SHIFT) - 1), pte, way;
+	TLB_Entry *set;
+
+	if (address < MMU_MAPPED_BEGIN || !MMU.enabled) {
+		return address;
+	}
+	set = &MMU.tlb[(vpn & (MMU.sets - 1)) * MMU.ways];
+	for (way = 0; way < MMU.ways; way++) {
+		if (set[way].vpn == vpn + 1) {
+			return set[way].pfn | offset;
+		}
+	}
+	pte = mem_read_32(MMU.table + ((vpn - (MMU_MAPPED_BEGIN >> MMU_PAGE_SHIFT)) << 2));
+	return pte & PTE_VALID ? (pte & ~((1 << MMU_PAGE_SHIFT) - 1)) | offset : address;
+}
+
+/**************************************************************/
+/* start writing interval statistics every INTERVAL_CYCLES cycles        */
+/**************************************************************/
+void interval_start(char *filename) {
+	size_t length = strlen(filename);
+	int i;
+
+	interval_stop();
+	if (INTERVAL_CYCLES == 0) {
+		INTERVAL_CYCLES = INTERVAL_DEFAULT;
+	}
+	INTERVAL_FILE = fopen(filename, "wb");
+	if (INTERVAL_FILE == NULL) {
+		printf("Error: Can't open interval file %s\n", filename);
+		return;
+	}
+	setvbuf(INTERVAL_FILE, NULL, _IOFBF, 1 << 20);
+	INTERVAL_FORMAT = (length > 4 && strcmp(filename + length - 4, ".bin") == 0) ? INTERVAL_BINARY : INTERVAL_CSV;
+	/* the binary header records INTERVAL_CYCLES, which an interval_cycles */
+	/* option after this one may still change: write it with the first sample */
+	INTERVAL_HEADER = INTERVAL_FORMAT == INTERVAL_BINARY;
+	if (INTERVAL_FORMAT == INTERVAL_CSV) {
+		fprintf(INTERVAL_FILE, "cycle,cycles,instructions,cpi,data_stalls,load_use_stalls,control_stalls,flushes,forwards");
+		for (i = 0; i < NUM_MIX; i++) {
+			fprintf(INTERVAL_FILE, ",%s", MIX_NAMES[i]);
+		}
+		fprintf(INTERVAL_FILE, "\n");
+	}
+	memset(&INTERVAL_LAST, 0, sizeof(INTERVAL_LAST));
+	INTERVAL_LAST.cycle = CYCLE_COUNT;
+	INTERVAL_LAST.instructions = INSTRUCTION_COUNT;
+	INTERVAL_LAST.data_stalls = STATS.DATA_STALLS;
+	INTERVAL_LAST.load_use_stalls = STATS.LOAD_USE_STALLS;
+	INTERVAL_LAST.control_stalls = STATS.CONTROL_STALLS;
+	INTERVAL_LAST.flushes = STATS.FLUSHES;
+	INTERVAL_LAST.forwards = STATS.FORWARDS;
+	memcpy(INTERVAL_LAST.mix, STATS.MIX, sizeof(INTERVAL_LAST.mix));
+	INTERVAL_LEFT = INTERVAL_CYCLES;
+	printf("Writing interval statistics every %u cycles to %s\n", INTERVAL_CYCLES, filename);
+}
+
+/**************************************************************/
+/* write the binary header once INTERVAL_CYCLES is final                        */
+/**************************************************************/
+static void interval_header() {
+	uint32_t header[4];
+
+	if (!INTERVAL_HEADER) {
+		return;
+	}
+	header[0] = INTERVAL_MAGIC;
+	header[1] = INTERVAL_VERSION;
+	header[2] = INTERVAL_CYCLES;
+	header[3] = sizeof(Interval_Record);
+	fwrite(header, sizeof(header), 1, INTERVAL_FILE);
+	INTERVAL_HEADER = FALSE;
+}
+
+/**************************************************************/
+/* append the counter deltas since the previous sample                           */
+/**************************************************************/
+void interval_sample() {
+	Interval_Record record;
+	int i;
+	PROF_START();
+
+	interval_header();
+
+	record.cycle = CYCLE_COUNT;
+	record.cycles = CYCLE_COUNT - INTERVAL_LAST.cycle;
+	record.instructions = INSTRUCTION_COUNT - INTERVAL_LAST.instructions;
+	record.data_stalls = STATS.DATA_STALLS - INTERVAL_LAST.data_stalls;
+	record.load_use_stalls = STATS.LOAD_USE_STALLS - INTERVAL_LAST.load_use_stalls;
+	record.control_stalls = STATS.CONTROL_STALLS - INTERVAL_LAST.control_stalls;
+	record.flushes = STATS.FLUSHES - INTERVAL_LAST.flushes;
+	record.forwards = STATS.FORWARDS - INTERVAL_LAST.forwards;
+	for (i = 0; i < NUM_MIX; i++) {
+		record.mix[i] = STATS.MIX[i] - INTERVAL_LAST.mix[i];
+	}
+
+	if (INTERVAL_FORMAT == INTERVAL_BINARY) {
+		fwrite(&record, sizeof(record), 1, INTERVAL_FILE);
+	}else {
+		fprintf(INTERVAL_FILE, "%lu,%lu,%lu,%.4f,%lu,%lu,%lu,%lu,%lu", (unsigned long)record.cycle,
+			(unsigned long)record.cycles, (unsigned long)record.instructions,
+			record.instructions ? (double)record.cycles / record.instructions : 0.0,
+			(unsigned long)record.data_stalls, (unsigned long)record.load_use_stalls,
+			(unsigned long)record.control_stalls, (unsigned long)record.flushes, (unsigned long)record.forwards);
+		for (i = 0; i < NUM_MIX; i++) {
+			fprintf(INTERVAL_FILE, ",%lu", (unsigned long)record.mix[i]);
+		}
+		fputc('\n', INTERVAL_FILE);
+	}
+
+	/* the running totals become the base of the next interval */
+	INTERVAL_LAST.cycle = CYCLE_COUNT;
+	INTERVAL_LAST.instructions = INSTRUCTION_COUNT;
+	INTERVAL_LAST.data_stalls += record.data_stalls;
+	INTERVAL_LAST.load_use_stalls += record.load_use_stalls;
+	INTERVAL_LAST.control_stalls += record.control_stalls;
+	INTERVAL_LAST.flushes += record.flushes;
+	INTERVAL_LAST.forwards += record.forwards;
+	for (i = 0; i < NUM_MIX; i++) {
+		INTERVAL_LAST.mix[i] += record.mix[i];
+	}
+	INTERVAL_LEFT = INTERVAL_CYCLES;
+	PROF_STOP(PROF_TRACE);
+}
+
+/**************************************************************/
+/* write the partial last interval and close the time series                   */
+/**************************************************************/
+void interval_stop() {
+	if (INTERVAL_FILE == NULL) {
+		return;
+	}
+	if (CYCLE_COUNT != INTERVAL_LAST.cycle) {
+		interval_sample();
+	}
+	interval_header();
+	fclose(INTERVAL_FILE);
+	INTERVAL_FILE = NULL;
+}
+
+/**************************************************************/
+/* publish live statistics to a memory-mapped file every LIVE_CYCLES    */
+/**************************************************************/
+void live_start(char *filename) {
+	int fd;
+
+	live_stop();
+	if (LIVE_CYCLES == 0) {
+		LIVE_CYCLES = LIVE_DEFAULT;
+	}
+	fd = open(filename, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0 || ftruncate(fd, sizeof(Live_Stats)) != 0) {
+		printf("Error: Can't create live statistics file %s\n", filename);
+		if (fd >= 0) {
+			close(fd);
+		}
+		return;
+	}
+	LIVE = mmap(NULL, sizeof(Live_Stats), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (LIVE == MAP_FAILED) {
+		printf("Error: Can't map live statistics file %s\n", filename);
+		LIVE = NULL;
+		return;
+	}
+	LIVE->version = LIVE_VERSION;
+	LIVE->pid = getpid();
+	memcpy(LIVE->program, prog_file, sizeof(LIVE->program) - 1);
+	live_publish();
+	/* readers check the magic last, so they never see a half-initialized file */
+	__atomic_store_n(&LIVE->magic, LIVE_MAGIC, __ATOMIC_RELEASE);
+	printf("Publishing live statistics every %u cycles to %s\n", LIVE_CYCLES, filename);
+}
+
+/**************************************************************/
+/* update the live statistics under the sequence lock                              */
+/**************************************************************/
+void live_publish() {
+	live_write_begin(LIVE);
+	LIVE->running = RUN_FLAG;
+	LIVE->pc = CURRENT_STATE.PC;
+	LIVE->cycles = CYCLE_COUNT;
+	LIVE->instructions = INSTRUCTION_COUNT;
+	LIVE->data_stalls = STATS.DATA_STALLS;
+	LIVE->load_use_stalls = STATS.LOAD_USE_STALLS;
+	LIVE->control_stalls = STATS.CONTROL_STALLS;
+	LIVE->flushes = STATS.FLUSHES;
+	LIVE->forwards = STATS.FORWARDS;
+	live_write_end(LIVE);
+	LIVE_LEFT = LIVE_CYCLES;
+}
+
+/**************************************************************/
+/* final update and unmap; the file keeps the last snapshot                  */
+/**************************************************************/
+void live_stop() {
+	if (LIVE == NULL) {
+		return;
+	}
+	live_publish();
+	munmap(LIVE, sizeof(Live_Stats));
+	LIVE = NULL;
+}
+
+/**************************************************************/
+/* hotspot counter for the instruction at pc, NULL if not profiling        */
+/**************************************************************/
+static inline Hotspot_Counter *hotspot_at(uint32_t pc) {
+	if (HOTSPOT == NULL || pc < MEM_TEXT_BEGIN || HOTSPOT_INDEX(pc) >= PROGRAM_SIZE) {
+		return NULL;
+	}
+	return &HOTSPOT[HOTSPOT_INDEX(pc)];
+}
+
+/**************************************************************/
+/* start (or restart) the guest hotspot profile                                      */
+/**************************************************************/
+void hotspot_enable() {
+	free(HOTSPOT);
+	HOTSPOT = calloc(PROGRAM_SIZE ? PROGRAM_SIZE : 1, sizeof(Hotspot_Counter));
+}
+
+/**************************************************************/
+/* does the instruction end a basic block; *target gets its static target  */
+/**************************************************************/
+static int ends_block(uint32_t pc, uint32_t instruction, uint32_t *target) {
+	const Instruction_Info *info = &INSTRUCTIONS[decode(instruction)];
+
+	*target = 0;
+	if (info->kind == KIND_BRANCH) {
+		*target = pc + ((uint32_t)(int32_t)(int16_t)(instruction & 0xFFFF) << 2);
+		return TRUE;
+	}
+	if (info->format == FMT_JUMP) {
+		*target = (pc & 0xF0000000) | ((instruction & 0x3FFFFFF) << 2);
+	}
+	return info->kind == KIND_JUMP || info->kind == KIND_SYSCALL;
+}
+
+static Hotspot_Counter *hotspot_sort_base;
+
+static int hotspot_cycles_desc(const void *a, const void *b) {
+	Hotspot_Counter *x = &hotspot_sort_base[*(const uint32_t *)a];
+	Hotspot_Counter *y = &hotspot_sort_base[*(const uint32_t *)b];
+	uint64_t cx = x->retired + x->stalls, cy = y->retired + y->stalls;
+
+	return cx < cy ? 1 : (cx > cy ? -1 : 0);
+}
+
+/**************************************************************/
+/* index of the first instruction of each basic block                                 */
+/**************************************************************/
+static uint32_t *hotspot_blocks(uint32_t *count) {
+	uint8_t *leader = calloc(PROGRAM_SIZE + 1, 1);
+	uint32_t *blocks;
+	uint32_t i, n = 0, target;
+
+	leader[0] = TRUE;
+	for (i = 0; i < PROGRAM_SIZE; i++) {
+		uint32_t pc = MEM_TEXT_BEGIN + 4 * i;
+		if (ends_block(pc, mem_read_32(pc), &target)) {
+			leader[i + 1] = TRUE;
+			if (target >= MEM_TEXT_BEGIN && HOTSPOT_INDEX(target) < PROGRAM_SIZE) {
+				leader[HOTSPOT_INDEX(target)] = TRUE;
+			}
+		}
+	}
+	blocks = malloc((PROGRAM_SIZE + 1) * sizeof(uint32_t));
+	for (i = 0; i < PROGRAM_SIZE; i++) {
+		if (leader[i]) {
+			blocks[n++] = i;
+		}
+	}
+	blocks[n] = PROGRAM_SIZE;
+	free(leader);
+	*count = n;
+	return blocks;
+}
+
+/**************************************************************/
+/* print the top instructions and basic blocks by cycles charged          */
+/**************************************************************/
+void hotspot_report(int top) {
+	uint32_t *order, *blocks, num_blocks, i, j;
+	Hotspot_Counter *block_sum;
+	uint64_t total = 0;
+
+	if (HOTSPOT == NULL) {
+		printf("Hotspot profiling is off (hotspot on)\n");
+		return;
+	}
+	for (i = 0; i < PROGRAM_SIZE; i++) {
+		total += HOTSPOT[i].retired + HOTSPOT[i].stalls;
+	}
+	if (total == 0) {
+		total = 1;
+	}
+
+	order = malloc(PROGRAM_SIZE * sizeof(uint32_t));
+	for (i = 0; i < PROGRAM_SIZE; i++) {
+		order[i] = i;
+	}
+	hotspot_sort_base = HOTSPOT;
+	qsort(order, PROGRAM_SIZE, sizeof(uint32_t), hotspot_cycles_desc);
+
+	printf("-------------------------------------\n");
+	printf("Top %d instructions (cycles = retired + stalls charged)\n", top);
+	printf("-------------------------------------\n");
+	printf("%-10s %10s %10s %10s %7s  %s\n", "PC", "retired", "stalls", "flushes", "cycles", "instruction");
+	for (i = 0; i < PROGRAM_SIZE && i < (uint32_t)top; i++) {
+		Hotspot_Counter *h = &HOTSPOT[order[i]];
+		if (h->retired + h->stalls == 0) {
+			break;
+		}
+		printf("0x%08x %10lu %10lu %10lu %6.2f%%  ", MEM_TEXT_BEGIN + 4 * order[i], (unsigned long)h->retired,
+			(unsigned long)h->stalls, (unsigned long)h->flushes, 100.0 * (h->retired + h->stalls) / total);
+		print_instruction(MEM_TEXT_BEGIN + 4 * order[i]);
+	}
+
+	/* one summed counter per block, sorted the same way */
+	blocks = hotspot_blocks(&num_blocks);
+	block_sum = calloc(num_blocks ? num_blocks : 1, sizeof(Hotspot_Counter));
+	for (i = 0; i < num_blocks; i++) {
+		for (j = blocks[i]; j < blocks[i + 1]; j++) {
+			block_sum[i].retired += HOTSPOT[j].retired;
+			block_sum[i].stalls += HOTSPOT[j].stalls;
+			block_sum[i].flushes += HOTSPOT[j].flushes;
+		}
+		order[i] = i;
+	}
+	hotspot_sort_base = block_sum;
+	qsort(order, num_blocks, sizeof(uint32_t), hotspot_cycles_desc);
+
+	printf("-------------------------------------\n");
+	printf("Top %d basic blocks\n", top);
+	printf("-------------------------------------\n");
+	for (i = 0; i < num_blocks && i < (uint32_t)top; i++) {
+		Hotspot_Counter *b = &block_sum[order[i]];
+		uint32_t first = blocks[order[i]], last = blocks[order[i] + 1];
+		if (b->retired + b->stalls == 0) {
+			break;
+		}
+		printf("[0x%08x - 0x%08x] entered %lu, cycles %lu (%.2f%%), stalls %lu, flushes %lu\n",
+			MEM_TEXT_BEGIN + 4 * first, MEM_TEXT_BEGIN + 4 * (last - 1), (unsigned long)HOTSPOT[first].retired,
+			(unsigned long)(b->retired + b->stalls), 100.0 * (b->retired + b->stalls) / total,
+			(unsigned long)b->stalls, (unsigned long)b->flushes);
+		for (j = first; j < last; j++) {
+			printf("\t%10lu %10lu  ", (unsigned long)HOTSPOT[j].retired, (unsigned long)HOTSPOT[j].stalls);
+			print_instruction(MEM_TEXT_BEGIN + 4 * j);
+		}
+	}
+	printf("-------------------------------------\n");
+	free(block_sum);
+	free(blocks);
+	free(order);
+}
+
+/**************************************************************/
+/* write "block;pc cycles" lines (folded stacks for flamegraph.pl)        */
+/**************************************************************/
+void hotspot_dump(char *filename) {
+	uint32_t *blocks, num_blocks, i, j;
+	FILE *fp;
+
+	if (HOTSPOT == NULL) {
+		printf("Hotspot profiling is off (hotspot on)\n");
+		return;
+	}
+	fp = fopen(filename, "w");
+	if (fp == NULL) {
+		printf("Error: Can't open %s\n", filename);
+		return;
+	}
+	blocks = hotspot_blocks(&num_blocks);
+	for (i = 0; i < num_blocks; i++) {
+		for (j = blocks[i]; j < blocks[i + 1]; j++) {
+			if (HOTSPOT[j].retired + HOTSPOT[j].stalls) {
+				fprintf(fp, "0x%08x;0x%08x %lu\n", MEM_TEXT_BEGIN + 4 * blocks[i], MEM_TEXT_BEGIN + 4 * j,
+					(unsigned long)(HOTSPOT[j].retired + HOTSPOT[j].stalls));
+			}
+		}
+	}
+	free(blocks);
+	fclose(fp);
+}
+
+/**************************************************************/
+/* charge cycles to a CPI stack bucket and, if attributing, to pc          */
+/**************************************************************/
+static inline void cpi_charge_cycles(int cause, uint32_t pc, uint32_t cycles) {
+	STATS.CPI_STACK[cause] += cycles;
+	if (CPI_PC != NULL && pc >= MEM_TEXT_BEGIN && HOTSPOT_INDEX(pc) < PROGRAM_SIZE) {
+		CPI_PC[HOTSPOT_INDEX(pc)].cycles[cause] += cycles;
+	}
+}
+
+static inline void cpi_charge(int cause, uint32_t pc) {
+	cpi_charge_cycles(cause, pc, 1);
+}
+
+/**************************************************************/
+/* Idle fast-forward: while the pipeline is frozen on a memory event    */
+/* (MEMORY_WAIT) every cycle is the same stall. Account up to <limit> */
+/* of them in one step, leaving the last one and any cycle that samples */
+/* statistics to cycle(). Returns the cycles skipped.                                  */
+/**************************************************************/
+uint32_t cycle_skip(uint32_t limit) {
+	uint32_t cycles = MEMORY_WAIT - 1, i;
+
+	if (!FAST_FORWARD || MEMORY_WAIT <= 1 || UNTIL_LENGTH) {
+		return 0;
+	}
+	if (cycles > limit) {
+		cycles = limit;
+	}
+	if (INTERVAL_FILE != NULL && cycles >= INTERVAL_LEFT) {
+		cycles = INTERVAL_LEFT - 1;
+	}
+	if (LIVE != NULL && cycles >= LIVE_LEFT) {
+		cycles = LIVE_LEFT - 1;
+	}
+	if (CHECKPOINT_CYCLES && cycles >= CHECKPOINT_LEFT) {
+		cycles = CHECKPOINT_LEFT - 1;
+	}
+	if (cycles >= DEVICE_NEXT - CYCLE_COUNT) {
+		cycles = DEVICE_NEXT - CYCLE_COUNT - 1;
+	}
+	if (cycles == 0) {
+		return 0;
+	}
+
+	MEMORY_WAIT -= cycles;
+	cpi_charge_cycles(STALL_MEMORY, MEMORY_WAIT_PC, cycles);
+	STATS.SKIPPED_CYCLES += cycles;
+	CYCLE_COUNT += cycles;
+	if (INTERVAL_FILE != NULL) {
+		INTERVAL_LEFT -= cycles;
+	}
+	if (LIVE != NULL) {
+		LIVE_LEFT -= cycles;
+	}
+	if (CHECKPOINT_CYCLES) {
+		CHECKPOINT_LEFT -= cycles;
+	}
+	if (TRACE_LEVEL) {
+		for (i = 0; i < cycles; i++) {
+			printf("STALL\n");
+		}
+	}
+	return cycles;
+}
+
+/**************************************************************/
+/* Analyse the loop closed by the branch at pc into loop; length stays 0  */
+/* unless every iteration provably does the same thing apart from the     */
+/* induction registers (bits 32/33 of the masks below are HI/LO)           */
+/**************************************************************/
+static void spin_analyse(Spin_Loop *loop, uint32_t pc) {
+	uint32_t branch = mem_read_32(pc);
+	uint32_t target = pc + ((uint32_t)(int32_t)(int16_t)(branch & 0xFFFF) << 2);
+	uint32_t length = (pc - target) / 4 + 1, i, r;
+	uint64_t reads[SPIN_MAX_BODY], writes[SPIN_MAX_BODY];
+	uint64_t written = 0, steady;
+
+	memset(loop, 0, sizeof(*loop));
+	loop->pc = pc;
+	loop->target = target;
+	if (INSTRUCTIONS[decode(branch)].kind != KIND_BRANCH || target > pc || length > SPIN_MAX_BODY) {
+		return;
+	}
+
+	for (i = 0; i < length; i++) {
+		uint32_t instruction = mem_read_32(target + 4 * i);
+		const Instruction_Info *info = &INSTRUCTIONS[decode(instruction)];
+		uint32_t rs = (instruction >> 21) & 0x1F, rt = (instruction >> 16) & 0x1F, rd = (instruction >> 11) & 0x1F;
+
+		/* a straight-line body of side-effect free instructions: nothing else can change what it computes */
+		if (i < length - 1 && info->kind != KIND_ALU && info->kind != KIND_LOAD) {
+			return;
+		}
+		reads[i] = (info->reads & READ_RS ? 1ull << rs : 0) | (info->reads & READ_RT ? 1ull << rt : 0) |
+			(info->reads & READ_HI ? 1ull << 32 : 0) | (info->reads & READ_LO ? 1ull << 33 : 0);
+		switch (info->dest) {
+			case DEST_RD:
+				writes[i] = rd ? 1ull << rd : 0;
+				break;
+			case DEST_RT:
+				writes[i] = rt ? 1ull << rt : 0;
+				break;
+			case DEST_HI:
+				writes[i] = 1ull << 32;
+				break;
+			case DEST_LO:
+				writes[i] = 1ull << 33;
+				break;
+			case DEST_HILO:
+				writes[i] = 3ull << 32;
+				break;
+			default:
+				writes[i] = 0;
+		}
+		if (writes[i] & written) {
+			return;
+		}
+		written |= writes[i];
+		loop->mix[info->mix]++;
+
+		/* r = r + imm, r = r + s, r = s + r, r = r - s */
+		r = info->dest == DEST_RT ? rt : rd;
+		if (writes[i] && ((info->dest == DEST_RT && rs == rt && (decode(instruction) == INS_ADDIU || decode(instruction) == INS_ADDI)) ||
+			(rs != rt && (rd == rs || rd == rt) && (decode(instruction) == INS_ADDU || decode(instruction) == INS_ADD)) ||
+			(rs != rt && rd == rs && (decode(instruction) == INS_SUBU || decode(instruction) == INS_SUB)))) {
+			loop->inductions |= 1u << r;
+			loop->step_imm[r] = info->dest == DEST_RT ? (uint32_t)(int32_t)(int16_t)(instruction & 0xFFFF) : 0;
+			loop->step_reg[r] = info->dest == DEST_RT ? 0 : (rd == rs ? rt : rs);
+			loop->step_negate[r] = decode(instruction) == INS_SUBU || decode(instruction) == INS_SUB;
+			reads[i] &= ~(1ull << r);
+		}
+	}
+
+	/* steady: never written, or written from steady registers earlier in the body. */
+	/* After one whole iteration these hold the same value in every iteration;   */
+	/* steps and other results may not depend on an induction.                          */
+	steady = ~written;
+	for (i = 0; i + 1 < length; i++) {
+		if (reads[i] & ~steady) {
+			return;
+		}
+		steady |= writes[i] & ~(uint64_t)loop->inductions;
+	}
+	/* the branch compares steady or induction registers */
+	if (reads[length - 1] & ~steady & ~(uint64_t)loop->inductions) {
+		return;
+	}
+	loop->length = length;
+}
+
+/**************************************************************/
+/* modular inverse of an odd number, mod 2^32                                      */
+/**************************************************************/
+static uint32_t spin_inverse(uint32_t x) {
+	uint32_t inverse = x;
+	int i;
+
+	for (i = 0; i < 5; i++) {
+		inverse *= 2 - x * inverse;
+	}
+	return inverse;
+}
+
+#define SPIN_FOREVER	UINT64_MAX
+
+/**************************************************************/
+/* further iterations of loop whose branch is still taken, given that it  */
+/* was just taken; SPIN_FOREVER if it never falls through                       */
+/**************************************************************/
+static uint64_t spin_trips(Spin_Loop *loop) {
+	uint32_t branch = mem_read_32(loop->pc);
+	uint32_t rs = (branch >> 21) & 0x1F, rt = (branch >> 16) & 0x1F;
+	uint32_t step[2], value[2], regs[2] = { rs, rt }, difference, shift;
+	int32_t x;
+	int64_t c, m;
+	uint32_t id = decode(branch);
+	int i;
+
+	for (i = 0; i < 2; i++) {
+		uint32_t r = regs[i];
+		value[i] = CURRENT_STATE.REGS[r];
+		step[i] = 0;
+		if (loop->inductions & (1u << r)) {
+			step[i] = loop->step_reg[r] ? CURRENT_STATE.REGS[loop->step_reg[r]] : loop->step_imm[r];
+			if (loop->step_negate[r]) {
+				step[i] = -step[i];
+			}
+		}
+	}
+
+	if (id == INS_BEQ || id == INS_BNE) {
+		/* rs - rt moves by a fixed amount each iteration, mod 2^32 */
+		difference = step[0] - step[1];
+		if (difference == 0) {
+			return SPIN_FOREVER;
+		}
+		if (id == INS_BEQ) {
+			return 0;
+		}
+		/* BNE falls through at the first k with value difference + k * difference == 0 */
+		shift = __builtin_ctz(difference);
+		if ((value[1] - value[0]) & ((1u << shift) - 1)) {
+			return SPIN_FOREVER;
+		}
+		return ((uint64_t)(((value[1] - value[0]) >> shift) * spin_inverse(difference >> shift)) &
+			(0xFFFFFFFFull >> shift)) - 1;
+	}
+
+	/* BLTZ, BGEZ, BLEZ, BGTZ: rs moves monotonically until it wraps */
+	x = (int32_t)value[0];
+	c = (int32_t)step[0];
+	if (c == 0) {
+		return SPIN_FOREVER;
+	}
+	if (c > 0) {
+		if (id == INS_BGTZ || id == INS_BGEZ) {
+			return (INT32_MAX - (int64_t)x) / c;
+		}
+		return id == INS_BLEZ ? -(int64_t)x / c : (-(int64_t)x + c - 1) / c - 1;
+	}
+	m = -c;
+	if (id == INS_BLTZ || id == INS_BLEZ) {
+		return ((int64_t)x - INT32_MIN) / m;
+	}
+	return id == INS_BGEZ ? (int64_t)x / m : ((int64_t)x + m - 1) / m - 1;
+}
+
+/**************************************************************/
+/* Spin-loop fast-forward (functional mode): when the branch at          */
+/* SPIN_BRANCH closes a spin loop, account up to <limit> cycles of its    */
+/* iterations in one step, leaving the last one to run. Returns the       */
+/* cycles skipped.                                                                                             */
+/**************************************************************/
+uint32_t spin_skip(uint32_t limit) {
+	uint32_t pc = SPIN_BRANCH, steps[MIPS_REGS], cycles, i, r;
+	Spin_Loop *loop;
+	uint64_t trips;
+	int polled;
+
+	SPIN_BRANCH = 0;
+	/* only when this branch was also the last transfer taken has a whole iteration run */
+	if (pc != SPIN_LAST) {
+		SPIN_LAST = pc;
+		return 0;
+	}
+	/* a recorded trace needs every retired instruction */
+	if (!FAST_FORWARD || TRACE_LEVEL || ACCESS_FILE || DEBUG_ARMED || TRACE_MODE == TRACE_RECORD) {
+		return 0;
+	}
+	loop = &SPIN_LOOPS[(pc >> 2) % SPIN_CACHE];
+	if (loop->pc != pc) {
+		spin_analyse(loop, pc);
+	}
+	/* translated loads count TLB lookups */
+	if (loop->length == 0 || (MMU.enabled && loop->mix[MIX_LOAD])) {
+		return 0;
+	}
+	/* loads read the same addresses every iteration; a timer polled there only */
+	/* changes at DEVICE_NEXT, which caps the skip below, other devices may    */
+	/* change on every cycle or read                                                                   */
+	polled = DEVICE_NONE;
+	for (i = 0; NUM_DEVICES && loop->mix[MIX_LOAD] && i < loop->length; i++) {
+		uint32_t instruction = mem_read_32(loop->target + 4 * i), address;
+		if (INSTRUCTIONS[decode(instruction)].kind != KIND_LOAD) {
+			continue;
+		}
+		address = CURRENT_STATE.REGS[(instruction >> 21) & 0x1F] + (uint32_t)(int32_t)(int16_t)(instruction & 0xFFFF);
+		if (device_polled(address) == DEVICE_VOLATILE) {
+			return 0;
+		}
+		if (device_polled(address) == DEVICE_STEADY) {
+			polled = DEVICE_STEADY;
+		}
+	}
+	/* the last iteration must have read the device after its latest tick */
+	if (polled == DEVICE_STEADY && DEVICE_TICKED + loop->length > CYCLE_COUNT) {
+		return 0;
+	}
+
+	trips = spin_trips(loop);
+	/* a loop polling a running timer may exit once it ticks */
+	if (trips == SPIN_FOREVER && limit == UINT32_MAX && (polled == DEVICE_NONE || DEVICE_NEXT == DEVICE_NEVER)) {
+		printf("Spin loop at 0x%08x never exits: simulation stopped\n", pc);
+		RUN_FLAG = FALSE;
+		return 0;
+	}
+	if (INTERVAL_FILE != NULL && limit >= INTERVAL_LEFT) {
+		limit = INTERVAL_LEFT - 1;
+	}
+	if (LIVE != NULL && limit >= LIVE_LEFT) {
+		limit = LIVE_LEFT - 1;
+	}
+	if (CHECKPOINT_CYCLES && limit >= CHECKPOINT_LEFT) {
+		limit = CHECKPOINT_LEFT - 1;
+	}
+	if (limit >= DEVICE_NEXT - CYCLE_COUNT) {
+		limit = DEVICE_NEXT - CYCLE_COUNT - 1;
+	}
+	if (trips > limit / loop->length) {
+		trips = limit / loop->length;
+	}
+	if (trips == 0) {
+		return 0;
+	}
+
+	for (r = 0; r < MIPS_REGS; r++) {
+		if (loop->inductions & (1u << r)) {
+			steps[r] = loop->step_reg[r] ? CURRENT_STATE.REGS[loop->step_reg[r]] : loop->step_imm[r];
+			steps[r] = loop->step_negate[r] ? -steps[r] : steps[r];
+		}
+	}
+	for (r = 0; r < MIPS_REGS; r++) {
+		if (loop->inductions & (1u << r)) {
+			CURRENT_STATE.REGS[r] += steps[r] * (uint32_t)trips;
+			NEXT_STATE.REGS[r] = CURRENT_STATE.REGS[r];
+		}
+	}
+
+	cycles = trips * loop->length;
+	INSTRUCTION_COUNT += cycles;
+	CYCLE_COUNT += cycles;
+	STATS.SPIN_ITERATIONS += trips;
+	for (i = 0; i < NUM_MIX; i++) {
+		STATS.MIX[i] += trips * loop->mix[i];
+	}
+	for (i = 0; i < loop->length; i++) {
+		cpi_charge_cycles(STALL_NONE, loop->target + 4 * i, trips);
+		if (hotspot_at(loop->target + 4 * i)) {
+			hotspot_at(loop->target + 4 * i)->retired += trips;
+		}
+	}
+	if (INTERVAL_FILE != NULL) {
+		INTERVAL_LEFT -= cycles;
+	}
+	if (LIVE != NULL) {
+		LIVE_LEFT -= cycles;
+	}
+	if (CHECKPOINT_CYCLES) {
+		CHECKPOINT_LEFT -= cycles;
+	}
+	return cycles;
+}
+
+static const char *INTERCEPT_NAMES[NUM_INTERCEPT_ROUTINES] = { "memcpy", "memset", "strlen" };
+
+/**************************************************************/
+/* run <routine> on the host whenever control reaches pc                        */
+/**************************************************************/
+int intercept_add(char *routine, uint32_t pc) {
+	int i, which;
+
+	for (which = 0; which < NUM_INTERCEPT_ROUTINES && strcmp(routine, INTERCEPT_NAMES[which]) != 0; which++);
+	if (which == NUM_INTERCEPT_ROUTINES || (pc & 3)) {
+		printf("Error: can't intercept %s at 0x%08x (memcpy, memset or strlen at a word address)\n", routine, pc);
+		return -1;
+	}
+	for (i = 0; i < NUM_INTERCEPTS && INTERCEPTS[i].pc != pc; i++);
+	if (i == MAX_INTERCEPTS) {
+		printf("Error: at most %d intercepted routines\n", MAX_INTERCEPTS);
+		return -1;
+	}
+	INTERCEPTS[i].pc = pc;
+	INTERCEPTS[i].routine = which;
+	if (i == NUM_INTERCEPTS) {
+		NUM_INTERCEPTS++;
+	}
+	checkpoint_restart();
+	return 0;
+}
+
+void intercept_clear() {
+	NUM_INTERCEPTS = 0;
+	checkpoint_restart();
+}
+
+/**************************************************************/
+/* intercept entered at pc, NULL if none. A memory access trace needs   */
+/* every load and store, so the guest code runs while one is recorded.  */
+/**************************************************************/
+static inline Intercept *intercept_at(uint32_t pc) {
+	int i;
+
+	if (ACCESS_FILE) {
+		return NULL;
+	}
+	for (i = 0; i < NUM_INTERCEPTS; i++) {
+		if (INTERCEPTS[i].pc == pc) {
+			return &INTERCEPTS[i];
+		}
+	}
+	return NULL;
+}
+
+/**************************************************************/
+/* host bytes behind guest address up to the end of its page, shortening */
+/* *length to fit; NULL if unmapped or, for a store, read-only                  */
+/**************************************************************/
+static uint8_t *intercept_span(uint32_t address, uint32_t pc, uint32_t *length, int store) {
+	uint32_t room = (1 << MMU_PAGE_SHIFT) - (address & ((1 << MMU_PAGE_SHIFT) - 1));
+
+	if (*length > room) {
+		*length = room;
+	}
+	address = mmu_translate(address, pc);
+	if (store && READONLY_MAPPINGS && mem_store_dropped(address, *length)) {
+		return NULL;
+	}
+	if (store) {
+		mem_store_page(address);
+	}
+	return mem_host(address);
+}
+
+/**************************************************************/
+/* Execute an intercepted routine with the libc routine of the host, page */
+/* by page, on the registers as NEXT_STATE holds them, and return to $ra.  */
+/* The pipeline is frozen for the modelled cost; unmapped source bytes   */
+/* read as zero, as they would from the guest.                                         */
+/**************************************************************/
+static void intercept_call(Intercept *intercept) {
+	uint32_t pc = intercept->pc;
+	uint32_t a0 = NEXT_STATE.REGS[4], a1 = NEXT_STATE.REGS[5], a2 = NEXT_STATE.REGS[6];
+	uint32_t done = 0, chunk, bytes, result = a0;
+	uint8_t *to, *from;
+
+	switch (intercept->routine) {
+		case INTERCEPT_MEMCPY:
+			for (done = 0; done < a2; done += chunk) {
+				chunk = a2 - done;
+				from = intercept_span(a1 + done, pc, &chunk, FALSE);
+				to = intercept_span(a0 + done, pc, &chunk, TRUE);
+				if (to != NULL && from != NULL) {
+					memmove(to, from, chunk);
+				}else if (to != NULL) {
+					memset(to, 0, chunk);
+				}
+			}
+			bytes = a2;
+			break;
+		case INTERCEPT_MEMSET:
+			for (done = 0; done < a2; done += chunk) {
+				chunk = a2 - done;
+				to = intercept_span(a0 + done, pc, &chunk, TRUE);
+				if (to != NULL) {
+					memset(to, a1 & 0xFF, chunk);
+				}
+			}
+			bytes = a2;
+			break;
+		default:
+			for (;; done += chunk) {
+				chunk = 1 << MMU_PAGE_SHIFT;
+				from = intercept_span(a0 + done, pc, &chunk, FALSE);
+				if (from == NULL) {
+					break;
+				}
+				to = memchr(from, 0, chunk);
+				if (to != NULL) {
+					done += to - from;
+					break;
+				}
+			}
+			result = done;
+			bytes = done + 1;
+			break;
+	}
+
+	NEXT_STATE.REGS[2] = result;
+	STATE_DIRTY |= 1u << 2;
+	NEXT_STATE.PC = NEXT_STATE.REGS[31];
+	STATS.INTERCEPTED_CALLS++;
+	STATS.INTERCEPTED_BYTES += bytes;
+	if (SIM_MODE == MODE_PIPELINE) {
+		MEMORY_WAIT += INTERCEPT_CYCLES + (INTERCEPT_RATE ? (bytes + INTERCEPT_RATE - 1) / INTERCEPT_RATE : 0);
+		MEMORY_WAIT_PC = pc;
+	}
+}
+
+/**************************************************************/
+/* recompute DEBUG_ARMED after a stop is set or cleared                      */
+/**************************************************************/
+static void debug_arm() {
+	DEBUG_ARMED = NUM_BREAKPOINTS || NUM_WATCHPOINTS || UNTIL_LENGTH;
+}
+
+/**************************************************************/
+/* is there a breakpoint on the instruction at pc                                     */
+/**************************************************************/
+static inline int break_at(uint32_t pc) {
+	uint32_t index = HOTSPOT_INDEX(pc);
+	return BREAKPOINTS != NULL && pc >= MEM_TEXT_BEGIN && index < PROGRAM_SIZE && (BREAKPOINTS[index >> 6] >> (index & 63) & 1);
+}
+
+/**************************************************************/
+/* stop before the instruction at pc retires                                         */
+/**************************************************************/
+int break_add(uint32_t pc) {
+	uint32_t index = HOTSPOT_INDEX(pc);
+
+	if ((pc & 3) || pc < MEM_TEXT_BEGIN || index >= PROGRAM_SIZE) {
+		printf("Error: 0x%08x is not an instruction of the program\n", pc);
+		return -1;
+	}
+	if (BREAKPOINTS == NULL) {
+		BREAKPOINTS = calloc((PROGRAM_SIZE + 63) / 64, sizeof(uint64_t));
+	}
+	if (!(BREAKPOINTS[index >> 6] >> (index & 63) & 1)) {
+		BREAKPOINTS[index >> 6] |= 1ull << (index & 63);
+		NUM_BREAKPOINTS++;
+	}
+	debug_arm();
+	return 0;
+}
+
+void break_remove(uint32_t pc) {
+	uint32_t index = HOTSPOT_INDEX(pc);
+
+	if (break_at(pc)) {
+		BREAKPOINTS[index >> 6] &= ~(1ull << (index & 63));
+		NUM_BREAKPOINTS--;
+		debug_arm();
+	}
+}
+
+void break_clear() {
+	free(BREAKPOINTS);
+	BREAKPOINTS = NULL;
+	NUM_BREAKPOINTS = 0;
+	debug_arm();
+}
+
+/**************************************************************/
+/* stop after a load (WATCH_READ) or store (WATCH_WRITE) touches      */
+/* [address, address + size)                                                                    */
+/**************************************************************/
+int watch_add(uint32_t address, uint32_t size, int mode) {
+	uint32_t page;
+
+	if (size == 0 || address + (size - 1) < address || mode == 0) {
+		printf("Error: invalid watchpoint 0x%08x, %u bytes\n", address, size);
+		return -1;
+	}
+	if (NUM_WATCHPOINTS == MAX_WATCHPOINTS) {
+		printf("Error: at most %d watchpoints\n", MAX_WATCHPOINTS);
+		return -1;
+	}
+	if (WATCH_PAGES == NULL) {
+		WATCH_PAGES = calloc(1 << (32 - MMU_PAGE_SHIFT), 1);
+	}
+	WATCHPOINTS[NUM_WATCHPOINTS].begin = address;
+	WATCHPOINTS[NUM_WATCHPOINTS].end = address + (size - 1);
+	WATCHPOINTS[NUM_WATCHPOINTS].mode = mode;
+	NUM_WATCHPOINTS++;
+	for (page = address >> MMU_PAGE_SHIFT; page <= (address + (size - 1)) >> MMU_PAGE_SHIFT; page++) {
+		WATCH_PAGES[page] |= mode;
+	}
+	debug_arm();
+	return 0;
+}
+
+void watch_clear() {
+	free(WATCH_PAGES);
+	WATCH_PAGES = NULL;
+	NUM_WATCHPOINTS = 0;
+	WATCH_HIT.mode = 0;
+	debug_arm();
+}
+
+/**************************************************************/
+/* a flagged page was accessed: record the first watchpoint it hits    */
+/**************************************************************/
+static void watch_match(uint32_t pc, uint32_t address, uint32_t size, int mode) {
+	int i;
+
+	for (i = 0; i < NUM_WATCHPOINTS; i++) {
+		if ((WATCHPOINTS[i].mode & mode) && address <= WATCHPOINTS[i].end && address + (size - 1) >= WATCHPOINTS[i].begin) {
+			WATCH_HIT.mode = mode;
+			WATCH_HIT.pc = pc;
+			WATCH_HIT.address = address;
+			WATCH_HIT.size = size;
+			return;
+		}
+	}
+}
+
+/**************************************************************/
+/* every load and store while WATCH_PAGES is set: one lookup unless   */
+/* its page holds a watchpoint                                                                  */
+/**************************************************************/
+static inline void watch_access(uint32_t pc, uint32_t address, uint32_t size, int mode) {
+	if (WATCH_PAGES[address >> MMU_PAGE_SHIFT] & mode) {
+		watch_match(pc, address, size, mode);
+	}
+}
+
+/**************************************************************/
+/* PC of the instruction that retires next, 0 for a pipeline bubble       */
+/**************************************************************/
+static inline uint32_t retire_pc() {
+	return SIM_MODE == MODE_FUNCTIONAL ? CURRENT_STATE.PC : WB_MEM.PC;
+}
+
+/**************************************************************/
+/* run until conditions:                                                                                    */
+/*   condition  := comparison { (&& | ||) comparison }, && binds tighter */
+/*   comparison := operand (== | != | < | <= | > | >=) operand          */
+/*   operand    := $<n> | r<n> | pc | hi | lo | cycles | instructions      */
+/*                 | number                                                                             */
+/* Values compare as unsigned 32-bit numbers; pc is retire_pc().            */
+/**************************************************************/
+static char *until_space(char *p) {
+	while (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r') {
+		p++;
+	}
+	return p;
+}
+
+static char *until_operand(char *p, Until_Op *op) {
+	static const struct { const char *name; uint32_t op; } names[] = {
+		{ "pc", UNTIL_PC }, { "hi", UNTIL_HI }, { "lo", UNTIL_LO },
+		{ "cycles", UNTIL_CYCLES }, { "instructions", UNTIL_INSTRUCTIONS }
+	};
+	char *end;
+	uint32_t i;
+
+	p = until_space(p);
+	if (*p == '$' || *p == 'r' || *p == 'R') {
+		op->op = UNTIL_REG;
+		op->arg = strtoul(p + 1, &end, 10);
+		return end == p + 1 || op->arg >= MIPS_REGS ? NULL : end;
+	}
+	for (i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+		size_t length = strlen(names[i].name);
+		if (strncmp(p, names[i].name, length) == 0 && !isalnum((unsigned char)p[length])) {
+			op->op = names[i].op;
+			return p + length;
+		}
+	}
+	op->op = UNTIL_CONST;
+	op->arg = strtoul(p, &end, 0);
+	return end == p ? NULL : end;
+}
+
+static char *until_comparison(char *p, Until_Op *code, int *length) {
+	static const struct { const char *name; uint32_t op; } operators[] = {
+		{ "==", UNTIL_EQ }, { "!=", UNTIL_NE }, { "<=", UNTIL_LE }, { ">=", UNTIL_GE },
+		{ "<", UNTIL_LT }, { ">", UNTIL_GT }
+	};
+	uint32_t i;
+
+	if ((p = until_operand(p, &code[*length])) == NULL) {
+		return NULL;
+	}
+	p = until_space(p);
+	for (i = 0; i < sizeof(operators) / sizeof(operators[0]); i++) {
+		if (strncmp(p, operators[i].name, strlen(operators[i].name)) == 0) {
+			break;
+		}
+	}
+	if (i == sizeof(operators) / sizeof(operators[0])) {
+		return NULL;
+	}
+	if ((p = until_operand(p + strlen(operators[i].name), &code[*length + 1])) == NULL) {
+		return NULL;
+	}
+	code[*length + 2].op = operators[i].op;
+	*length += 3;
+	return p;
+}
+
+/**************************************************************/
+/* compile condition into UNTIL; -1 and UNTIL unchanged on a syntax error */
+/**************************************************************/
+int until_compile(char *condition) {
+	Until_Op code[MAX_UNTIL];
+	int length = 0, and_pending = FALSE, or_pending = FALSE;
+	char *p = condition;
+
+	for (;;) {
+		if (length + 5 > MAX_UNTIL || (p = until_comparison(p, code, &length)) == NULL) {
+			printf("Error: can't parse condition %s\n", condition);
+			return -1;
+		}
+		if (and_pending) {
+			code[length++].op = UNTIL_AND;
+		}
+		p = until_space(p);
+		if (strncmp(p, "&&", 2) == 0) {
+			and_pending = TRUE;
+			p += 2;
+			continue;
+		}
+		and_pending = FALSE;
+		if (or_pending) {
+			code[length++].op = UNTIL_OR;
+		}
+		if (strncmp(p, "||", 2) == 0) {
+			or_pending = TRUE;
+			p += 2;
+			continue;
+		}
+		if (*p != '\0') {
+			printf("Error: can't parse condition %s\n", condition);
+			return -1;
+		}
+		break;
+	}
+	memcpy(UNTIL, code, length * sizeof(Until_Op));
+	UNTIL_LENGTH = length;
+	debug_arm();
+	return 0;
+}
+
+void until_clear() {
+	UNTIL_LENGTH = 0;
+	debug_arm();
+}
+
+/**************************************************************/
+/* evaluate UNTIL on the committed state                                              */
+/**************************************************************/
+static int until_eval() {
+	uint32_t stack[UNTIL_STACK];
+	int i, depth = 0;
+
+#define UNTIL_PUSH(op, value)	case op: stack[depth++] = (value); break;
+#define UNTIL_BINARY(op, operator) \
+		case op: \
+			depth--; \
+			stack[depth - 1] = stack[depth - 1] operator stack[depth]; \
+			break;
+	for (i = 0; i < UNTIL_LENGTH; i++) {
+		switch (UNTIL[i].op) {
+			UNTIL_PUSH(UNTIL_REG, CURRENT_STATE.REGS[UNTIL[i].arg])
+			UNTIL_PUSH(UNTIL_CONST, UNTIL[i].arg)
+			UNTIL_PUSH(UNTIL_PC, retire_pc())
+			UNTIL_PUSH(UNTIL_HI, CURRENT_STATE.HI)
+			UNTIL_PUSH(UNTIL_LO, CURRENT_STATE.LO)
+			UNTIL_PUSH(UNTIL_CYCLES, CYCLE_COUNT)
+			UNTIL_PUSH(UNTIL_INSTRUCTIONS, INSTRUCTION_COUNT)
+			UNTIL_BINARY(UNTIL_EQ, ==)
+			UNTIL_BINARY(UNTIL_NE, !=)
+			UNTIL_BINARY(UNTIL_LT, <)
+			UNTIL_BINARY(UNTIL_LE, <=)
+			UNTIL_BINARY(UNTIL_GT, >)
+			UNTIL_BINARY(UNTIL_GE, >=)
+			UNTIL_BINARY(UNTIL_AND, &&)
+			UNTIL_BINARY(UNTIL_OR, ||)
+		}
+	}
+#undef UNTIL_PUSH
+#undef UNTIL_BINARY
+	return stack[0];
+}
+
+/**************************************************************/
+/* Between cycles while DEBUG_ARMED: TRUE, after printing why, if the    */
+/* run must stop before the next cycle: a breakpoint stops when its        */
+/* instruction is retire_pc(). Running again passes over the breakpoint */
+/* stopped at.                                                                                                */
+/**************************************************************/
+int debug_stop() {
+	uint32_t pc = retire_pc();
+
+	if (WATCH_HIT.mode) {
+		printf("Watchpoint: %s of %u bytes at 0x%08x by 0x%08x, cycle %u\n\n", WATCH_HIT.mode == WATCH_WRITE ? "store" : "load",
+			WATCH_HIT.size, WATCH_HIT.address, WATCH_HIT.pc, CYCLE_COUNT);
+		WATCH_HIT.mode = 0;
+		return TRUE;
+	}
+	if (UNTIL_LENGTH && until_eval()) {
+		printf("Condition met at cycle %u\n\n", CYCLE_COUNT);
+		return TRUE;
+	}
+	if (break_at(pc) && (pc != BREAK_PC || INSTRUCTION_COUNT != BREAK_COUNT)) {
+		BREAK_PC = pc;
+		BREAK_COUNT = INSTRUCTION_COUNT;
+		printf("Breakpoint at 0x%08x, cycle %u\n\n", pc, CYCLE_COUNT);
+		return TRUE;
+	}
+	return FALSE;
+}
+
+/**************************************************************/
+/* checkpoint every <cycles> cycles from now on                                   */
+/**************************************************************/
+void checkpoint_start(uint32_t cycles) {
+	checkpoint_stop();
+	if (cycles == 0) {
+		return;
+	}
+	CHECKPOINT_PAGES = calloc(1u << (32 - MMU_PAGE_SHIFT), 1);
+	CHECKPOINT_CYCLES = cycles;
+	checkpoint_take();
+	printf("Checkpoint every %u cycles, up to %lu MB of history\n", cycles, (unsigned long)(CHECKPOINT_BUDGET >> 20));
+}
+
+static void checkpoint_free(Checkpoint *checkpoint) {
+	uint32_t i;
+
+	for (i = 0; i < checkpoint->num_pages; i++) {
+		free(checkpoint->pages[i].data);
+	}
+	free(checkpoint->pages);
+	free(checkpoint->tlb);
+	CHECKPOINT_BYTES -= checkpoint->bytes;
+}
+
+/**************************************************************/
+/* drop checkpoints [first, NUM_CHECKPOINTS), newest first                 */
+/**************************************************************/
+static void checkpoint_drop(uint32_t first) {
+	uint32_t i;
+
+	while (NUM_CHECKPOINTS > first) {
+		Checkpoint *newest = &CHECKPOINTS[--NUM_CHECKPOINTS];
+		/* only the newest checkpoint's pages are flagged */
+		for (i = 0; i < newest->num_pages; i++) {
+			CHECKPOINT_PAGES[newest->pages[i].address >> MMU_PAGE_SHIFT] = 0;
+		}
+		checkpoint_free(newest);
+	}
+}
+
+void checkpoint_stop() {
+	if (CHECKPOINT_PAGES != NULL) {
+		checkpoint_drop(0);
+	}
+	free(CHECKPOINTS);
+	free(CHECKPOINT_PAGES);
+	CHECKPOINTS = NULL;
+	CHECKPOINT_PAGES = NULL;
+	CHECKPOINT_CAPACITY = 0;
+	CHECKPOINT_CYCLES = 0;
+}
+
+/**************************************************************/
+/* Checkpoint the state between two cycles, then drop the oldest        */
+/* checkpoints while over budget                                                           */
+/**************************************************************/
+void checkpoint_take() {
+	Checkpoint *checkpoint;
+	uint32_t i;
+
+	CHECKPOINT_LEFT = CHECKPOINT_CYCLES;
+	if (NUM_CHECKPOINTS) {
+		/* stores after this point are saved into the new checkpoint */
+		checkpoint = &CHECKPOINTS[NUM_CHECKPOINTS - 1];
+		for (i = 0; i < checkpoint->num_pages; i++) {
+			CHECKPOINT_PAGES[checkpoint->pages[i].address >> MMU_PAGE_SHIFT] = 0;
+		}
+	}
+	if (NUM_CHECKPOINTS == CHECKPOINT_CAPACITY) {
+		CHECKPOINT_CAPACITY = CHECKPOINT_CAPACITY ? 2 * CHECKPOINT_CAPACITY : 64;
+		CHECKPOINTS = realloc(CHECKPOINTS, CHECKPOINT_CAPACITY * sizeof(Checkpoint));
+	}
+	checkpoint = &CHECKPOINTS[NUM_CHECKPOINTS++];
+	memset(checkpoint, 0, sizeof(*checkpoint));
+	checkpoint->cycle = CYCLE_COUNT;
+	checkpoint->instructions = INSTRUCTION_COUNT;
+	checkpoint->state = CURRENT_STATE;
+	checkpoint->latches[0] = ID_IF;
+	checkpoint->latches[1] = EX_ID;
+	checkpoint->latches[2] = MEM_EX;
+	checkpoint->latches[3] = WB_MEM;
+	checkpoint->stats = STATS;
+	checkpoint->run_flag = RUN_FLAG;
+	checkpoint->control_hazard = controlHazard;
+	checkpoint->jump_stall = jumpStall;
+	checkpoint->syscall_pending = SYSCALL_PENDING;
+	checkpoint->memory_wait = MEMORY_WAIT;
+	checkpoint->memory_wait_pc = MEMORY_WAIT_PC;
+	checkpoint->heap_break = HEAP_BREAK;
+	checkpoint->spin_branch = SPIN_BRANCH;
+	checkpoint->spin_last = SPIN_LAST;
+	if (MMU.enabled) {
+		checkpoint->tlb = malloc(MMU.entries * sizeof(TLB_Entry));
+		memcpy(checkpoint->tlb, MMU.tlb, MMU.entries * sizeof(TLB_Entry));
+		checkpoint->tlb_clock = MMU.clock;
+	}
+	memcpy(checkpoint->devices, DEVICES, sizeof(DEVICES));
+	checkpoint->device_next = DEVICE_NEXT;
+	checkpoint->bytes = sizeof(Checkpoint) + (checkpoint->tlb ? MMU.entries * sizeof(TLB_Entry) : 0);
+	CHECKPOINT_BYTES += checkpoint->bytes;
+
+	while (CHECKPOINT_BYTES > CHECKPOINT_BUDGET && NUM_CHECKPOINTS > 1) {
+		checkpoint_free(&CHECKPOINTS[0]);
+		memmove(CHECKPOINTS, CHECKPOINTS + 1, --NUM_CHECKPOINTS * sizeof(Checkpoint));
+	}
+}
+
+/**************************************************************/
+/* Something that can't be replayed happened (host I/O during a cycle): */
+/* history restarts with a checkpoint at the end of this cycle               */
+/**************************************************************/
+void checkpoint_forget() {
+	checkpoint_drop(0);
+	CHECKPOINT_LEFT = 1;
+}
+
+/**************************************************************/
+/* the state was changed from the command line: history restarts now   */
+/**************************************************************/
+void checkpoint_restart() {
+	if (CHECKPOINT_CYCLES) {
+		checkpoint_drop(0);
+		checkpoint_take();
+	}
+}
+
+/**************************************************************/
+/* first store to the page of address since the newest checkpoint: save */
+/* the page as it is                                                                                         */
+/**************************************************************/
+void checkpoint_page(uint32_t address) {
+	Checkpoint *checkpoint;
+	uint8_t *host = mem_host(address & ~(MAP_PAGE - 1));
+
+	if (NUM_CHECKPOINTS == 0 || host == NULL) {
+		return;
+	}
+	checkpoint = &CHECKPOINTS[NUM_CHECKPOINTS - 1];
+	CHECKPOINT_PAGES[address >> MMU_PAGE_SHIFT] = 1;
+	if (checkpoint->num_pages == checkpoint->capacity) {
+		checkpoint->capacity = checkpoint->capacity ? 2 * checkpoint->capacity : 16;
+		checkpoint->pages = realloc(checkpoint->pages, checkpoint->capacity * sizeof(Image_Page));
+	}
+	checkpoint->pages[checkpoint->num_pages].address = address & ~(MAP_PAGE - 1);
+	checkpoint->pages[checkpoint->num_pages].data = malloc(MAP_PAGE);
+	memcpy(checkpoint->pages[checkpoint->num_pages].data, host, MAP_PAGE);
+	checkpoint->num_pages++;
+	checkpoint->bytes += MAP_PAGE + sizeof(Image_Page);
+	CHECKPOINT_BYTES += MAP_PAGE + sizeof(Image_Page);
+}
+
+/**************************************************************/
+/* Return to checkpoint <index>. It becomes the newest: the later ones   */
+/* are dropped, and replaying takes them again.                                  */
+/**************************************************************/
+static void checkpoint_restore(uint32_t index) {
+	Checkpoint *checkpoint;
+	double host_seconds = STATS.HOST_SECONDS;
+	int i;
+	uint32_t j;
+
+	for (i = NUM_CHECKPOINTS - 1; i >= (int)index; i--) {
+		checkpoint = &CHECKPOINTS[i];
+		for (j = 0; j < checkpoint->num_pages; j++) {
+			memcpy(mem_host(checkpoint->pages[j].address), checkpoint->pages[j].data, MAP_PAGE);
+		}
+	}
+	checkpoint = &CHECKPOINTS[index];
+
+	CURRENT_STATE = checkpoint->state;
+	NEXT_STATE = checkpoint->state;
+	STATE_DIRTY = 0;
+	ID_IF = checkpoint->latches[0];
+	EX_ID = checkpoint->latches[1];
+	MEM_EX = checkpoint->latches[2];
+	WB_MEM = checkpoint->latches[3];
+	STATS = checkpoint->stats;
+	STATS.HOST_SECONDS = host_seconds;
+	CYCLE_COUNT = checkpoint->cycle;
+	INSTRUCTION_COUNT = checkpoint->instructions;
+	RUN_FLAG = checkpoint->run_flag;
+	controlHazard = checkpoint->control_hazard;
+	jumpStall = checkpoint->jump_stall;
+	SYSCALL_PENDING = checkpoint->syscall_pending;
+	MEMORY_WAIT = checkpoint->memory_wait;
+	MEMORY_WAIT_PC = checkpoint->memory_wait_pc;
+	HEAP_BREAK = checkpoint->heap_break;
+	SPIN_BRANCH = checkpoint->spin_branch;
+	SPIN_LAST = checkpoint->spin_last;
+	if (checkpoint->tlb != NULL && MMU.enabled) {
+		memcpy(MMU.tlb, checkpoint->tlb, MMU.entries * sizeof(TLB_Entry));
+		MMU.clock = checkpoint->tlb_clock;
+	}
+	memcpy(DEVICES, checkpoint->devices, sizeof(DEVICES));
+	DEVICE_NEXT = checkpoint->device_next;
+	/* a breakpoint stop ahead is a new one again */
+	BREAK_PC = 0;
+	WATCH_HIT.mode = 0;
+	checkpoint_drop(index);
+	checkpoint_take();
+}
+
+/**************************************************************/
+/* re-execute up to cycle <target> without trace or guest output          */
+/**************************************************************/
+static void replay_to(uint32_t target) {
+	int trace = TRACE_LEVEL;
+
+	TRACE_LEVEL = 0;
+	pipeline_select();
+	REPLAYING = TRUE;
+	while (CYCLE_COUNT < target && RUN_FLAG) {
+		if (MEMORY_WAIT > 1) {
+			cycle_skip(target - CYCLE_COUNT - 1);
+		}
+		cycle();
+		if (SPIN_BRANCH) {
+			spin_skip(target - CYCLE_COUNT);
+		}
+	}
+	REPLAYING = FALSE;
+	TRACE_LEVEL = trace;
+	pipeline_select();
+}
+
+/**************************************************************/
+/* why history can't be replayed right now, NULL if it can                    */
+/**************************************************************/
+static const char *reverse_blocked() {
+	if (NUM_CHECKPOINTS == 0) {
+		return "no checkpoints are taken (checkpoint <n>)";
+	}
+	if (TRACE_MODE != TRACE_OFF || ACCESS_FILE != NULL) {
+		return "a trace is being recorded or replayed";
+	}
+	if (INTERVAL_FILE != NULL || LIVE != NULL || HOTSPOT != NULL || CPI_PC != NULL) {
+		return "interval, live, hotspot or cpi statistics would count replayed cycles twice";
+	}
+	return NULL;
+}
+
+/**************************************************************/
+/* go back <cycles> cycles, or to the oldest checkpoint                           */
+/**************************************************************/
+void reverse_step(uint32_t cycles) {
+	const char *blocked = reverse_blocked();
+	uint32_t target = cycles < CYCLE_COUNT ? CYCLE_COUNT - cycles : 0;
+	int index;
+
+	if (blocked != NULL) {
+		printf("Error: can't run backwards: %s\n", blocked);
+		return;
+	}
+	for (index = NUM_CHECKPOINTS - 1; index > 0 && CHECKPOINTS[index].cycle > target; index--);
+	if (CHECKPOINTS[index].cycle > target) {
+		printf("History starts at cycle %u\n", CHECKPOINTS[0].cycle);
+		target = CHECKPOINTS[0].cycle;
+	}
+	checkpoint_restore(index);
+	replay_to(target);
+	printf("Stepped back to cycle %u\n\n", CYCLE_COUNT);
+}
+
+/**************************************************************/
+/* Replay from the current checkpoint up to cycle <end>; TRUE with the    */
+/* last cycle before <origin> at which a forward run would have stopped */
+/* on a breakpoint or watchpoint in *hit                                                   */
+/**************************************************************/
+static int reverse_scan(uint32_t end, uint32_t origin, uint32_t *hit) {
+	uint32_t last_pc = 0, last_count = 0, pc;
+	int found = FALSE, trace = TRACE_LEVEL;
+
+	TRACE_LEVEL = 0;
+	pipeline_select();
+	REPLAYING = TRUE;
+	while (CYCLE_COUNT < end && RUN_FLAG) {
+		pc = retire_pc();
+		if (WATCH_HIT.mode || (break_at(pc) && (pc != last_pc || INSTRUCTION_COUNT != last_count))) {
+			found = TRUE;
+			*hit = CYCLE_COUNT;
+			WATCH_HIT.mode = 0;
+		}
+		if (break_at(pc)) {
+			/* a forward run stops once per retiring instruction */
+			last_pc = pc;
+			last_count = INSTRUCTION_COUNT;
+		}
+		cycle();
+	}
+	/* an access in the segment's last cycle stops at its end */
+	if (WATCH_HIT.mode && CYCLE_COUNT < origin) {
+		found = TRUE;
+		*hit = CYCLE_COUNT;
+	}
+	WATCH_HIT.mode = 0;
+	REPLAYING = FALSE;
+	TRACE_LEVEL = trace;
+	pipeline_select();
+	return found;
+}
+
+/**************************************************************/
+/* Run backwards to the previous breakpoint or watchpoint stop: scan      */
+/* the intervals between checkpoints newest first, then replay to the  */
+/* last stop found                                                                                          */
+/**************************************************************/
+void reverse_continue() {
+	const char *blocked = reverse_blocked();
+	uint32_t origin = CYCLE_COUNT, end = CYCLE_COUNT, start = 0, hit = 0;
+	int index;
+
+	if (blocked != NULL) {
+		printf("Error: can't run backwards: %s\n", blocked);
+		return;
+	}
+	for (;;) {
+		for (index = NUM_CHECKPOINTS - 1; index >= 0 && CHECKPOINTS[index].cycle >= end; index--);
+		if (index < 0) {
+			checkpoint_restore(0);
+			printf("No earlier stop: at the start of the history, cycle %u\n\n", CYCLE_COUNT);
+			return;
+		}
+		start = CHECKPOINTS[index].cycle;
+		checkpoint_restore(index);
+		if (DEBUG_ARMED && reverse_scan(end, origin, &hit)) {
+			break;
+		}
+		end = start;
+	}
+
+	/* replaying took new checkpoints; the budget may have moved the one at start */
+	for (index = NUM_CHECKPOINTS - 1; index > 0 && CHECKPOINTS[index].cycle > start; index--);
+	checkpoint_restore(index);
+	if (hit > CYCLE_COUNT) {
+		replay_to(hit - 1);
+		WATCH_HIT.mode = 0;
+		replay_to(hit);
+	}
+	if (!debug_stop()) {
+		printf("Stopped at cycle %u\n\n", CYCLE_COUNT);
+	}
+}
+
+/**************************************************************/
+/* the next instruction to retire: in the pipeline the oldest one in   */
+/* flight, so registers and pc agree at every stop                                */
+/**************************************************************/
+static uint32_t gdb_pc() {
+	if (SIM_MODE == MODE_PIPELINE) {
+		if (WB_MEM.PC) {
+			return WB_MEM.PC;
+		}
+		if (MEM_EX.PC) {
+			return MEM_EX.PC;
+		}
+		if (EX_ID.PC) {
+			return EX_ID.PC;
+		}
+		if (ID_IF.PC) {
+			return ID_IF.PC;
+		}
+	}
+	return CURRENT_STATE.PC;
+}
+
+/**************************************************************/
+/* gdb changed registers or memory: instructions in flight may have     */
+/* read the old values, so drop them and fetch again from pc. The one in */
+/* WB has done its memory access already and must not run it twice: it  */
+/* retires as it is, and fetching restarts after it, unless gdb moved pc */
+/**************************************************************/
+static void gdb_changed(uint32_t pc) {
+	if (SIM_MODE == MODE_PIPELINE) {
+		if (WB_MEM.PC && pc == WB_MEM.PC) {
+			pc = MEM_EX.PC ? MEM_EX.PC : EX_ID.PC ? EX_ID.PC : ID_IF.PC ? ID_IF.PC : CURRENT_STATE.PC;
+		}else {
+			memset(&WB_MEM, 0, sizeof(WB_MEM));
+		}
+		memset(&ID_IF, 0, sizeof(ID_IF));
+		memset(&EX_ID, 0, sizeof(EX_ID));
+		memset(&MEM_EX, 0, sizeof(MEM_EX));
+		controlHazard = 0;
+		jumpStall = 0;
+		SYSCALL_PENDING = FALSE;
+		MEMORY_WAIT = 0;
+	}
+	CURRENT_STATE.PC = pc;
+	NEXT_STATE = CURRENT_STATE;
+	SPIN_BRANCH = 0;
+	SPIN_LAST = 0;
+	/* code may have been patched */
+	memset(SPIN_LOOPS, 0, sizeof(SPIN_LOOPS));
+	checkpoint_restart();
+}
+
+static uint32_t gdb_reg(int number) {
+	if (number < MIPS_REGS) {
+		return CURRENT_STATE.REGS[number];
+	}
+	switch (number) {
+		case GDB_REG_LO:
+			return CURRENT_STATE.LO;
+		case GDB_REG_HI:
+			return CURRENT_STATE.HI;
+		case GDB_REG_PC:
+			return gdb_pc();
+	}
+	return 0;
+}
+
+/* returns the pc to fetch from afterwards */
+static uint32_t gdb_set_reg(int number, uint32_t value, uint32_t pc) {
+	if (number > 0 && number < MIPS_REGS) {
+		CURRENT_STATE.REGS[number] = value;
+	}else if (number == GDB_REG_LO) {
+		CURRENT_STATE.LO = value;
+	}else if (number == GDB_REG_HI) {
+		CURRENT_STATE.HI = value;
+	}else if (number == GDB_REG_PC) {
+		pc = value;
+	}
+	return pc;
+}
+
+/**************************************************************/
+/* hex in the target's byte order, which is little endian                        */
+/**************************************************************/
+static void gdb_put_word(char *out, uint32_t value) {
+	int i;
+	for (i = 0; i < 4; i++) {
+		sprintf(out + 2 * i, "%02x", (value >> (8 * i)) & 0xFF);
+	}
+}
+
+static uint32_t gdb_get_word(const char *in) {
+	unsigned int byte;
+	uint32_t value = 0;
+	int i;
+	for (i = 0; i < 4; i++) {
+		if (sscanf(in + 2 * i, "%2x", &byte) == 1) {
+			value |= byte << (8 * i);
+		}
+	}
+	return value;
+}
+
+/**************************************************************/
+/* packet framing: $<data>#<checksum>, acknowledged with + or -            */
+/**************************************************************/
+static int gdb_getc(int fd) {
+	unsigned char c;
+	return recv(fd, &c, 1, 0) == 1 ? c : -1;
+}
+
+static void gdb_send(int fd, const char *data) {
+	char packet[2 * GDB_PACKET + 8];
+	uint8_t checksum = 0;
+	int length = strlen(data), i, ack;
+
+	for (i = 0; i < length; i++) {
+		checksum += (uint8_t)data[i];
+	}
+	length = snprintf(packet, sizeof(packet), "$%s#%02x", data, checksum);
+	do {
+		if (send(fd, packet, length, 0) != length) {
+			return;
+		}
+		while ((ack = gdb_getc(fd)) != '+' && ack != '-' && ack >= 0);
+	} while (ack == '-');
+}
+
+/* the next packet's data, NULL once the connection is gone */
+static char *gdb_receive(int fd, char *data) {
+	unsigned int sum;
+	uint8_t checksum;
+	char digits[3] = "";
+	int c, length, high, low;
+
+	for (;;) {
+		while ((c = gdb_getc(fd)) != '$') {
+			if (c < 0) {
+				return NULL;
+			}
+		}
+		checksum = 0;
+		length = 0;
+		while ((c = gdb_getc(fd)) != '#' && c >= 0) {
+			if (length < GDB_PACKET - 1) {
+				data[length++] = c;
+			}
+			checksum += c;
+		}
+		if (c < 0 || (high = gdb_getc(fd)) < 0 || (low = gdb_getc(fd)) < 0) {
+			return NULL;
+		}
+		digits[0] = high;
+		digits[1] = low;
+		data[length] = '\0';
+		if (sscanf(digits, "%2x", &sum) == 1 && sum == checksum) {
+			send(fd, "+", 1, 0);
+			return data;
+		}
+		send(fd, "-", 1, 0);
+	}
+}
+
+/* has gdb sent an interrupt (^C) or hung up */
+static int gdb_interrupted(int fd) {
+	struct pollfd client = { fd, POLLIN, 0 };
+	unsigned char c;
+
+	while (poll(&client, 1, 0) > 0) {
+		if (recv(fd, &c, 1, 0) != 1 || c == 0x03) {
+			return TRUE;
+		}
+	}
+	return FALSE;
+}
+
+/**************************************************************/
+/* Resume until a stop, an interrupt from gdb or the end of the program; */
+/* one instruction retired when step is set. Returns the stop reply.        */
+/**************************************************************/
+static const char *gdb_resume(int fd, int step) {
+	uint32_t retired = INSTRUCTION_COUNT, polls = 0;
+	double start = host_time();
+	const char *reply = "S05";
+
+	while (RUN_FLAG) {
+		if (step && INSTRUCTION_COUNT != retired && gdb_pc() != 0) {
+			break;
+		}
+		if (DEBUG_ARMED && debug_stop()) {
+			break;
+		}
+		if (++polls == GDB_POLL) {
+			polls = 0;
+			if (gdb_interrupted(fd)) {
+				reply = "S02";
+				break;
+			}
+		}
+		if (MEMORY_WAIT > 1) {
+			cycle_skip(UINT32_MAX);
+		}
+		cycle();
+		if (SPIN_BRANCH) {
+			/* a loop that never exits keeps waiting for the interrupt */
+			spin_skip(GDB_POLL);
+		}
+	}
+	STATS.HOST_SECONDS += host_time() - start;
+	console_flush();
+	return RUN_FLAG ? reply : "W00";
+}
+
+/**************************************************************/
+/* Answer one packet; FALSE when the session is over                             */
+/**************************************************************/
+static int gdb_packet(int fd, char *packet) {
+	char reply[2 * GDB_PACKET + 1] = "";
+	uint32_t address, length, pc = gdb_pc(), i;
+	unsigned int byte;
+	int number, type;
+	char *data;
+
+	switch (packet[0]) {
+		case '?':
+			strcpy(reply, RUN_FLAG ? "S05" : "W00");
+			break;
+		case 'g':
+			for (i = 0; i < GDB_NUM_REGS; i++) {
+				gdb_put_word(reply + 8 * i, gdb_reg(i));
+			}
+			break;
+		case 'G':
+			for (i = 0; i < GDB_NUM_REGS && strlen(packet + 1) >= 8 * (i + 1); i++) {
+				pc = gdb_set_reg(i, gdb_get_word(packet + 1 + 8 * i), pc);
+			}
+			gdb_changed(pc);
+			strcpy(reply, "OK");
+			break;
+		case 'p':
+			number = strtol(packet + 1, NULL, 16);
+			if (number < GDB_NUM_REGS) {
+				gdb_put_word(reply, gdb_reg(number));
+			}else {
+				strcpy(reply, "xxxxxxxx");
+			}
+			break;
+		case 'P':
+			number = strtol(packet + 1, &data, 16);
+			if (*data == '=') {
+				gdb_changed(gdb_set_reg(number, gdb_get_word(data + 1), pc));
+			}
+			strcpy(reply, "OK");
+			break;
+		case 'm':
+			if (sscanf(packet + 1, "%x,%x", &address, &length) != 2) {
+				strcpy(reply, "E01");
+				break;
+			}
+			/* addresses are virtual, as in a load; stop at the first unmapped */
+			/* byte, an error if that is the first */
+			for (i = 0; i < length && i < GDB_PACKET && mem_host(mmu_peek(address + i)) != NULL; i++) {
+				sprintf(reply + 2 * i, "%02x", mem_read_8(mmu_peek(address + i)));
+			}
+			if (i == 0 && length) {
+				strcpy(reply, "E14");
+			}
+			break;
+		case 'M':
+			if (sscanf(packet + 1, "%x,%x", &address, &length) != 2 || (data = strchr(packet, ':')) == NULL) {
+				strcpy(reply, "E01");
+				break;
+			}
+			for (i = 0; i < length && sscanf(data + 1 + 2 * i, "%2x", &byte) == 1; i++) {
+				uint32_t physical = mmu_peek(address + i);
+
+				/* a store the simulator would drop is an error, not OK */
+				if (mem_host(physical) == NULL || (READONLY_MAPPINGS && mem_store_dropped(physical, 1))) {
+					break;
+				}
+				mem_write_8(physical, byte);
+			}
+			gdb_changed(pc);
+			strcpy(reply, i == length ? "OK" : "E14");
+			break;
+		case 'c':
+		case 's':
+			if (sscanf(packet + 1, "%x", &address) == 1) {
+				gdb_changed(address);
+			}
+			strcpy(reply, gdb_resume(fd, packet[0] == 's'));
+			break;
+		case 'Z':
+		case 'z':
+			/* software and hardware breakpoints both go in the bitmap */
+			if (sscanf(packet + 1, "%d,%x", &type, &address) != 2 || type > 1) {
+				break;
+			}
+			if (packet[0] == 'z') {
+				break_remove(address);
+			}else if (break_add(address) != 0) {
+				strcpy(reply, "E01");
+				break;
+			}
+			strcpy(reply, "OK");
+			break;
+		case 'H':
+		case 'T':
+			strcpy(reply, "OK");
+			break;
+		case 'q':
+			if (strncmp(packet, "qSupported", 10) == 0) {
+				sprintf(reply, "PacketSize=%x", GDB_PACKET);
+			}else if (strcmp(packet, "qAttached") == 0) {
+				strcpy(reply, "1");
+			}
+			break;
+		case 'D':
+			gdb_send(fd, "OK");
+			return FALSE;
+		case 'k':
+			return FALSE;
+		case 'v':
+			if (strncmp(packet, "vKill", 5) == 0) {
+				gdb_send(fd, "OK");
+				return FALSE;
+			}
+			break;
+	}
+	gdb_send(fd, reply);
+	return TRUE;
+}
+
+/**************************************************************/
+/* Wait for gdb on localhost:<port> and serve it until it detaches,         */
+/* kills the program or disconnects                                                            */
+/**************************************************************/
+int gdb_serve(int port) {
+	struct sockaddr_in address;
+	char packet[GDB_PACKET];
+	int server, fd, on = 1;
+
+	memset(&address, 0, sizeof(address));
+	address.sin_family = AF_INET;
+	address.sin_port = htons(port);
+	address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	server = socket(AF_INET, SOCK_STREAM, 0);
+	if (server < 0 || setsockopt(server, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) != 0 ||
+		bind(server, (struct sockaddr *)&address, sizeof(address)) != 0 || listen(server, 1) != 0) {
+		printf("Error: Can't listen on localhost:%d\n", port);
+		if (server >= 0) {
+			close(server);
+		}
+		return -1;
+	}
+	printf("Waiting for gdb on localhost:%d (target remote :%d)\n", port, port);
+	fflush(stdout);
+	fd = accept(server, NULL, NULL);
+	close(server);
+	if (fd < 0) {
+		printf("Error: Can't accept a gdb connection\n");
+		return -1;
+	}
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+	printf("gdb connected\n");
+
+	while (gdb_receive(fd, packet) != NULL && gdb_packet(fd, packet));
+	close(fd);
+	printf("gdb disconnected at cycle %u\n\n", CYCLE_COUNT);
+	return 0;
+}
+
+/**************************************************************/
+/* uart: transmit goes to the console, receive reads the console;     */
+/* both are always ready, receive blocks for a byte like a read syscall */
+/**************************************************************/
+static uint32_t uart_read(Device *device, uint32_t offset) {
+	int c;
+
+	switch (offset) {
+		case UART_RX_CONTROL:
+			return !device->regs[0];
+		case UART_RX_DATA:
+			if (device->regs[0]) {
+				return 0;
+			}
+			/* host input can't be replayed: history starts over */
+			if (CHECKPOINT_CYCLES && !REPLAYING) {
+				checkpoint_forget();
+			}
+			console_flush();
+			if ((c = getchar()) == EOF) {
+				/* receive stays unready from here on */
+				device->regs[0] = TRUE;
+				return 0;
+			}
+			return c;
+		case UART_TX_CONTROL:
+			return 1;
+	}
+	return 0;
+}
+
+static void uart_write(Device *device, uint32_t offset, uint32_t value) {
+	char c = value;
+
+	if (offset == UART_TX_DATA) {
+		console_write(&c, 1);
+	}
+}
+
+/**************************************************************/
+/* timer: regs are control, period, status and expirations                 */
+/**************************************************************/
+static uint32_t timer_read(Device *device, uint32_t offset) {
+	return device->regs[offset / 4];
+}
+
+static void timer_write(Device *device, uint32_t offset, uint32_t value) {
+	switch (offset) {
+		case TIMER_CONTROL:
+			device->regs[0] = value & 3;
+			device->next = (value & 1) && device->regs[1] ? (uint64_t)CYCLE_COUNT + device->regs[1] : DEVICE_NEVER;
+			break;
+		case TIMER_PERIOD:
+			/* a running timer picks up the new period when it next reloads; */
+			/* period 0 stops it, it could never expire again                 */
+			device->regs[1] = value;
+			if (value == 0) {
+				device->regs[0] &= ~1;
+				device->next = DEVICE_NEVER;
+			}
+			break;
+		case TIMER_STATUS:
+			device->regs[2] = 0;
+			break;
+	}
+}
+
+static void timer_tick(Device *device) {
+	device->regs[2] = 1;
+	device->regs[3]++;
+	if ((device->regs[0] & 2) && device->regs[1]) {
+		device->next += device->regs[1];
+	}else {
+		device->regs[0] = 0;
+		device->next = DEVICE_NEVER;
+	}
+}
+
+/**************************************************************/
+/* counter: the cycle and instruction counts                                    */
+/**************************************************************/
+static uint32_t counter_read(Device *device, uint32_t offset) {
+	switch (offset) {
+		case COUNTER_CYCLES:
+			return CYCLE_COUNT;
+		case COUNTER_INSTRUCTIONS:
+			return INSTRUCTION_COUNT;
+	}
+	return 0;
+}
+
+static void counter_write(Device *device, uint32_t offset, uint32_t value) {
+}
+
+static const Device_Type DEVICE_TYPES[NUM_DEVICE_TYPES] = {
+	[DEVICE_UART] = { "uart", uart_read, uart_write, NULL },
+	[DEVICE_TIMER] = { "timer", timer_read, timer_write, timer_tick },
+	[DEVICE_COUNTER] = { "counter", counter_read, counter_write, NULL },
+};
+
+/**************************************************************/
+/* the earliest tick any device wants                                                        */
+/**************************************************************/
+static void device_schedule() {
+	int i;
+
+	DEVICE_NEXT = DEVICE_NEVER;
+	for (i = 0; i < NUM_DEVICES; i++) {
+		if (DEVICES[i].next < DEVICE_NEXT) {
+			DEVICE_NEXT = DEVICES[i].next;
+		}
+	}
+}
+
+/**************************************************************/
+/* map device <name> at the page <address>, which has no memory behind it */
+/**************************************************************/
+int device_add(char *name, uint32_t address) {
+	int type, i;
+
+	for (type = 0; type < NUM_DEVICE_TYPES && strcmp(name, DEVICE_TYPES[type].name) != 0; type++);
+	if (type == NUM_DEVICE_TYPES) {
+		printf("Error: no device %s (uart, timer or counter)\n", name);
+		return -1;
+	}
+	if ((address & (MAP_PAGE - 1)) || mem_host(address) != NULL || mem_host(address + MAP_PAGE - 1) != NULL) {
+		printf("Error: 0x%08x is not a page without memory behind it (e.g. 0xffff0000)\n", address);
+		return -1;
+	}
+	if (DEVICE_PAGES != NULL && (i = DEVICE_PAGES[address >> MMU_PAGE_SHIFT])) {
+		printf("Error: 0x%08x already holds the %s\n", address, DEVICE_TYPES[DEVICES[i - 1].type].name);
+		return -1;
+	}
+	if (NUM_DEVICES == MAX_DEVICES) {
+		printf("Error: at most %d devices\n", MAX_DEVICES);
+		return -1;
+	}
+	if (DEVICE_PAGES == NULL) {
+		DEVICE_PAGES = calloc(1u << (32 - MMU_PAGE_SHIFT), 1);
+	}
+	memset(&DEVICES[NUM_DEVICES], 0, sizeof(Device));
+	DEVICES[NUM_DEVICES].type = type;
+	DEVICES[NUM_DEVICES].address = address;
+	DEVICES[NUM_DEVICES].next = DEVICE_NEVER;
+	DEVICE_PAGES[address >> MMU_PAGE_SHIFT] = ++NUM_DEVICES;
+	printf("%s at 0x%08x\n", name, address);
+	checkpoint_restart();
+	return 0;
+}
+
+void device_clear() {
+	free(DEVICE_PAGES);
+	DEVICE_PAGES = NULL;
+	NUM_DEVICES = 0;
+	DEVICE_NEXT = DEVICE_NEVER;
+	checkpoint_restart();
+}
+
+/**************************************************************/
+/* devices as they are at power on                                                            */
+/**************************************************************/
+void device_reset() {
+	int i;
+
+	for (i = 0; i < NUM_DEVICES; i++) {
+		memset(DEVICES[i].regs, 0, sizeof(DEVICES[i].regs));
+		DEVICES[i].next = DEVICE_NEVER;
+	}
+	DEVICE_NEXT = DEVICE_NEVER;
+	DEVICE_TICKED = 0;
+}
+
+/**************************************************************/
+/* what a load from address reads between now and DEVICE_NEXT: DEVICE_NONE */
+/* for memory, DEVICE_STEADY for a device whose registers only change at   */
+/* its ticks (and on stores), DEVICE_VOLATILE for one that changes on its  */
+/* own or on being read                                                                                 */
+/**************************************************************/
+int device_polled(uint32_t address) {
+	int index;
+
+	if (DEVICE_PAGES == NULL || mem_host(address) != NULL) {
+		return DEVICE_NONE;
+	}
+	index = DEVICE_PAGES[address >> MMU_PAGE_SHIFT];
+	if (index == 0) {
+		return DEVICE_NONE;
+	}
+	return DEVICE_TYPES[DEVICES[index - 1].type].tick != NULL ? DEVICE_STEADY : DEVICE_VOLATILE;
+}
+
+/**************************************************************/
+/* run the ticks that are due                                                                        */
+/**************************************************************/
+void device_tick() {
+	int i;
+
+	for (i = 0; i < NUM_DEVICES; i++) {
+		while (DEVICES[i].next <= CYCLE_COUNT) {
+			DEVICE_TYPES[DEVICES[i].type].tick(&DEVICES[i]);
+		}
+	}
+	DEVICE_TICKED = CYCLE_COUNT;
+	device_schedule();
+}
+
+/**************************************************************/
+/* An access to a page with no memory behind it: the device's word,        */
+/* shifted down to the byte addressed; zero if no device is there            */
+/**************************************************************/
+uint32_t device_read(uint32_t address) {
+	int index = DEVICE_PAGES[address >> MMU_PAGE_SHIFT];
+	uint32_t offset = address & (MAP_PAGE - 1);
+	Device *device;
+
+	if (index == 0) {
+		return 0;
+	}
+	device = &DEVICES[index - 1];
+	return DEVICE_TYPES[device->type].read(device, offset & ~3) >> (8 * (offset & 3));
+}
+
+void device_write(uint32_t address, uint32_t value) {
+	int index = DEVICE_PAGES[address >> MMU_PAGE_SHIFT];
+	uint32_t offset = address & (MAP_PAGE - 1);
+	Device *device;
+
+	if (index == 0) {
+		return;
+	}
+	device = &DEVICES[index - 1];
+	DEVICE_TYPES[device->type].write(device, offset & ~3, value << (8 * (offset & 3)));
+	device_schedule();
+}
+
+/**************************************************************/
+/* start (or restart) per-instruction CPI attribution                              */
+/**************************************************************/
+void cpi_enable() {
+	free(CPI_PC);
+	CPI_PC = calloc(PROGRAM_SIZE ? PROGRAM_SIZE : 1, sizeof(Cpi_Counter));
+}
+
+/**************************************************************/
+/* sum the per-instruction stacks of text words [first, last)               */
+/**************************************************************/
+static void cpi_sum(uint32_t first, uint32_t last, Cpi_Counter *sum) {
+	uint32_t i;
+	int j;
+
+	memset(sum, 0, sizeof(*sum));
+	for (i = first; i < last && i < PROGRAM_SIZE; i++) {
+		for (j = 0; j < NUM_STALL; j++) {
+			sum->cycles[j] += CPI_PC[i].cycles[j];
+		}
+	}
+}
+
+/**************************************************************/
+/* print the CPI stack of [start, stop], or of the whole run if both 0  */
+/**************************************************************/
+void cpi_report(uint32_t start, uint32_t stop) {
+	Cpi_Counter sum;
+	uint64_t total = 0, instructions;
+	int i;
+
+	if (start == 0 && stop == 0) {
+		memcpy(sum.cycles, STATS.CPI_STACK, sizeof(sum.cycles));
+	}else if (CPI_PC == NULL) {
+		printf("CPI attribution is off (cpi on)\n");
+		return;
+	}else {
+		if (start < MEM_TEXT_BEGIN) {
+			start = MEM_TEXT_BEGIN;
+		}
+		cpi_sum(HOTSPOT_INDEX(start), stop < MEM_TEXT_BEGIN ? 0 : HOTSPOT_INDEX(stop) + 1, &sum);
+	}
+	for (i = 0; i < NUM_STALL; i++) {
+		total += sum.cycles[i];
+	}
+	instructions = sum.cycles[STALL_NONE] ? sum.cycles[STALL_NONE] : 1;
+
+	printf("-------------------------------------\n");
+	if (start == 0 && stop == 0) {
+		printf("CPI stack (whole program)\n");
+	}else {
+		printf("CPI stack [0x%08x - 0x%08x]\n", start, stop);
+	}
+	printf("-------------------------------------\n");
+	printf("%-12s %12s %8s %7s\n", "component", "cycles", "CPI", "%");
+	for (i = 0; i < NUM_STALL; i++) {
+		printf("%-12s %12lu %8.4f %6.2f%%\n", CPI_NAMES[i], (unsigned long)sum.cycles[i],
+			(double)sum.cycles[i] / instructions, total ? 100.0 * sum.cycles[i] / total : 0.0);
+	}
+	printf("%-12s %12lu %8.4f\n", "total", (unsigned long)total, (double)total / instructions);
+	printf("-------------------------------------\n");
+}
+
+/**************************************************************/
+/* CPI stack per function: the entry point and every JAL target start one  */
+/**************************************************************/
+void cpi_functions() {
+	uint8_t *entry;
+	uint32_t i, next, target;
+	Cpi_Counter sum;
+	uint64_t total;
+	int j;
+
+	if (CPI_PC == NULL) {
+		printf("CPI attribution is off (cpi on)\n");
+		return;
+	}
+	entry = calloc(PROGRAM_SIZE + 1, 1);
+	entry[0] = TRUE;
+	for (i = 0; i < PROGRAM_SIZE; i++) {
+		uint32_t pc = MEM_TEXT_BEGIN + 4 * i;
+		uint32_t instruction = mem_read_32(pc);
+		if (decode(instruction) == INS_JAL && ends_block(pc, instruction, &target) &&
+			target >= MEM_TEXT_BEGIN && HOTSPOT_INDEX(target) < PROGRAM_SIZE) {
+			entry[HOTSPOT_INDEX(target)] = TRUE;
+		}
+	}
+
+	printf("-------------------------------------\n");
+	printf("CPI stack per function\n");
+	printf("-------------------------------------\n");
+	printf("%-23s %10s %10s %7s", "function", "instrs", "cycles", "CPI");
+	for (j = 0; j < NUM_STALL - 1; j++) {
+		printf(" %9s", CPI_NAMES[j]);
+	}
+	printf("\n");
+	for (i = 0; i < PROGRAM_SIZE; i = next) {
+		for (next = i + 1; next < PROGRAM_SIZE && !entry[next]; next++);
+		cpi_sum(i, next, &sum);
+		total = 0;
+		for (j = 0; j < NUM_STALL; j++) {
+			total += sum.cycles[j];
+		}
+		if (total == 0) {
+			continue;
+		}
+		printf("0x%08x - 0x%08x %10lu %10lu %7.3f", MEM_TEXT_BEGIN + 4 * i, MEM_TEXT_BEGIN + 4 * (next - 1),
+			(unsigned long)sum.cycles[STALL_NONE], (unsigned long)total,
+			sum.cycles[STALL_NONE] ? (double)total / sum.cycles[STALL_NONE] : 0.0);
+		/* fill/drain cycles belong to no instruction */
+		for (j = 0; j < NUM_STALL - 1; j++) {
+			printf(" %9.3f", sum.cycles[STALL_NONE] ? (double)sum.cycles[j] / sum.cycles[STALL_NONE] : 0.0);
+		}
+		printf("\n");
+	}
+	printf("-------------------------------------\n");
+	printf("columns after CPI are its components (cycles per instruction)\n");
+	free(entry);
+}
+
+/************************************************************/
+/* The pipeline is specialised on its configuration: the stages that   */
+/* test forwarding or the trace level are inlined into handle_pipeline, */
+/* which is compiled once per combination with the tests folded away.  */
+/* pipeline_select() points PIPELINE_CYCLE at the matching variant.    */
+/************************************************************/
+#define PIPELINE_STAGE	static inline __attribute__((always_inline))
+
+PIPELINE_STAGE void WB(int trace);
+PIPELINE_STAGE void MEM();
+PIPELINE_STAGE void EX();
+PIPELINE_STAGE void ID(int forwarding);
+PIPELINE_STAGE void IF();
+
+/************************************************************/
+/* maintain the pipeline; the stages must run WB to IF (see the         */
+/* pipeline registers in mu-mips.h)                                                              */ 
+/************************************************************/
+PIPELINE_STAGE void handle_pipeline(int forwarding, int trace)
+{
+	/*INSTRUCTION_COUNT should be incremented when instruction is done*/
+	/*Since we do not have branch/jump instructions, INSTRUCTION_COUNT should be incremented in WB stage */
+	
+	if (MEMORY_WAIT) {
+		/* a TLB walk holds every stage: the cycle retires nothing */
+		MEMORY_WAIT--;
+		cpi_charge(STALL_MEMORY, MEMORY_WAIT_PC);
+		if (trace) {
+			printf("STALL\n");
+		}
+		return;
+	}
+
+	PROF_START();
+	WB(trace);
+	PROF_LAP(PROF_WB);
+	MEM();
+	PROF_LAP(PROF_MEM);
+	EX();
+	PROF_LAP(PROF_EX);
+	ID(forwarding);
+	PROF_LAP(PROF_ID);
+	IF();
+	PROF_LAP(PROF_IF);
+}
+
+#define PIPELINE_VARIANT(forwarding, trace) \
+	static void handle_pipeline_##forwarding##_##trace() { \
+		handle_pipeline(forwarding, trace); \
+	}
+PIPELINE_VARIANT(0, 0)
+PIPELINE_VARIANT(0, 1)
+PIPELINE_VARIANT(1, 0)
+PIPELINE_VARIANT(1, 1)
+
+/************************************************************/
+/* point PIPELINE_CYCLE at the variant for ENABLE_FORWARDING and         */
+/* TRACE_LEVEL; call whenever either changes                                           */ 
+/************************************************************/
+void pipeline_select()
+{
+	static void (*const variants[2][2])() = {
+		{ handle_pipeline_0_0, handle_pipeline_0_1 },
+		{ handle_pipeline_1_0, handle_pipeline_1_1 },
+	};
+
+	PIPELINE_CYCLE = variants[ENABLE_FORWARDING != 0][TRACE_LEVEL != 0];
+}
+
+/************************************************************/
+/* writeback (WB) pipeline stage:                                                                          */ 
+/************************************************************/
+PIPELINE_STAGE void WB(int trace)
+{
+	if(CYCLE_COUNT < 5)
+	{
+		cpi_charge(STALL_FILL, 0);
+		return;
+	}
+	
 	if(WB_MEM.IR == 0 && WB_MEM.PC == 0 && WB_MEM.SYSCALL == 0)
 	{
-		printf("STALL\n");
+		cpi_charge(WB_MEM.STALL == STALL_NONE ? STALL_FILL : WB_MEM.STALL, WB_MEM.STALL_PC);
+		if (trace) {
+			PROF_START();
+			printf("STALL\n");
+			PROF_STOP(PROF_TRACE);
+		}
+		return;
+	}
+
+	if (trace) {
+		PROF_START();
+		print_instruction_word(WB_MEM.IR);
+		PROF_STOP(PROF_TRACE);
+	}
+	uint32_t id = decode(WB_MEM.IR);
+	Hotspot_Counter *hotspot = hotspot_at(WB_MEM.PC);
+	
+	INSTRUCTION_COUNT++;
+	STATS.MIX[INSTRUCTIONS[id].mix]++;
+	cpi_charge(STALL_NONE, WB_MEM.PC);
+	if (hotspot) {
+		hotspot->retired++;
+	}
+
+	if (TRACE_MODE == TRACE_RECORD) {
+		trace_append(WB_MEM.PC, WB_MEM.IR, id == INS_SYSCALL ? WB_MEM.SYSCALL : WB_MEM.EA, WB_MEM.TARGET);
+	}
+	else if (TRACE_MODE == TRACE_REPLAY) {
+		/* timing only: there is no architectural state to write back */
+		TRACE_RETIRED++;
+		if (id == INS_SYSCALL) {
+			SYSCALL_PENDING = FALSE;
+		}
+		if ((id == INS_SYSCALL && WB_MEM.SYSCALL == SYS_EXIT) ||
+			(TRACE_RETIRED == TRACE_FETCHED && TRACE_CURSOR == TRACE_LENGTH)) {
+			RUN_FLAG = FALSE;
+		}
+		return;
+	}
+
+/* results come from the latch: ALUOutput (HI for HILO, with LO in ALUOutput2) or LMD */
+#define WB_ALU(dest)	write_dest(dest, WB_MEM.IR, (dest) == DEST_HILO ? \
+							(uint64_t)WB_MEM.ALUOutput << 32 | WB_MEM.ALUOutput2 : WB_MEM.ALUOutput)
+#define WB_LOAD(dest)	write_dest(dest, WB_MEM.IR, WB_MEM.LMD)
+#define WB_STORE(dest)
+#define WB_BRANCH(dest)
+#define WB_JUMP(dest)	write_dest(dest, WB_MEM.IR, WB_MEM.ALUOutput)
+#define WB_SYSCALL(dest) \
+	syscall_execute(WB_MEM.SYSCALL); \
+	SYSCALL_PENDING = !RUN_FLAG;	/* after exit, nothing more is fetched */
+#define X(name, op, fn, format, dest, reads, mix, kind, value) \
+		case INS_##name: \
+			WB_##kind(DEST_##dest); \
+			break;
+
+	switch (id) {
+		MIPS_INSTRUCTIONS(X)
+	}
+#undef X
+}
+
+/************************************************************/
+/* memory access (MEM) pipeline stage:                                                          */ 
+/************************************************************/
+PIPELINE_STAGE void MEM()
+{
+	if(CYCLE_COUNT < 4 || WB_MEM.SYSCALL == 0xA)
+	{
+		return;
+	}
+
+	WB_MEM.IR = MEM_EX.IR;
+	WB_MEM.PC = MEM_EX.PC;
+	WB_MEM.SYSCALL = MEM_EX.SYSCALL;
+	WB_MEM.EA = MEM_EX.EA;
+	WB_MEM.TARGET = MEM_EX.TARGET;
+	WB_MEM.STALL = MEM_EX.STALL;
+	WB_MEM.STALL_PC = MEM_EX.STALL_PC;
+	WB_MEM.ALUOutput = MEM_EX.ALUOutput;
+	WB_MEM.ALUOutput2 = MEM_EX.ALUOutput2;
+
+	uint32_t id = decode(MEM_EX.IR);
+	int kind = INSTRUCTIONS[id].kind;
+
+	if ((kind == KIND_LOAD || kind == KIND_STORE) && TRACE_MODE != TRACE_REPLAY) {
+		MEM_EX.ALUOutput = mmu_translate(MEM_EX.ALUOutput, MEM_EX.PC);
+		if (WATCH_PAGES != NULL) {
+			watch_access(MEM_EX.PC, MEM_EX.ALUOutput, access_size(MEM_EX.IR), kind == KIND_STORE ? WATCH_WRITE : WATCH_READ);
+		}
+	}
+	if (ACCESS_FILE && (kind == KIND_LOAD || kind == KIND_STORE)) {
+		access_append(kind == KIND_STORE ? ACCESS_WRITE : ACCESS_READ, MEM_EX.PC, MEM_EX.EA, access_size(MEM_EX.IR));
+	}
+	if (TRACE_MODE == TRACE_REPLAY && (kind == KIND_LOAD || kind == KIND_STORE)) {
+		/* timing only: loads and stores have no memory state to touch */
+		return;
+	}
+
+	uint32_t address = MEM_EX.ALUOutput;
+	uint32_t b = MEM_EX.B;
+
+#define MEM_ALU(value)
+#define MEM_LOAD(value) \
+	WB_MEM.LMD = (value); \
+	MEM_EX.ALUOutput = WB_MEM.LMD;
+#define MEM_STORE(value)	(value);
+/* the branch or jump has left EX: ID may decode again */
+#define MEM_BRANCH(value) \
+	controlHazard = 0; \
+	jumpStall = 0;
+#define MEM_JUMP(value)		MEM_BRANCH(value)
+#define MEM_SYSCALL(value)
+#define X(name, op, fn, format, dest, reads, mix, kind, value) \
+		case INS_##name: \
+			MEM_##kind(value) \
+			break;
+
+	switch (id) {
+		MIPS_INSTRUCTIONS(X)
+	}
+#undef X
+}
+
+/************************************************************/
+/* send fetch to a taken branch/jump target, squashing the wrong path  */ 
+/************************************************************/
+static void redirect_fetch(uint32_t target)
+{
+	Hotspot_Counter *hotspot = hotspot_at(MEM_EX.PC);
+
+	STATS.FLUSHES++;
+	if (hotspot) {
+		hotspot->flushes++;
+	}
+	MEM_EX.TARGET = target;
+	CURRENT_STATE.PC = target;
+	NEXT_STATE.PC = target;
+	SYSCALL_PENDING = FALSE;	/* a syscall fetched behind the branch is squashed too */
+	ID_IF.IR = 0;
+	ID_IF.PC = 0;
+	ID_IF.SYSCALL = 0;
+	EX_ID.IR = 0;
+	EX_ID.PC = 0;
+	EX_ID.SYSCALL = 0;
+}
+
+/************************************************************/
+/* execution (EX) pipeline stage:                                                                          */ 
+/************************************************************/
+PIPELINE_STAGE void EX()
+{
+	if(CYCLE_COUNT < 3 || MEM_EX.SYSCALL == 0xA)
+	{
 		return;
 	}
 
-	print_instruction(WB_MEM.PC);
-	uint32_t opcode = (WB_MEM.IR & 0xFC000000) >> 26;
-	uint32_t function = (WB_MEM.IR & 0x3F);
-	uint32_t rd = (0xF800 & WB_MEM.IR) >> 11;
-	uint32_t rt = (0x1F0000 & WB_MEM.IR) >> 16;
-	
-	INSTRUCTION_COUNT++;
-/*	
-	printf("\n=================WB==============\n");
-	print_instruction(WB_MEM.PC);
-	printf("WB.SYSCALL = %X\n", WB_MEM.SYSCALL);
-	printf("WB opcode = %X\n", opcode);
-	printf("====================================");
-*/	
+	MEM_EX.IR = EX_ID.IR;
+	MEM_EX.PC = EX_ID.PC;
+	MEM_EX.SYSCALL = EX_ID.SYSCALL;
+	MEM_EX.EA = EX_ID.EA;
+	MEM_EX.TARGET = EX_ID.TARGET;
+	MEM_EX.STALL = EX_ID.STALL;
+	MEM_EX.STALL_PC = EX_ID.STALL_PC;
+
+	if(EX_ID.IR == 0 && EX_ID.PC == 0 && EX_ID.SYSCALL == 0)
+	{
+		return;
+	}
+
+	uint32_t id = decode(EX_ID.IR);
+
+	if (TRACE_MODE == TRACE_REPLAY) {
+		/* timing only: follow the recorded control flow instead of evaluating it */
+		if (INSTRUCTIONS[id].kind == KIND_JUMP || (INSTRUCTIONS[id].kind == KIND_BRANCH && MEM_EX.TARGET != 0))
+		{
+			jumpStall = 1;
+		}
+		if (MEM_EX.TARGET != 0) {
+			STATS.FLUSHES++;
+			if (hotspot_at(MEM_EX.PC)) {
+				hotspot_at(MEM_EX.PC)->flushes++;
+			}
+		}
+		return;
+	}
+	MEM_EX.EA = 0;
+	MEM_EX.TARGET = 0;
+
+	uint32_t instruction = EX_ID.IR;
+	uint32_t a = EX_ID.A;
+	uint32_t b = EX_ID.B;
+	uint32_t hi = EX_ID.HI;
+	uint32_t lo = EX_ID.LO;
+	uint32_t simm = EX_ID.imm;
+	uint32_t imm = EX_ID.imm & 0xFFFF;
+	uint32_t shamt = (0x7C0 & EX_ID.IR) >> 6;
+	uint32_t pc = MEM_EX.PC;
+	uint32_t address = a + simm;
+	uint64_t result;
+
+/* HILO results leave EX as HI in ALUOutput, LO in ALUOutput2 */
+#define EX_ALU(dest, value) \
+	result = (value); \
+	MEM_EX.ALUOutput = (dest) == DEST_HILO ? result >> 32 : result; \
+	MEM_EX.ALUOutput2 = (dest) == DEST_HILO ? (uint32_t)result : MEM_EX.ALUOutput2;
+#define EX_LOAD(dest, value) \
+	MEM_EX.ALUOutput = address; \
+	MEM_EX.B = b; \
+	MEM_EX.EA = address;
+#define EX_STORE(dest, value)	EX_LOAD(dest, value)
+#define EX_BRANCH(dest, value) \
+	if (value) { \
+		redirect_fetch(pc + (simm << 2)); \
+		jumpStall = 1; \
+	}
+#define EX_JUMP(dest, value) \
+	if ((dest) != DEST_NONE) { \
+		MEM_EX.ALUOutput = pc + 4; \
+	} \
+	redirect_fetch(value); \
+	jumpStall = 1;
+#define EX_SYSCALL(dest, value) \
+	if (EX_ID.SYSCALL == 0xA) { \
+		MEM_EX.ALUOutput = 0xA; \
+	}
+#define X(name, op, fn, format, dest, reads, mix, kind, value) \
+		case INS_##name: \
+			EX_##kind(DEST_##dest, value) \
+			break;
+
+	switch (id) {
+		MIPS_INSTRUCTIONS(X)
+	}
+#undef X
+}
+
+/************************************************************/
+/* stall cause for a dependence on the given producer                                 */ 
+/************************************************************/
+static int load_stall(uint32_t instruction)
+{
+	return INSTRUCTIONS[decode(instruction)].kind == KIND_LOAD ? STALL_LOAD_USE : STALL_DATA;
+}
+
+/************************************************************/
+/* turn the instruction entering EX into a bubble                                      */ 
+/************************************************************/
+static void stall_ID(int cause)
+{
+	EX_ID.IR = 0;
+	EX_ID.PC = 0;
+	EX_ID.SYSCALL = 0;
+	if (ID_STALL == STALL_NONE) {
+		ID_STALL = cause;
+		/* a control bubble is the branch's fault, a data bubble the waiting instruction's */
+		EX_ID.STALL = cause;
+		EX_ID.STALL_PC = (cause == STALL_CONTROL) ? MEM_EX.PC : ID_IF.PC;
+	}
+}
+
+/************************************************************/
+/* account the bubble inserted by ID this cycle                                         */ 
+/************************************************************/
+static void count_stall(int cause)
+{
+	Hotspot_Counter *hotspot;
+
+	if (cause != STALL_NONE) {
+		hotspot = hotspot_at(EX_ID.STALL_PC);
+		if (hotspot) {
+			hotspot->stalls++;
+		}
+	}
+	switch (cause) {
+		case STALL_DATA:
+			STATS.DATA_STALLS++;
+			break;
+		case STALL_LOAD_USE:
+			STATS.LOAD_USE_STALLS++;
+			break;
+		case STALL_CONTROL:
+			STATS.CONTROL_STALLS++;
+			break;
+	}
+}
+
+/************************************************************/
+/* register an instruction writes back, 0 if none                                     */ 
+/************************************************************/
+static uint32_t dest_reg(uint32_t instruction)
+{
+	switch (INSTRUCTIONS[decode(instruction)].dest) {
+		case DEST_RD:
+			return (instruction & 0xF800) >> 11;
+		case DEST_RT:
+			return (instruction & 0x1F0000) >> 16;
+		case DEST_RA:
+			return 31;
+	}
+	return 0;
+}
+
+/************************************************************/
+/* HI/LO written by an instruction (HILO_HI | HILO_LO)                         */ 
+/************************************************************/
+static int hilo_written(uint32_t instruction)
+{
+	switch (INSTRUCTIONS[decode(instruction)].dest) {
+		case DEST_HI:
+			return HILO_HI;
+		case DEST_LO:
+			return HILO_LO;
+		case DEST_HILO:
+			return HILO_HI | HILO_LO;
+	}
+	return 0;
+}
+
+/************************************************************/
+/* read a GPR in ID: forward from EX/MEM or MEM/WB, or stall                */ 
+/************************************************************/
+PIPELINE_STAGE uint32_t read_operand(uint32_t reg, int used, int forwarding, uint32_t *forwards)
+{
+	if (!used || reg == 0) {
+		return NEXT_STATE.REGS[reg];
+	}
+	if (dest_reg(MEM_EX.IR) == reg) {
+		// a load's value does not exist until the end of MEM
+		if (!forwarding || load_stall(MEM_EX.IR) == STALL_LOAD_USE) {
+			stall_ID(load_stall(MEM_EX.IR));
+			return 0;
+		}
+		(*forwards)++;
+		return MEM_EX.ALUOutput;
+	}
+	if (dest_reg(WB_MEM.IR) == reg) {
+		if (!forwarding) {
+			stall_ID(load_stall(WB_MEM.IR));
+			return 0;
+		}
+		(*forwards)++;
+		return load_stall(WB_MEM.IR) == STALL_LOAD_USE ? WB_MEM.LMD : WB_MEM.ALUOutput;
+	}
+	// WB has already run this cycle: read the register file after its write
+	return NEXT_STATE.REGS[reg];
+}
+
+/************************************************************/
+/* read HI or LO in ID, with the same forwarding rules                           */ 
+/************************************************************/
+PIPELINE_STAGE uint32_t read_hilo(int which, int used, int forwarding, uint32_t *forwards)
+{
+	CPU_Pipeline_Reg *producer = NULL;
+
+	if (used && (hilo_written(MEM_EX.IR) & which)) {
+		producer = &MEM_EX;
+	}else if (used && (hilo_written(WB_MEM.IR) & which)) {
+		producer = &WB_MEM;
+	}
+	if (producer == NULL) {
+		return which == HILO_HI ? NEXT_STATE.HI : NEXT_STATE.LO;
+	}
+	if (!forwarding) {
+		stall_ID(STALL_DATA);
+		return 0;
+	}
+	(*forwards)++;
+	// MTHI/MTLO carry their value in ALUOutput, MULT/DIV put LO in ALUOutput2
+	return (which == HILO_HI || hilo_written(producer->IR) == HILO_LO) ? producer->ALUOutput : producer->ALUOutput2;
+}
+
+/************************************************************/
+/* instruction decode (ID) pipeline stage:                                                         */ 
+/************************************************************/
+PIPELINE_STAGE void ID(int forwarding)
+{
+	if(CYCLE_COUNT < 2 || EX_ID.SYSCALL == 0xA)
+	{
+		return;
+	}
+
+	ID_STALL = STALL_NONE;
+
+	EX_ID.IR = ID_IF.IR;
+	EX_ID.PC = ID_IF.PC;
+	EX_ID.SYSCALL = ID_IF.SYSCALL;
+	EX_ID.EA = ID_IF.EA;
+	EX_ID.TARGET = ID_IF.TARGET;
+	EX_ID.STALL = STALL_FILL;	/* only read if this turns out to be a bubble */
+	EX_ID.STALL_PC = 0;
+
+    if(controlHazard == 1)
+	{
+		stall_ID(STALL_CONTROL);
+	}
+
+    if (jumpStall == 1)
+    {
+        stall_ID(STALL_CONTROL);
+		count_stall(ID_STALL);
+        return;
+    }
+
+
 	
-	if (opcode == 0x00) {
-		switch(function) {
-			case 0x00:		//SLL
-				NEXT_STATE.REGS[rd] = WB_MEM.ALUOutput;
-				break;
-			case 0x02:		//SRL
-				NEXT_STATE.REGS[rd] = WB_MEM.ALUOutput;
-				break;
-			case 0x03:		//SRA
-				NEXT_STATE.REGS[rd] = WB_MEM.ALUOutput;
-				break;
-			case 0x0C:		//SYSCALL
-				if(WB_MEM.SYSCALL == 0xA)
-				{
-					RUN_FLAG = FALSE;
-				} 
-				break;
-			case 0x10:		//MFHI
-				NEXT_STATE.REGS[rd] = WB_MEM.ALUOutput;
-				break;
-			case 0x11:		//MTHI
-				NEXT_STATE.HI = WB_MEM.ALUOutput;
-				break;
-			case 0x12:		//MFLO
-				NEXT_STATE.REGS[rd] = WB_MEM.ALUOutput;
-				break;
-			case 0x13:		//MTLO
-				NEXT_STATE.LO = WB_MEM.ALUOutput;
-				break;
-			case 0x18:		//MULT
-				NEXT_STATE.HI = WB_MEM.ALUOutput;
-				NEXT_STATE.LO = WB_MEM.ALUOutput2;
-				break;
-			case 0x19:		//MULT Unsigned
-				NEXT_STATE.HI = WB_MEM.ALUOutput;
-				NEXT_STATE.LO = WB_MEM.ALUOutput2;
-				break;
-			case 0x1A:		//DIV
-				NEXT_STATE.HI = WB_MEM.ALUOutput;
-				NEXT_STATE.LO = WB_MEM.ALUOutput2;
-				break;
-			case 0x1B:		//DIVU
-				NEXT_STATE.HI = WB_MEM.ALUOutput;
-				NEXT_STATE.LO = WB_MEM.ALUOutput2;
-				break;
-			case 0x20:		//ADD
-				NEXT_STATE.REGS[rd] = WB_MEM.ALUOutput;
-				break;
-			case 0x21:		//ADD Unsigned
-				NEXT_STATE.REGS[rd] = WB_MEM.ALUOutput;
-				break;
-			case 0x22:		//SUB
-				NEXT_STATE.REGS[rd] = WB_MEM.ALUOutput;
-				break;
-			case 0x23:		//SUB Unsigned
-				NEXT_STATE.REGS[rd] = WB_MEM.ALUOutput;
-				break;
-			case 0x24:		//AND
-				NEXT_STATE.REGS[rd] = WB_MEM.ALUOutput;
-				break;
-			case 0x25:		//OR
-				NEXT_STATE.REGS[rd] = WB_MEM.ALUOutput;
-				break;
-			case 0x26:		//XOR
-				NEXT_STATE.REGS[rd] = WB_MEM.ALUOutput;
-				break;
-			case 0x27:		//NOR
-				NEXT_STATE.REGS[rd] = WB_MEM.ALUOutput;
-				break;
-			case 0x2A:		//SLT
-				if(EX_ID.A < EX_ID.B)
-				{
-					NEXT_STATE.REGS[rd] = WB_MEM.ALUOutput;
-				}
-				else
-				{
-					NEXT_STATE.REGS[rd] = WB_MEM.ALUOutput;
-				}
-				break;
-            case 0x09:		//JALR
-				NEXT_STATE.REGS[rd] = WB_MEM.ALUOutput;
-				break;
+	uint32_t rs = (0x3E00000 & ID_IF.IR) >> 21;
+	uint32_t rt = (0x1F0000 & ID_IF.IR) >> 16;
+	uint32_t immediate = (0xFFFF & ID_IF.IR);
+	uint32_t id = decode(ID_IF.IR);
+	const Instruction_Info *info = &INSTRUCTIONS[id];
+	uint32_t forwards = 0;
+	PROF_START();
+
+	if (id == INS_SYSCALL)
+	{
+		rs = 2;		// SYSCALL reads $v0
+	}
+	EX_ID.A = read_operand(rs, info->reads & READ_RS, forwarding, &forwards);
+	EX_ID.B = read_operand(rt, info->reads & READ_RT, forwarding, &forwards);
+	EX_ID.HI = read_hilo(HILO_HI, info->reads & READ_HI, forwarding, &forwards);
+	EX_ID.LO = read_hilo(HILO_LO, info->reads & READ_LO, forwarding, &forwards);
+	EX_ID.imm = (uint32_t)((int16_t)immediate);
+	PROF_STOP(PROF_DECODE);
+
+	if (ID_STALL == STALL_NONE)
+	{
+		STATS.FORWARDS += forwards;
+	}
+
+	/* EX_ID.IR is a bubble if ID stalled */
+	id = decode(EX_ID.IR);
+	if (INSTRUCTIONS[id].kind == KIND_BRANCH || INSTRUCTIONS[id].kind == KIND_JUMP)
+	{
+			controlHazard = 1;
+	}
+
+	count_stall(ID_STALL);
+
+	if (id == INS_SYSCALL)
+		EX_ID.SYSCALL = (TRACE_MODE == TRACE_REPLAY) ? EX_ID.EA : EX_ID.A;
+}
+
+/************************************************************/
+/* instruction fetch (IF) pipeline stage:                                                              */ 
+/************************************************************/
+PIPELINE_STAGE void IF()
+{
+	int ID_IF_empty = (ID_IF.IR == 0 && ID_IF.PC == 0 && ID_IF.SYSCALL == 0);
+
+	if(CYCLE_COUNT < 1 || ((EX_ID.IR == 0 && EX_ID.PC == 0 && EX_ID.SYSCALL == 0) && CYCLE_COUNT > 2 && !ID_IF_empty))
+	{
+		return;
+	}
+
+	if (SYSCALL_PENDING) {
+		// ID has taken the syscall: feed it bubbles until the syscall retires
+		ID_IF.IR = 0;
+		ID_IF.PC = 0;
+		ID_IF.SYSCALL = 0;
+		return;
+	}
+
+	if (TRACE_MODE == TRACE_REPLAY) {
+		Trace_Record record;
+
+		if (!trace_next(&record)) {
+			return;
 		}
+		ID_IF.IR = record.IR;
+		ID_IF.PC = record.PC;
+		ID_IF.EA = record.addr;
+		ID_IF.TARGET = record.target;
+		NEXT_STATE.PC = record.PC + 4;
+	}
+	else if (NUM_INTERCEPTS && intercept_at(CURRENT_STATE.PC) != NULL) {
+		// an intercepted routine: fetch nothing, and run it on the host once everything older has retired
+		ID_IF.IR = 0;
+		ID_IF.PC = 0;
+		ID_IF.SYSCALL = 0;
+		if (EX_ID.IR == 0 && EX_ID.PC == 0 && EX_ID.SYSCALL == 0 && MEM_EX.IR == 0 && MEM_EX.PC == 0 &&
+			MEM_EX.SYSCALL == 0 && WB_MEM.IR == 0 && WB_MEM.PC == 0 && WB_MEM.SYSCALL == 0) {
+			intercept_call(intercept_at(CURRENT_STATE.PC));
+		}
+		return;
 	}
-	// Regular opcode (I-Type)
 	else {
-		switch(opcode) {
-			case 0x8:		//ADDI
-				NEXT_STATE.REGS[rt] = WB_MEM.ALUOutput;
-				break;
-			case 0x9:		//ADDIU
-				NEXT_STATE.REGS[rt] = WB_MEM.ALUOutput;
-				break;
-			case 0xC:		//ANDI
-				NEXT_STATE.REGS[rt] = WB_MEM.ALUOutput;
-				break;
-			case 0xE:		//XORI
-				NEXT_STATE.REGS[rt] = WB_MEM.ALUOutput;
-				break;
-			case 0xD:		//ORI
-				NEXT_STATE.REGS[rt] = WB_MEM.ALUOutput;
-				break;
-			case 0xA:		//SLTI
-				if(EX_ID.A < EX_ID.imm)
-				{
-					NEXT_STATE.REGS[rt] = WB_MEM.ALUOutput;
-				}
-				else
-				{
-					NEXT_STATE.REGS[rt] = WB_MEM.ALUOutput;
-				}
-				break;
-			case 0x20:		//LB
-				// :(
-				NEXT_STATE.REGS[rt] = WB_MEM.LMD;
-				break;
-			case 0x21:		//LH
-				NEXT_STATE.REGS[rt] = WB_MEM.LMD;
-				break;
-			case 0xF:		//LUI
-				NEXT_STATE.REGS[rt] = WB_MEM.ALUOutput;
-				break;
-			case 0x23:		//LW
-				NEXT_STATE.REGS[rt] = WB_MEM.LMD;;
-				break;
-            case 0x3:		//JAL
-				NEXT_STATE.REGS[31] = WB_MEM.ALUOutput;
-				break;
+		ID_IF.IR = mem_read_32(mmu_translate(CURRENT_STATE.PC, CURRENT_STATE.PC));
+		ID_IF.PC = CURRENT_STATE.PC;
+		NEXT_STATE.PC = CURRENT_STATE.PC + 4;
+	}
+	if (ACCESS_FILE) {
+		access_append(ACCESS_FETCH, ID_IF.PC, ID_IF.PC, 4);
+	}
+	
+	ID_IF.SYSCALL = 0;
+	// a syscall reads and writes registers/memory in WB: fetch nothing after it until it retires
+	if (decode(ID_IF.IR) == INS_SYSCALL)
+		SYSCALL_PENDING = TRUE;
+}
+
+
+/************************************************************/
+/* functional mode: execute the instruction at PC in one cycle                */ 
+/************************************************************/
+void functional_step()
+{
+	if (NUM_INTERCEPTS && intercept_at(CURRENT_STATE.PC) != NULL) {
+		/* the call takes this one cycle */
+		if (TRACE_LEVEL) {
+			printf("STALL\n");
+		}
+		cpi_charge(STALL_MEMORY, CURRENT_STATE.PC);
+		intercept_call(intercept_at(CURRENT_STATE.PC));
+		return;
+	}
+
+	uint32_t instruction = mem_read_32(mmu_translate(CURRENT_STATE.PC, CURRENT_STATE.PC));
+	uint32_t id = decode(instruction);
+	uint32_t rs = (instruction & 0x3E00000) >> 21;
+	uint32_t rt = (instruction & 0x1F0000) >> 16;
+	uint32_t shamt = (instruction & 0x7C0) >> 6;
+	uint32_t imm = instruction & 0xFFFF;
+	uint32_t simm = (uint32_t)(int32_t)(int16_t)imm;
+	uint32_t a = CURRENT_STATE.REGS[rs];
+	uint32_t b = CURRENT_STATE.REGS[rt];
+	uint32_t hi = CURRENT_STATE.HI;
+	uint32_t lo = CURRENT_STATE.LO;
+	uint32_t pc = CURRENT_STATE.PC;
+	uint32_t address = a + simm;
+	uint32_t target = CURRENT_STATE.PC + (simm << 2);
+	uint32_t v0 = CURRENT_STATE.REGS[2];
+	int kind = INSTRUCTIONS[id].kind;
+	Hotspot_Counter *hotspot = hotspot_at(CURRENT_STATE.PC);
+
+	if (TRACE_LEVEL) {
+		PROF_START();
+		print_instruction_word(instruction);
+		PROF_STOP(PROF_TRACE);
+	}
+	INSTRUCTION_COUNT++;
+	STATS.MIX[INSTRUCTIONS[id].mix]++;
+	cpi_charge(STALL_NONE, CURRENT_STATE.PC);
+	if (hotspot) {
+		hotspot->retired++;
+	}
+	if (INSTRUCTIONS[id].kind == KIND_LOAD || INSTRUCTIONS[id].kind == KIND_STORE) {
+		address = mmu_translate(address, CURRENT_STATE.PC);
+		if (WATCH_PAGES != NULL) {
+			watch_access(pc, address, access_size(instruction), INSTRUCTIONS[id].kind == KIND_STORE ? WATCH_WRITE : WATCH_READ);
 		}
 	}
-}	
+	NEXT_STATE.PC = CURRENT_STATE.PC + 4;
+
+#define FUNCTIONAL_ALU(dest, value)		write_dest(dest, instruction, value);
+#define FUNCTIONAL_LOAD(dest, value)	write_dest(dest, instruction, value);
+#define FUNCTIONAL_STORE(dest, value)	(value);
+#define FUNCTIONAL_BRANCH(dest, value) \
+	if (value) { \
+		NEXT_STATE.PC = target; \
+		SPIN_BRANCH = pc; \
+	}
+#define FUNCTIONAL_JUMP(dest, value) \
+	write_dest(dest, instruction, pc + 4); \
+	NEXT_STATE.PC = (value); \
+	SPIN_BRANCH = pc;
+#define FUNCTIONAL_SYSCALL(dest, value)	syscall_execute(CURRENT_STATE.REGS[2]);
+#define X(name, op, fn, format, dest, reads, mix, kind, value) \
+		case INS_##name: \
+			FUNCTIONAL_##kind(DEST_##dest, value) \
+			break;
+
+	switch (id) {
+		MIPS_INSTRUCTIONS(X)
+	}
+#undef X
+
+	/* the same record WB writes: virtual EA or $v0, and the target if taken */
+	if (TRACE_MODE == TRACE_RECORD) {
+		trace_append(pc, instruction, kind == KIND_SYSCALL ? v0 :
+			(kind == KIND_LOAD || kind == KIND_STORE) ? a + simm : 0,
+			(kind == KIND_BRANCH || kind == KIND_JUMP) && SPIN_BRANCH == pc ? NEXT_STATE.PC : 0);
+	}
+}
+
+/************************************************************/
+/* Initialize Memory                                                                                                    */ 
+/************************************************************/
+void initialize() { 
+	init_memory();
+	decode_init();
+	pipeline_select();
+	syscall_reset();
+	CURRENT_STATE.PC = MEM_TEXT_BEGIN;
+	NEXT_STATE = CURRENT_STATE;
+	RUN_FLAG = TRUE;
+}
+
+/************************************************************/
+/* Print the program loaded into memory (in MIPS assembly format)    */ 
+/************************************************************/
+void print_program(){
+	/*IMPLEMENT THIS*/
+	int i;
+	uint32_t addr;
+	
+	for(i=0; i<PROGRAM_SIZE; i++){
+		addr = MEM_TEXT_BEGIN + (i*4);
+		printf("[0x%x]\t", addr);
+		print_instruction(addr);
+	}
+}
+
+void print_instruction(uint32_t addr){
+	/*IMPLEMENT THIS*/
+	print_instruction_word(mem_read_32(addr));
+}
 
 /************************************************************/
-/* memory access (MEM) pipeline stage:                                                          */ 
+/* Disassemble one instruction word                                                                        */ 
 /************************************************************/
-void MEM()
-{
-	if(CYCLE_COUNT < 4 || WB_MEM.SYSCALL == 0xA)
-	{
-		return;
-	}
+void print_instruction_word(uint32_t current_instruction){
+	const Instruction_Info *info = &INSTRUCTIONS[decode(current_instruction)];
+	const char *name = info->name;
 
-	//print_instruction(WB_MEM.PC);
+	// Other masks
+	uint32_t rs_mask = 0x3E00000, rt_mask = 0x1F0000, immediate_mask = 0xFFFF, rd_mask = 0xF800, shamt_mask = 0x7C0, offset_mask = 0x3FFFFFF;
+	uint32_t rs = (rs_mask & current_instruction) >> 21;
+	uint32_t rt = (rt_mask & current_instruction) >> 16;
+	uint32_t immediate = (immediate_mask & current_instruction);
+	uint32_t rd = (rd_mask & current_instruction) >> 11;
+	uint32_t shamt = (shamt_mask & current_instruction) >> 6;
+	uint32_t offset = (offset_mask & current_instruction);
+	// branch offsets are shown in bytes
+	uint32_t branch = (uint32_t)((int16_t)(immediate * 4));
 
-	WB_MEM.IR = MEM_EX.IR;
-	WB_MEM.PC = MEM_EX.PC;
-	WB_MEM.SYSCALL = MEM_EX.SYSCALL;
+	switch (info->format) {
+		case FMT_SHIFT:
+			printf("%s $%d, $%d, 0x%x\n", name, rd, rt, shamt);
+			break;
+		case FMT_RS:
+			printf("%s $%d\n", name, rs);
+			break;
+		case FMT_RD:
+			printf("%s $%d\n", name, rd);
+			break;
+		case FMT_RSRT:
+			printf("%s $%d, $%d\n", name, rs, rt);
+			break;
+		case FMT_R3:
+			printf("%s $%d, $%d, $%d\n", name, rd, rs, rt);
+			break;
+		case FMT_JALR:
+			printf("%s $%d, $%d\n", name, rs, rd);
+			break;
+		case FMT_NONE:
+			printf("%s\n", name);
+			break;
+		case FMT_IMM:
+			printf("%s $%d, $%d, 0x%x\n", name, rt, rs, immediate);
+			break;
+		case FMT_LUI:
+			printf("%s $%d, 0x%x\n", name, rt, immediate);
+			break;
+		case FMT_MEM:
+			printf("%s $%d, 0x%x($%d)\n", name, rt, immediate, rs);
+			break;
+		case FMT_BRANCH1:
+			printf("%s $%d, 0x%x\n", name, rs, branch);
+			break;
+		case FMT_BRANCH2:
+			printf("%s $%d, $%d, 0x%x\n", name, rs, rt, branch);
+			break;
+		case FMT_JUMP:
+			printf("%s 0x%x\n", name, offset);
+			break;
+	}
+}
 
+/************************************************************/
+/* Print the current pipeline                                                                                    */ 
+/************************************************************/
+void show_pipeline(){
+	printf("Current PC: 		%X\n", CURRENT_STATE.PC);
+	printf("IF/ID.IR			%X  ", ID_IF.IR);
+	print_instruction(ID_IF.PC);
+	printf("IF/ID.PC			%X\n", ID_IF.PC);
+	printf("\n");
 
-	uint32_t opcode = (MEM_EX.IR & 0xFC000000) >> 26;
-    uint32_t function = (MEM_EX.IR & 0x3F);
-	uint32_t WB_rd = (0xF800 & WB_MEM.IR) >> 11;
-	uint32_t MEM_rd = (0xF800 & MEM_EX.IR) >> 11;
-	uint32_t EX_rs = (0x3E00000 & EX_ID.IR) >> 21;
-	uint32_t EX_rt = (0x1F0000 & EX_ID.IR) >> 16;
+	printf("ID/EX.IR			%X  ", EX_ID.IR);
+	print_instruction(EX_ID.PC);
+	printf("ID/EX.A				%X\n", EX_ID.A);
+	printf("ID/EX.B				%X\n", EX_ID.B);
+	printf("ID/EX.imm			%X\n", EX_ID.imm);
+	printf("\n");
 
-	if(ENABLE_FORWARDING)
-	{
-		if(opcode == 0x29 || opcode == 0x2B || opcode == 0x28)
-		{
-			
-		}
-		else
-		{
-			if((WB_rd != 0) && !((MEM_rd != 0) && (MEM_rd == EX_rs)) && (WB_rd == EX_rs))
-			{
-				//print_instruction(WB_MEM.PC);
-				ForwardA = 01;
-			}
-			
-			if((WB_rd != 0) && !((MEM_rd != 0) && (MEM_rd == EX_rt)) && (WB_rd == EX_rt))
-			{
-				//print_instruction(WB_MEM.PC);
-				ForwardB = 01;
-			}
-		}
-	}
-	
-/*	
-	printf("\n===================MEM=================\n");
+	printf("EX/MEM.IR			%X  ", MEM_EX.IR);
+	print_instruction(MEM_EX.PC);
+	printf("EX/MEM.A			%X\n", MEM_EX.A);
+	printf("EX/MEM.B			%X\n", MEM_EX.B);
+	printf("EX/MEM.ALUOutput	%X\n", MEM_EX.ALUOutput);
+	printf("EX/MEM.ALUOutput2	%X\n", MEM_EX.ALUOutput2);
+	printf("\n");
+
+	printf("MEM/WEB.IR			%X  ", WB_MEM.IR);
 	print_instruction(WB_MEM.PC);
-	printf("MEM.SYSCALL = %X\n", WB_MEM.SYSCALL);
-	printf("MEM opcode = %X\n", opcode);
-	printf("====================================\n");
-*/
-	if (opcode == 0x00) {
-		WB_MEM.ALUOutput = MEM_EX.ALUOutput;
-		WB_MEM.ALUOutput2 = MEM_EX.ALUOutput2;
-        switch(function) {
-			case 0x8:		//JR
-			case 0x9:		//JALR
-				controlHazard = 0;
-                jumpStall = 0;
-                break;
-        }
-	}
-	// Regular opcode (I-Type)
-	else {
-		switch(opcode) {
-			case 0x8:		//ADDI
-				WB_MEM.ALUOutput = MEM_EX.ALUOutput;
-				break;
-			case 0x9:		//ADDIU
-				WB_MEM.ALUOutput = MEM_EX.ALUOutput;
-				break;
-			case 0xC:		//ANDI
-				WB_MEM.ALUOutput = MEM_EX.ALUOutput;
-				break;
-			case 0xE:		//XORI
-				WB_MEM.ALUOutput = MEM_EX.ALUOutput;
-				break;
-			case 0xD:		//ORI
-				WB_MEM.ALUOutput = MEM_EX.ALUOutput;
-				break;
-			case 0xA:		//SLTI
-				if(EX_ID.A < EX_ID.imm)
-				{
-					WB_MEM.ALUOutput = MEM_EX.ALUOutput;
-				}
-				else
-				{
-					WB_MEM.ALUOutput = MEM_EX.ALUOutput;
-				}
-				break;
-			case 0x20:		//LB
-				// :(
-				WB_MEM.LMD = (int32_t)((int16_t)(mem_read_32(MEM_EX.ALUOutput) >> 24));
-				MEM_EX.ALUOutput = WB_MEM.LMD;
-				break;
-			case 0x21:		//LH
-				WB_MEM.LMD = (int32_t)((int16_t)(mem_read_32(MEM_EX.ALUOutput) >> 16));
-				MEM_EX.ALUOutput = WB_MEM.LMD;
-				break;
-			case 0xF:		//LUI
-				WB_MEM.ALUOutput = MEM_EX.ALUOutput;
-				break;
-			case 0x23:		//LW
-				WB_MEM.LMD = mem_read_32(MEM_EX.ALUOutput);
-				MEM_EX.ALUOutput = WB_MEM.LMD;
-				break;
-			case 0x29:		//SH
-				mem_write_32(MEM_EX.ALUOutput, (((int32_t)((int16_t)(MEM_EX.B & 0xFFFF))) << 16) + (0xFFFF & mem_read_32(MEM_EX.ALUOutput)));
-				break;
-			case 0x28:		//SB
-				mem_write_32(MEM_EX.ALUOutput, (((int32_t)((int8_t)(MEM_EX.B & 0xFF))) << 24) + (0xFFFFFF & mem_read_32(MEM_EX.ALUOutput)));
-				break;
-			case 0x2B:		//SW
-				mem_write_32(MEM_EX.ALUOutput, MEM_EX.B);
-				break;
-            case 0x1:
-            case 0x2:
-            case 0x3:
-            case 0x4:
-            case 0x5:
-            case 0x6:
-            case 0x7:
-                controlHazard = 0;
-                jumpStall = 0;
-                break;
-		}
-	}
+	printf("MEM/WEB.A			%X\n", WB_MEM.IR);
+	printf("MEM/WEB.LMD			%X\n", WB_MEM.IR);
 }
 
 /************************************************************/
-/* execution (EX) pipeline stage:                                                                          */ 
+/* Lockstep batch engine                                                                                           */ 
 /************************************************************/
-void EX()
-{
-	if(CYCLE_COUNT < 3 || MEM_EX.SYSCALL == 0xA)
-	{
-		return;
-	}
-
-	//print_instruction(MEM_EX.PC);
-
-	MEM_EX.IR = EX_ID.IR;
-	MEM_EX.PC = EX_ID.PC;
-	MEM_EX.SYSCALL = EX_ID.SYSCALL;
+#if defined(__AVX2__)
+typedef __m256i lane_vec;
+#define VLOAD(p)			_mm256_load_si256((const __m256i *)(p))
+#define VSTORE(p, v)		_mm256_store_si256((__m256i *)(p), (v))
+#define VSET(x)				_mm256_set1_epi32(x)
+#define VADD(a, b)			_mm256_add_epi32(a, b)
+#define VSUB(a, b)			_mm256_sub_epi32(a, b)
+#define VAND(a, b)			_mm256_and_si256(a, b)
+#define VOR(a, b)			_mm256_or_si256(a, b)
+#define VXOR(a, b)			_mm256_xor_si256(a, b)
+#define VEQ(a, b)			_mm256_cmpeq_epi32(a, b)
+#define VGT(a, b)			_mm256_cmpgt_epi32(a, b)
+#define VSLL(a, n)			_mm256_sll_epi32(a, _mm_cvtsi32_si128(n))
+#define VSRL(a, n)			_mm256_srl_epi32(a, _mm_cvtsi32_si128(n))
+#define VSRA(a, n)			_mm256_sra_epi32(a, _mm_cvtsi32_si128(n))
+#define VBLEND(old, new, m)	_mm256_blendv_epi8(old, new, m)
+#elif defined(__SSE2__)
+typedef __m128i lane_vec;
+#define VLOAD(p)			_mm_load_si128((const __m128i *)(p))
+#define VSTORE(p, v)		_mm_store_si128((__m128i *)(p), (v))
+#define VSET(x)				_mm_set1_epi32(x)
+#define VADD(a, b)			_mm_add_epi32(a, b)
+#define VSUB(a, b)			_mm_sub_epi32(a, b)
+#define VAND(a, b)			_mm_and_si128(a, b)
+#define VOR(a, b)			_mm_or_si128(a, b)
+#define VXOR(a, b)			_mm_xor_si128(a, b)
+#define VEQ(a, b)			_mm_cmpeq_epi32(a, b)
+#define VGT(a, b)			_mm_cmpgt_epi32(a, b)
+#define VSLL(a, n)			_mm_sll_epi32(a, _mm_cvtsi32_si128(n))
+#define VSRL(a, n)			_mm_srl_epi32(a, _mm_cvtsi32_si128(n))
+#define VSRA(a, n)			_mm_sra_epi32(a, _mm_cvtsi32_si128(n))
+#define VBLEND(old, new, m)	_mm_or_si128(_mm_and_si128(m, new), _mm_andnot_si128(m, old))
+#else
+typedef uint32_t lane_vec;
+#define VLOAD(p)			(*(p))
+#define VSTORE(p, v)		(*(p) = (v))
+#define VSET(x)				((uint32_t)(x))
+#define VADD(a, b)			((a) + (b))
+#define VSUB(a, b)			((a) - (b))
+#define VAND(a, b)			((a) & (b))
+#define VOR(a, b)			((a) | (b))
+#define VXOR(a, b)			((a) ^ (b))
+#define VEQ(a, b)			((a) == (b) ? 0xFFFFFFFF : 0)
+#define VGT(a, b)			((int32_t)(a) > (int32_t)(b) ? 0xFFFFFFFF : 0)
+#define VSLL(a, n)			((a) << (n))
+#define VSRL(a, n)			((a) >> (n))
+#define VSRA(a, n)			((uint32_t)((int32_t)(a) >> (n)))
+#define VBLEND(old, new, m)	(((m) & (new)) | (~(m) & (old)))
+#endif
 
-	if(EX_ID.IR == 0 && EX_ID.PC == 0 && EX_ID.SYSCALL == 0)
-	{
-		//printf("EX STALL\n");
-		return;
+/* dest = expr on every active lane; expr may use the operand vectors a (rs) and b (rt) */
+#define LANE_ALU(dest, expr) \
+	if ((dest) != 0) { \
+		for (i = 0; i < BATCH.padded; i += LANE_WIDTH) { \
+			lane_vec m = VLOAD(&BATCH.ACTIVE[i]); \
+			lane_vec a = VLOAD(&BATCH.REGS[rs][i]); \
+			lane_vec b = VLOAD(&BATCH.REGS[rt][i]); \
+			(void)a; (void)b; \
+			VSTORE(&BATCH.REGS[dest][i], VBLEND(VLOAD(&BATCH.REGS[dest][i]), (expr), m)); \
+		} \
 	}
 
-	
-	uint32_t opcode = (EX_ID.IR & 0xFC000000) >> 26;
-	uint32_t function = (EX_ID.IR & 0x3F);
-	uint32_t shamt = (0x7C0 & EX_ID.IR) >> 6;
-	uint32_t sixteen_bit_mask = 0xFFFF;
-	uint32_t MEM_rd = (0xF800 & MEM_EX.IR) >> 11;
-	uint32_t EX_rs = (0x3E00000 & EX_ID.IR) >> 21;
-	uint32_t EX_rt = (0x1F0000 & EX_ID.IR) >> 16;
+/* PC = taken ? target : PC + 4 on every active lane; cond is a lane mask over a (rs) and b (rt) */
+#define LANE_BRANCH(cond) \
+	for (i = 0; i < BATCH.padded; i += LANE_WIDTH) { \
+		lane_vec m = VLOAD(&BATCH.ACTIVE[i]); \
+		lane_vec a = VLOAD(&BATCH.REGS[rs][i]); \
+		lane_vec b = VLOAD(&BATCH.REGS[rt][i]); \
+		(void)a; (void)b; \
+		lane_vec next = VBLEND(VSET(pc + 4), VSET(target), (cond)); \
+		VSTORE(&BATCH.PC[i], VBLEND(VLOAD(&BATCH.PC[i]), next, m)); \
+	}
 
-	uint64_t product;
+#define FOR_ACTIVE_LANES(lane) \
+	for (lane = 0; lane < BATCH.lanes; lane++) if (BATCH.ACTIVE[lane])
 
-	if(ENABLE_FORWARDING)
-	{
-		
-		if (ForwardA == 10)
-		{
-			
-			EX_ID.A = MEM_EX.ALUOutput;
-			ForwardA = 0;
-		}
-		else if (ForwardA == 01)
-		{
-			EX_ID.A = WB_MEM.ALUOutput;
-			ForwardA = 0;
-		}
-		if (ForwardB == 10)
-		{
-			EX_ID.B = MEM_EX.ALUOutput;
-			ForwardB = 0;
-		}
-		else if (ForwardB == 01)
-		{
-			EX_ID.B = WB_MEM.ALUOutput;
-			ForwardB = 0;
-		}
+/************************************************************/
+/* Slot of a word address in a lane's private store table                        */ 
+/************************************************************/
+static uint32_t lane_slot(Lane_Memory *mem, uint32_t address)
+{
+	uint32_t slot = (address >> 2) * 0x9E3779B1u & (mem->capacity - 1);
+	while (mem->addr[slot] != 0 && mem->addr[slot] != address) {
+		slot = (slot + 1) & (mem->capacity - 1);
 	}
+	return slot;
+}
 
-	if(ENABLE_FORWARDING)
-	{
-		EX_ID.IR = ID_IF.IR;
-		EX_ID.PC = ID_IF.PC;
-		EX_ID.SYSCALL = ID_IF.SYSCALL;
-		MEM_rd = (0xF800 & MEM_EX.IR) >> 11;
-		EX_rs = (0x3E00000 & EX_ID.IR) >> 21;
-		EX_rt = (0x1F0000 & EX_ID.IR) >> 16;
-		if(opcode == 0x29 || opcode == 0x2B || opcode == 0x28)
-		{
-			
+/************************************************************/
+/* Read a word as seen by one lane                                                                     */ 
+/************************************************************/
+static uint32_t lane_read_32(uint32_t lane, uint32_t address)
+{
+	Lane_Memory *mem = &BATCH.MEM[lane];
+	address &= ~3;
+	if (mem->count) {
+		uint32_t slot = lane_slot(mem, address);
+		if (mem->addr[slot] == address) {
+			return mem->data[slot];
 		}
-		else
-		{
-
-			if(opcode != 0x00){
-				MEM_rd = (0x1F0000 & MEM_EX.IR) >> 16;}
+	}
+	return mem_read_32(address);
+}
 
-			if((MEM_rd != 0) && (MEM_rd == EX_rs)){
-				ForwardA = 10;}
+/************************************************************/
+/* Write a word into a lane's private store table                                       */ 
+/************************************************************/
+static void lane_write_32(uint32_t lane, uint32_t address, uint32_t value)
+{
+	Lane_Memory *mem = &BATCH.MEM[lane];
+	uint32_t slot, i;
 
-			if((MEM_rd != 0) && (MEM_rd == EX_rt)){
-				//print_instruction(MEM_EX.PC);
-				ForwardB = 10;}
+	address &= ~3;
+	if ((mem->count + 1) * 2 > mem->capacity) {
+		Lane_Memory old = *mem;
+		mem->capacity = old.capacity ? old.capacity * 2 : 64;
+		mem->addr = calloc(mem->capacity, sizeof(uint32_t));
+		mem->data = calloc(mem->capacity, sizeof(uint32_t));
+		mem->count = 0;
+		for (i = 0; i < old.capacity; i++) {
+			if (old.addr[i] != 0) {
+				slot = lane_slot(mem, old.addr[i]);
+				mem->addr[slot] = old.addr[i];
+				mem->data[slot] = old.data[i];
+				mem->count++;
+			}
 		}
+		free(old.addr);
+		free(old.data);
 	}
-
-	if (opcode == 0x00) {
-		switch(function) {
-			case 0x00:		//SLL
-				MEM_EX.ALUOutput = EX_ID.B << shamt;
-				break;
-			case 0x02:		//SRL
-				MEM_EX.ALUOutput = EX_ID.B >> shamt;
-				break;
-			case 0x03:		//SRA
-				MEM_EX.ALUOutput = EX_ID.B >> shamt;
-				break;
-			case 0x0C:		//SYSCALL
-				if(EX_ID.SYSCALL == 0xA)
-				{
-					MEM_EX.ALUOutput = 0xA;
-				} 
-				break;
-			case 0x10:		//MFHI
-				MEM_EX.ALUOutput = EX_ID.HI;
-				break;
-			case 0x11:		//MTHI
-				MEM_EX.ALUOutput = EX_ID.A;
-				break;
-			case 0x12:		//MFLO
-				MEM_EX.ALUOutput = EX_ID.LO;
-				break;
-			case 0x13:		//MTLO
-				MEM_EX.ALUOutput = EX_ID.A;
-				break;
-			case 0x18:		//MULT
-				product = EX_ID.A * EX_ID.B;
-				MEM_EX.ALUOutput = product >> 32;
-				MEM_EX.ALUOutput2 = product & 0xFFFFFFFF;
-				break;
-			case 0x19:		//MULT Unsigned
-				product = EX_ID.A * EX_ID.B;
-				MEM_EX.ALUOutput = product >> 32;
-				MEM_EX.ALUOutput2 = product & 0xFFFFFFFF;
-				break;
-			case 0x1A:		//DIV
-				MEM_EX.ALUOutput = EX_ID.A / EX_ID.B;
-				MEM_EX.ALUOutput2 = EX_ID.A % EX_ID.B;
-				break;
-			case 0x1B:		//DIVU
-                if (EX_ID.B == 0){
-					int rt = ((0x1F0000 & MEM_EX.IR) >> 16);
-					EX_ID.B = NEXT_STATE.REGS[rt];}
-				MEM_EX.ALUOutput = EX_ID.A / EX_ID.B;
-				MEM_EX.ALUOutput2 = EX_ID.A % EX_ID.B;
-				break;
-			case 0x20:		//ADD
-				MEM_EX.ALUOutput = EX_ID.A + EX_ID.B;
-				break;
-			case 0x21:		//ADD Unsigned
-				MEM_EX.ALUOutput = EX_ID.A + EX_ID.B;
-				break;
-			case 0x22:		//SUB
-				MEM_EX.ALUOutput = EX_ID.A - EX_ID.B;
-				break;
-			case 0x23:		//SUB Unsigned
-				MEM_EX.ALUOutput = EX_ID.A - EX_ID.B;
-				break;
-			case 0x24:		//AND
-				MEM_EX.ALUOutput = EX_ID.A & EX_ID.B;
-				break;
-			case 0x25:		//OR
-				MEM_EX.ALUOutput = EX_ID.A | EX_ID.B;
-				break;
-			case 0x26:		//XOR
-				MEM_EX.ALUOutput = EX_ID.A ^ EX_ID.B;
-				break;
-			case 0x27:		//NOR
-				MEM_EX.ALUOutput = ~(EX_ID.A | EX_ID.B);
-				break;
-			case 0x2A:		//SLT
-				if(EX_ID.A < EX_ID.B){
-					MEM_EX.ALUOutput = 0x00000001;}
-				else{
-					MEM_EX.ALUOutput = 0x00000000;}
-				break;
-            case 0x08:		//JR
-				CURRENT_STATE.PC = EX_ID.A;
-                jumpStall = 1;
-				break;
-			case 0x09:		//JALR
-				MEM_EX.ALUOutput = EX_ID.PC;
-				CURRENT_STATE.PC = EX_ID.A;
-                jumpStall = 1;
-				break;
-		}
-	} 
-	// Regular opcode (I-Type)
-	else {
-		switch(opcode) {
-			case 0x8:		//ADDI
-				MEM_EX.ALUOutput = EX_ID.A + EX_ID.imm;
-				break;
-			case 0x9:		//ADDIU
-				MEM_EX.ALUOutput = EX_ID.A + EX_ID.imm;
-				break;
-			case 0xC:		//ANDI
-				MEM_EX.ALUOutput = EX_ID.imm & EX_ID.A & sixteen_bit_mask;
-				break;
-			case 0xE:		//XORI
-				MEM_EX.ALUOutput = EX_ID.A ^ EX_ID.imm;
-				break;
-			case 0xD:		//ORI
-				MEM_EX.ALUOutput = EX_ID.A | EX_ID.imm;
-				break;
-			case 0xA:		//SLTI
-				if(EX_ID.A < EX_ID.imm)
-				{
-					MEM_EX.ALUOutput = 0x00000001;
-				}
-				else
-				{
-					MEM_EX.ALUOutput = 0x00000000;
-				}
-				break;
-			case 0x20:		//LB
-				// :(
-				MEM_EX.ALUOutput = EX_ID.imm + EX_ID.A;
-				MEM_EX.B = EX_ID.B;
-				break;
-			case 0x21:		//LH
-				MEM_EX.ALUOutput = EX_ID.imm + EX_ID.A;
-				MEM_EX.B = EX_ID.B;
-				break;
-			case 0xF:		//LUI
-				MEM_EX.ALUOutput = (EX_ID.imm << 16);
-				break;
-			case 0x23:		//LW
-				MEM_EX.ALUOutput = EX_ID.imm + EX_ID.A;
-				MEM_EX.B = EX_ID.B;
-				break;
-			case 0x29:		//SH
-				MEM_EX.ALUOutput = EX_ID.imm + EX_ID.A;
-				MEM_EX.B = EX_ID.B;
-				break;
-			case 0x28:		//SB
-				MEM_EX.ALUOutput = EX_ID.imm + EX_ID.A;
-				MEM_EX.B = EX_ID.B;
-				break;
-			case 0x2B:		//SW
-				MEM_EX.ALUOutput = EX_ID.imm + EX_ID.A;
-				MEM_EX.B = EX_ID.B;
-				break;
-				
-			//Branches and Jumps
-			case 0x4://BEQ
-				if (EX_ID.A == EX_ID.B)
-                {
-					( (EX_ID.imm) > 0 ? (EX_ID.imm | 0xFFFF0000)<<2 : (EX_ID.imm & 0x0000FFFF)<<2);
-                    jumpStall = 1;
-                }
-				break;
-			case 0x1:
-				if (EX_ID.B == 1)
-				{
-					// BGEZ
-					if (((int32_t)EX_ID.A) >= 0)
-                    {
-						( (EX_ID.imm) > 0 ? (EX_ID.imm | 0xFFFF0000)<<2 : (EX_ID.imm & 0x0000FFFF)<<2);
-                        jumpStall = 1;
-                    }
-				} 
-				else if (EX_ID.B == 0) 
-				{
-					// BLTZ
-					if (((int32_t)EX_ID.A) < 0)
-                    {
-						( (EX_ID.imm) > 0 ? (EX_ID.imm | 0xFFFF0000)<<2 : (EX_ID.imm & 0x0000FFFF)<<2);
-                        jumpStall = 1;
-                    }
-				}
-				break;
-			case 0x7://BGTZ
-				if (((int32_t)EX_ID.A) > 0){
-					CURRENT_STATE.PC = EX_ID.PC + 
-					( (EX_ID.imm) > 0 ? (EX_ID.imm | 0xFFFF0000)<<2 : (EX_ID.imm & 0x0000FFFF)<<2);
-					jumpStall = 1;}
-				break;
-				
-			case 0x6://BLEZ
-				if (((int32_t)EX_ID.A) <= 0){
-					CURRENT_STATE.PC = EX_ID.PC + 
-					((EX_ID.imm) > 0 ? (EX_ID.imm | 0xFFFF0000)<<2 : (EX_ID.imm & 0x0000FFFF)<<2);
-					jumpStall = 1;}
-				break;
-			case 0x5://BNE
-				if (EX_ID.A != EX_ID.B){
-					CURRENT_STATE.PC = EX_ID.PC + 
-					( (EX_ID.imm) > 0 ? (EX_ID.imm | 0xFFFF0000)<<2 : (EX_ID.imm & 0x0000FFFF)<<2);
-					jumpStall = 1;}
-				break;
-				
-			case 0x2://J
-                jumpStall = 1;
-				CURRENT_STATE.PC = ((EX_ID.PC >> 28) << 28) + ((EX_ID.IR & 0x3FFFFFF) << 2);
-				break;
-				
-			case 0x3://JAL
-				CURRENT_STATE.PC = ((EX_ID.PC >> 28) << 28) + ((EX_ID.IR & 0x3FFFFFF) << 2);
-				MEM_EX.ALUOutput = EX_ID.PC;
-				break;
-		}
+	slot = lane_slot(mem, address);
+	if (mem->addr[slot] == 0) {
+		mem->addr[slot] = address;
+		mem->count++;
 	}
+	mem->data[slot] = value;
 }
 
 /************************************************************/
-/* instruction decode (ID) pipeline stage:                                                         */ 
+/* Release all lanes                                                                                                    */ 
 /************************************************************/
-void ID()
+static void batch_free()
 {
-	if(CYCLE_COUNT < 2 || EX_ID.SYSCALL == 0xA)
-	{
-		return;
-	}
+	uint32_t lane;
+	int r;
 
-	int stallFlag = 0;
-	if(EX_ID.IR == 0 && EX_ID.PC == 0 && EX_ID.SYSCALL == 0)
-	{
-		stallFlag = 1;
+	for (r = 0; r < MIPS_REGS; r++) {
+		free(BATCH.REGS[r]);
 	}
+	free(BATCH.HI);
+	free(BATCH.LO);
+	free(BATCH.PC);
+	free(BATCH.ACTIVE);
+	free(BATCH.STATUS);
+	free(BATCH.COUNT);
+	for (lane = 0; lane < BATCH.lanes; lane++) {
+		free(BATCH.MEM[lane].addr);
+		free(BATCH.MEM[lane].data);
+	}
+	free(BATCH.MEM);
+	memset(&BATCH, 0, sizeof(BATCH));
+}
 
+/************************************************************/
+/* Allocate one lane array, aligned for vector loads                                 */ 
+/************************************************************/
+static uint32_t *lane_array(uint32_t value)
+{
+	/* aligned_alloc wants a multiple of the alignment */
+	uint32_t *array = aligned_alloc(32, (BATCH.padded * sizeof(uint32_t) + 31) & ~(size_t)31);
+	uint32_t i;
+	for (i = 0; i < BATCH.padded; i++) {
+		array[i] = value;
+	}
+	return array;
+}
 
-	EX_ID.IR = ID_IF.IR;
-	EX_ID.PC = ID_IF.PC;
-	EX_ID.SYSCALL = ID_IF.SYSCALL;
+/************************************************************/
+/* Create one lane per line of <filename>. Every lane starts from the     */
+/* current register state; a line lists "<reg> <value>" pairs to override. */
+/************************************************************/
+int batch_load(char *filename)
+{
+	char line[1024];
+	uint32_t lanes = 0, lane, reg, value;
+	int r, n, used;
+	char *p;
+	FILE *fp;
 
-    if(controlHazard == 1)
-	{
-		EX_ID.IR = 0;
-		EX_ID.PC = 0;
-		EX_ID.SYSCALL = 0;
+	fp = fopen(filename, "r");
+	if (fp == NULL) {
+		printf("Error: Can't open lane file %s\n", filename);
+		return -1;
+	}
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		lanes++;
+	}
+	if (lanes == 0) {
+		printf("Error: %s describes no lanes\n", filename);
+		fclose(fp);
+		return -1;
 	}
 
-    if (jumpStall == 1)
-    {
-        EX_ID.IR = 0;
-		EX_ID.PC = 0;
-		EX_ID.SYSCALL = 0;
-        return;
-    }
+	batch_free();
+	BATCH.lanes = lanes;
+	BATCH.padded = (lanes + LANE_WIDTH - 1) / LANE_WIDTH * LANE_WIDTH;
+	for (r = 0; r < MIPS_REGS; r++) {
+		BATCH.REGS[r] = lane_array(CURRENT_STATE.REGS[r]);
+	}
+	BATCH.HI = lane_array(CURRENT_STATE.HI);
+	BATCH.LO = lane_array(CURRENT_STATE.LO);
+	BATCH.PC = lane_array(CURRENT_STATE.PC);
+	BATCH.ACTIVE = lane_array(0);
+	BATCH.STATUS = lane_array(LANE_RUNNING);
+	BATCH.COUNT = lane_array(0);
+	BATCH.MEM = calloc(lanes, sizeof(Lane_Memory));
+	for (lane = lanes; lane < BATCH.padded; lane++) {
+		BATCH.STATUS[lane] = LANE_EXITED;
+	}
 
+	rewind(fp);
+	for (lane = 0; lane < lanes && fgets(line, sizeof(line), fp) != NULL; lane++) {
+		for (p = line; sscanf(p, "%u %i%n", &reg, &value, &used) == 2; p += used) {
+			if (reg < MIPS_REGS && reg != 0) {
+				BATCH.REGS[reg][lane] = value;
+			}
+		}
+	}
+	fclose(fp);
+	n = lanes;
+	printf("%d lanes loaded from %s (%d-wide SIMD)\n", n, filename, LANE_WIDTH);
+	return 0;
+}
 
-	
-	uint32_t rs = (0x3E00000 & ID_IF.IR) >> 21;
-	uint32_t rt = (0x1F0000 & ID_IF.IR) >> 16;
-	uint32_t immediate = (0xFFFF & ID_IF.IR);
-	EX_ID.A = CURRENT_STATE.REGS[rs];
-	EX_ID.B = CURRENT_STATE.REGS[rt];
-	EX_ID.HI = CURRENT_STATE.HI;
-	EX_ID.LO = CURRENT_STATE.LO;
-	EX_ID.imm = (uint32_t)((int16_t)immediate);
-	uint32_t opcode = (EX_ID.IR & 0xFC000000) >> 26;
+/************************************************************/
+/* Pick the next PC (lowest PC among running lanes, so diverged lanes */
+/* reconverge) and mark the lanes that are at it. Returns the number of */
+/* running lanes left behind, or -1 when every lane has finished.          */
+/************************************************************/
+static int batch_schedule(uint32_t *pc)
+{
+	uint32_t lane, best = 0xFFFFFFFF;
+	int running = 0, active = 0;
 
-	if (stallFlag == 1 || (ENABLE_FORWARDING && (opcode == 0x29 || opcode == 0x2B || opcode == 0x28)))
-	{
-		EX_ID.A = NEXT_STATE.REGS[rs];
-		EX_ID.B = NEXT_STATE.REGS[rt];
+	for (lane = 0; lane < BATCH.lanes; lane++) {
+		if (BATCH.STATUS[lane] == LANE_RUNNING) {
+			running++;
+			if (BATCH.PC[lane] < best) {
+				best = BATCH.PC[lane];
+			}
+		}
+	}
+	for (lane = 0; lane < BATCH.lanes; lane++) {
+		BATCH.ACTIVE[lane] = (BATCH.STATUS[lane] == LANE_RUNNING && BATCH.PC[lane] == best) ? 0xFFFFFFFF : 0;
+		active += BATCH.ACTIVE[lane] != 0;
 	}
+	*pc = best;
+	return running ? running - active : -1;
+}
 
-	uint32_t MEM_rd = (0xF800 & MEM_EX.IR) >> 11;
-	uint32_t WB_rd = (0xF800 & WB_MEM.IR) >> 11;
-	uint32_t EX_rs = (0x3E00000 & EX_ID.IR) >> 21;
-	uint32_t EX_rt = (0x1F0000 & EX_ID.IR) >> 16;
-	uint32_t function = (EX_ID.IR & 0x3F);
-	uint32_t MEM_opcode = (MEM_EX.IR & 0xFC000000) >> 26;
-	uint32_t WB_opcode = (WB_MEM.IR & 0xFC000000) >> 26;
-	
+/************************************************************/
+/* Execute the instruction at <pc> on every active lane. Returns TRUE  */
+/* if it changed control flow, FALSE if the active lanes are at pc + 4.    */
+/************************************************************/
+static int batch_execute(uint32_t pc)
+{
+	uint32_t instruction = mem_read_32(pc);
+	uint32_t id = decode(instruction);
+	uint32_t rs = (instruction & 0x3E00000) >> 21;
+	uint32_t rt = (instruction & 0x1F0000) >> 16;
+	uint32_t rd = (instruction & 0xF800) >> 11;
+	uint32_t shamt = (instruction & 0x7C0) >> 6;
+	uint32_t imm = instruction & 0xFFFF;
+	uint32_t simm = (uint32_t)(int32_t)(int16_t)imm;
+	uint32_t target = pc + (simm << 2);
+	uint32_t lane, address, value;
+	uint64_t product;
+	uint32_t i;
 
-	if((!ENABLE_FORWARDING) && MEM_opcode == 0x00)
-	{
-		if(!(MEM_opcode == 0x29 || MEM_opcode == 0x2B || MEM_opcode == 0x28))
-		{
-			if((MEM_rd != 0) && (MEM_rd == EX_rs))
-			{
-				//print_instruction(EX_ID.PC);
-				EX_ID.IR = 0;
-				EX_ID.PC = 0;
-				EX_ID.SYSCALL = 0;
+	FOR_ACTIVE_LANES(lane) {
+		BATCH.COUNT[lane]++;
+	}
+
+	switch (id) {
+		case INS_SLL:
+			LANE_ALU(rd, VSLL(b, shamt));
+			break;
+		case INS_SRL:
+			LANE_ALU(rd, VSRL(b, shamt));
+			break;
+		case INS_SRA:
+			LANE_ALU(rd, VSRA(b, shamt));
+			break;
+		case INS_JR:
+		case INS_JALR:
+			LANE_ALU(id == INS_JALR ? rd : 0, VSET(pc + 4));
+			for (i = 0; i < BATCH.padded; i += LANE_WIDTH) {
+				lane_vec m = VLOAD(&BATCH.ACTIVE[i]);
+				VSTORE(&BATCH.PC[i], VBLEND(VLOAD(&BATCH.PC[i]), VLOAD(&BATCH.REGS[rs][i]), m));
+			}
+			return TRUE;
+		case INS_SYSCALL:
+			FOR_ACTIVE_LANES(lane) {
+				BATCH.PC[lane] = pc + 4;
+				if (BATCH.REGS[2][lane] == 0xA) {
+					BATCH.STATUS[lane] = LANE_EXITED;
+				}
+			}
+			return TRUE;
+		case INS_MFHI:
+			LANE_ALU(rd, VLOAD(&BATCH.HI[i]));
+			break;
+		case INS_MTHI:
+			FOR_ACTIVE_LANES(lane) {
+				BATCH.HI[lane] = BATCH.REGS[rs][lane];
 			}
-			if((MEM_rd != 0) && (MEM_rd == EX_rt))
-			{
-				//print_instruction(EX_ID.PC);
-				EX_ID.IR = 0;
-				EX_ID.PC = 0;
-				EX_ID.SYSCALL = 0;
+			break;
+		case INS_MFLO:
+			LANE_ALU(rd, VLOAD(&BATCH.LO[i]));
+			break;
+		case INS_MTLO:
+			FOR_ACTIVE_LANES(lane) {
+				BATCH.LO[lane] = BATCH.REGS[rs][lane];
 			}
-		}
-	}
-	else if((!ENABLE_FORWARDING) || (MEM_opcode == 0x20 || MEM_opcode == 0x21 || MEM_opcode == 0x23))
-	{
-		MEM_rd = (0x1F0000 & MEM_EX.IR) >> 16;
-		switch(MEM_opcode) {
-			case 0x8:		//ADDI
-			case 0x9:		//ADDIU
-			case 0xC:		//ANDI
-			case 0xE:		//XORI
-			case 0xD:		//ORI
-			case 0xA:		//SLTI
-			case 0x20:		//LB
-			case 0x21:		//LH
-			case 0xF:		//LUI
-			case 0x23:		//LW
-				if(!(MEM_opcode == 0x29 || MEM_opcode == 0x2B || MEM_opcode == 0x28))
-				{
-					if((MEM_rd != 0) && (MEM_rd == EX_rs))
-					{
-						//print_instruction(EX_ID.PC);
-						EX_ID.IR = 0;
-						EX_ID.PC = 0;
-						EX_ID.SYSCALL = 0;
-					}
+			break;
+		case INS_MULT:
+			FOR_ACTIVE_LANES(lane) {
+				product = (int64_t)(int32_t)BATCH.REGS[rs][lane] * (int64_t)(int32_t)BATCH.REGS[rt][lane];
+				BATCH.HI[lane] = product >> 32;
+				BATCH.LO[lane] = product & 0xFFFFFFFF;
+			}
+			break;
+		case INS_MULTU:
+			FOR_ACTIVE_LANES(lane) {
+				product = (uint64_t)BATCH.REGS[rs][lane] * (uint64_t)BATCH.REGS[rt][lane];
+				BATCH.HI[lane] = product >> 32;
+				BATCH.LO[lane] = product & 0xFFFFFFFF;
+			}
+			break;
+		case INS_DIV:
+			FOR_ACTIVE_LANES(lane) {
+				int32_t n = BATCH.REGS[rs][lane], d = BATCH.REGS[rt][lane];
+				if (d != 0 && !(n == INT32_MIN && d == -1)) {
+					BATCH.LO[lane] = n / d;
+					BATCH.HI[lane] = n % d;
 				}
-				break;
-			case 0x29:		//SH
-			case 0x28:		//SB
-			case 0x2B:		//SW
-				if((MEM_rd != 0) && (MEM_rd == EX_rs))
-				{
-					//print_instruction(EX_ID.PC);
-					EX_ID.IR = 0;
-					EX_ID.PC = 0;
-					EX_ID.SYSCALL = 0;
+			}
+			break;
+		case INS_DIVU:
+			FOR_ACTIVE_LANES(lane) {
+				if (BATCH.REGS[rt][lane] != 0) {
+					BATCH.LO[lane] = BATCH.REGS[rs][lane] / BATCH.REGS[rt][lane];
+					BATCH.HI[lane] = BATCH.REGS[rs][lane] % BATCH.REGS[rt][lane];
 				}
-				if((MEM_rd != 0) && (MEM_rd == EX_rt))
-				{
-					//print_instruction(EX_ID.PC);
-					EX_ID.IR = 0;
-					EX_ID.PC = 0;
-					EX_ID.SYSCALL = 0;
+			}
+			break;
+		case INS_ADD:
+		case INS_ADDU:
+			LANE_ALU(rd, VADD(a, b));
+			break;
+		case INS_SUB:
+		case INS_SUBU:
+			LANE_ALU(rd, VSUB(a, b));
+			break;
+		case INS_AND:
+			LANE_ALU(rd, VAND(a, b));
+			break;
+		case INS_OR:
+			LANE_ALU(rd, VOR(a, b));
+			break;
+		case INS_XOR:
+			LANE_ALU(rd, VXOR(a, b));
+			break;
+		case INS_NOR:
+			LANE_ALU(rd, VXOR(VOR(a, b), VSET(0xFFFFFFFF)));
+			break;
+		case INS_SLT:
+			LANE_ALU(rd, VAND(VGT(b, a), VSET(1)));
+			break;
+		case INS_ADDI:
+		case INS_ADDIU:
+			LANE_ALU(rt, VADD(a, VSET(simm)));
+			break;
+		case INS_SLTI:
+			LANE_ALU(rt, VAND(VGT(VSET(simm), a), VSET(1)));
+			break;
+		case INS_ANDI:
+			LANE_ALU(rt, VAND(a, VSET(imm)));
+			break;
+		case INS_ORI:
+			LANE_ALU(rt, VOR(a, VSET(imm)));
+			break;
+		case INS_XORI:
+			LANE_ALU(rt, VXOR(a, VSET(imm)));
+			break;
+		case INS_LUI:
+			LANE_ALU(rt, VSET(imm << 16));
+			break;
+		case INS_LB:
+		case INS_LH:
+		case INS_LW:
+		case INS_LBU:
+		case INS_LHU:
+			FOR_ACTIVE_LANES(lane) {
+				address = BATCH.REGS[rs][lane] + simm;
+				value = lane_read_32(lane, address) >> ((address & 3) * 8);
+				if (id == INS_LB) {
+					value = (uint32_t)(int32_t)(int8_t)value;
+				}else if (id == INS_LH) {
+					value = (uint32_t)(int32_t)(int16_t)value;
+				}else if (id == INS_LBU) {
+					value &= 0xFF;
+				}else if (id == INS_LHU) {
+					value &= 0xFFFF;
+				}
+				if (rt != 0) {
+					BATCH.REGS[rt][lane] = value;
 				}
-				break;
-		}
-	}
-
-	if(((!ENABLE_FORWARDING) || (WB_opcode == 0xF)) && WB_opcode == 0x00) 
-	{
-		if(!(WB_opcode == 0x29 || WB_opcode == 0x2B || WB_opcode == 0x28))
-		{
-			if((WB_rd != 0) && (WB_rd == EX_rs))                        //
-			{
-				EX_ID.IR = 0;
-				EX_ID.PC = 0;
-				EX_ID.SYSCALL = 0;
-				//print_instruction(EX_ID.PC);
 			}
-
-			if((WB_rd != 0) && (WB_rd == EX_rt))
-			{
-				EX_ID.IR = 0;
-				EX_ID.PC = 0;
-				EX_ID.SYSCALL = 0;
-				//print_instruction(EX_ID.PC);
+			break;
+		case INS_SB:
+		case INS_SH:
+		case INS_SW:
+			FOR_ACTIVE_LANES(lane) {
+				uint32_t shift, mask;
+				address = BATCH.REGS[rs][lane] + simm;
+				shift = (address & 3) * 8;
+				mask = id == INS_SB ? 0xFF : (id == INS_SH ? 0xFFFF : 0xFFFFFFFF);
+				value = lane_read_32(lane, address) & ~(mask << shift);
+				lane_write_32(lane, address, value | ((BATCH.REGS[rt][lane] & mask) << shift));
 			}
-		}
+			break;
+		case INS_BEQ:
+			LANE_BRANCH(VEQ(a, b));
+			return TRUE;
+		case INS_BNE:
+			LANE_BRANCH(VXOR(VEQ(a, b), VSET(0xFFFFFFFF)));
+			return TRUE;
+		case INS_BLEZ:
+			LANE_BRANCH(VXOR(VGT(a, VSET(0)), VSET(0xFFFFFFFF)));
+			return TRUE;
+		case INS_BGTZ:
+			LANE_BRANCH(VGT(a, VSET(0)));
+			return TRUE;
+		case INS_BLTZ:
+			LANE_BRANCH(VGT(VSET(0), a));
+			return TRUE;
+		case INS_BGEZ:
+			LANE_BRANCH(VXOR(VGT(VSET(0), a), VSET(0xFFFFFFFF)));
+			return TRUE;
+		case INS_J:
+		case INS_JAL:
+			LANE_ALU(id == INS_JAL ? 31 : 0, VSET(pc + 4));
+			target = (pc & 0xF0000000) | ((instruction & 0x3FFFFFF) << 2);
+			for (i = 0; i < BATCH.padded; i += LANE_WIDTH) {
+				lane_vec m = VLOAD(&BATCH.ACTIVE[i]);
+				VSTORE(&BATCH.PC[i], VBLEND(VLOAD(&BATCH.PC[i]), VSET(target), m));
+			}
+			return TRUE;
 	}
-	else if((!ENABLE_FORWARDING) || (WB_opcode == 0xF))
-	{
-		WB_rd = (0x1F0000 & WB_MEM.IR) >> 16;
-		switch(WB_opcode) {
-			case 0x8:		//ADDI
-			case 0x9:		//ADDIU
-			case 0xC:		//ANDI
-			case 0xE:		//XORI
-			case 0xD:		//ORI
-			case 0xA:		//SLTI
-			case 0x20:		//LB
-			case 0x21:		//LH
-			case 0xF:		//LUI
-			case 0x23:		//LW
-				if(!(WB_opcode == 0x29 || WB_opcode == 0x2B || WB_opcode == 0x28))
-				{
-					if((WB_rd != 0) && (WB_rd == EX_rs))
-					{
-						EX_ID.IR = 0;
-						EX_ID.PC = 0;
-						EX_ID.SYSCALL = 0;
-						//print_instruction(EX_ID.PC);
-					}
-				}
-				break;
-			case 0x29:		//SH
-			case 0x28:		//SB
-			case 0x2B:		//SW
-				if((WB_rd != 0) && (WB_rd == EX_rs))
-				{
-					EX_ID.IR = 0;
-					EX_ID.PC = 0;
-					EX_ID.SYSCALL = 0;
-					//print_instruction(EX_ID.PC);
-				}
 
-				if((WB_rd != 0) && (WB_rd == EX_rt))
-				{
-					EX_ID.IR = 0;
-					EX_ID.PC = 0;
-					EX_ID.SYSCALL = 0;
-					//print_instruction(EX_ID.PC);
-				}
-				break;
-		}
+	for (i = 0; i < BATCH.padded; i += LANE_WIDTH) {
+		lane_vec m = VLOAD(&BATCH.ACTIVE[i]);
+		VSTORE(&BATCH.PC[i], VBLEND(VLOAD(&BATCH.PC[i]), VSET(pc + 4), m));
 	}
+	return FALSE;
+}
 
-	if(!ENABLE_FORWARDING)
-	{
-		MEM_rd = (0x1F0000 & MEM_EX.IR) >> 16;
-		WB_rd = (0x1F0000 & WB_MEM.IR) >> 16;
-		switch (opcode)
-		{
-			case 0x29:		//SH
-			case 0x28:		//SB
-			case 0x2B:		//SW
-				if((MEM_rd != 0) && (MEM_rd == EX_rs))
-				{
-					EX_ID.IR = 0;
-					EX_ID.PC = 0;
-					EX_ID.SYSCALL = 0;
-					//print_instruction(EX_ID.PC);
-				}
-				if((MEM_rd != 0) && (MEM_rd == EX_rt))
-				{
-					EX_ID.IR = 0;
-					EX_ID.PC = 0;
-					EX_ID.SYSCALL = 0;
-					//print_instruction(EX_ID.PC);
-				}	
-
-				if((WB_rd != 0) && (WB_rd == EX_rs))
-				{
-					EX_ID.IR = 0;
-					EX_ID.PC = 0;
-					EX_ID.SYSCALL = 0;
-					//print_instruction(EX_ID.PC);
+/************************************************************/
+/* Run all lanes in lockstep until they exit (or <max_steps> steps)     */
+/************************************************************/
+void batch_run(uint32_t max_steps)
+{
+	uint32_t pc = 0, lane, steps = 0;
+	uint64_t retired = 0;
+	int jumped = TRUE, waiting = 0;
+	double start;
 
-				}
+	if (BATCH.lanes == 0) {
+		printf("No lanes loaded.\n");
+		return;
+	}
+	for (lane = 0; lane < BATCH.lanes; lane++) {
+		if (BATCH.STATUS[lane] == LANE_LIMIT) {
+			BATCH.STATUS[lane] = LANE_RUNNING;
+		}
+	}
 
-				if((WB_rd != 0) && (WB_rd == EX_rt))
-				{
-					EX_ID.IR = 0;
-					EX_ID.PC = 0;
-					EX_ID.SYSCALL = 0;
-					//print_instruction(EX_ID.PC);
-				}		
+	start = host_time();
+	while (max_steps == 0 || steps < max_steps) {
+		/* with every running lane active, straight-line code needs no rescheduling */
+		if (jumped || waiting) {
+			if ((waiting = batch_schedule(&pc)) < 0) {
 				break;
+			}
+		}else {
+			pc += 4;
 		}
+		jumped = batch_execute(pc);
+		steps++;
 	}
-
-    opcode = (EX_ID.IR & 0xFC000000) >> 26;
-	function = (EX_ID.IR & 0x3F);
-
-	if(opcode == 0x3 ||opcode == 0x2 ||opcode == 0x4 ||opcode == 0x5 ||opcode == 0x6 
-	||opcode == 0x7|| (opcode == 0 && function == 9) || (opcode == 0 && function == 8)||opcode == 0x1)
-	{
-			controlHazard = 1;
+	for (lane = 0; lane < BATCH.lanes; lane++) {
+		if (BATCH.STATUS[lane] == LANE_RUNNING) {
+			BATCH.STATUS[lane] = LANE_LIMIT;
+		}
+		retired += BATCH.COUNT[lane];
 	}
-
-	if (opcode == 0x00 && function == 0x0C)
-		EX_ID.SYSCALL = CURRENT_STATE.REGS[2];
+	STATS.HOST_SECONDS += host_time() - start;
+	printf("Batch finished: %u lanes, %u steps, %lu lane-instructions in %.6f s\n",
+		BATCH.lanes, steps, (unsigned long)retired, host_time() - start);
 }
 
 /************************************************************/
-/* instruction fetch (IF) pipeline stage:                                                              */ 
+/* Write one line per lane: status, instruction count, PC and registers */
 /************************************************************/
-void IF()
+void batch_dump(char *filename)
 {
-	if(CYCLE_COUNT < 1 || ID_IF.SYSCALL == 0xA || ((EX_ID.IR == 0 && EX_ID.PC == 0 && EX_ID.SYSCALL == 0) && CYCLE_COUNT > 2))
-	{
+	static const char *status[] = { "running", "exited", "limit" };
+	uint32_t lane;
+	int r;
+	FILE *fp = (filename == NULL || strcmp(filename, "-") == 0) ? stdout : fopen(filename, "w");
+
+	if (fp == NULL) {
+		printf("Error: Can't open %s\n", filename);
 		return;
 	}
-
-	ID_IF.IR = mem_read_32(CURRENT_STATE.PC);
-	ID_IF.PC = CURRENT_STATE.PC;
-	NEXT_STATE.PC = CURRENT_STATE.PC + 4;
-	
-	uint32_t opcode = (ID_IF.IR & 0xFC000000) >> 26;
-	uint32_t function = (ID_IF.IR & 0x3F);
-	
-	if (opcode == 0x00 && function == 0x0C)
-		ID_IF.SYSCALL = 0xA;
+	fprintf(fp, "lane,status,instructions,pc");
+	for (r = 0; r < MIPS_REGS; r++) {
+		fprintf(fp, ",r%d", r);
+	}
+	fprintf(fp, ",hi,lo\n");
+	for (lane = 0; lane < BATCH.lanes; lane++) {
+		fprintf(fp, "%u,%s,%u,0x%08x", lane, status[BATCH.STATUS[lane]], BATCH.COUNT[lane], BATCH.PC[lane]);
+		for (r = 0; r < MIPS_REGS; r++) {
+			fprintf(fp, ",0x%08x", BATCH.REGS[r][lane]);
+		}
+		fprintf(fp, ",0x%08x,0x%08x\n", BATCH.HI[lane], BATCH.LO[lane]);
+	}
+	if (fp != stdout) {
+		fclose(fp);
+	}
 }
 
+/***************************************************************/
+/* Apply a key=value configuration option (command line / sweeps)        */
+/***************************************************************/
+int set_option(char *key, char *value) {
+	int status = 0;		/* of the helper applying it, nonzero on failure */
 
-/************************************************************/
-/* Initialize Memory                                                                                                    */ 
-/************************************************************/
-void initialize() { 
-	init_memory();
-	CURRENT_STATE.PC = MEM_TEXT_BEGIN;
-	NEXT_STATE = CURRENT_STATE;
-	RUN_FLAG = TRUE;
-}
-
-/************************************************************/
-/* Print the program loaded into memory (in MIPS assembly format)    */ 
-/************************************************************/
-void print_program(){
-	/*IMPLEMENT THIS*/
-	int i;
-	uint32_t addr;
-	
-	for(i=0; i<PROGRAM_SIZE; i++){
-		addr = MEM_TEXT_BEGIN + (i*4);
-		printf("[0x%x]\t", addr);
-		print_instruction(addr);
+	if (strcmp(key, "forwarding") == 0) {
+		ENABLE_FORWARDING = strtol(value, NULL, 0) != 0;
+		pipeline_select();
+		checkpoint_restart();
+	}
+	else if (strcmp(key, "fast_forward") == 0) {
+		FAST_FORWARD = strtol(value, NULL, 0) != 0;
+	}
+	else if (strcmp(key, "max_cycles") == 0) {
+		MAX_CYCLES = strtoul(value, NULL, 0);
+	}
+	else if (strcmp(key, "trace_record") == 0) {
+		trace_record(value);
+	}
+	else if (strcmp(key, "trace_replay") == 0) {
+		trace_replay(value);
+	}
+	else if (strcmp(key, "lanes") == 0) {
+		status = batch_load(value);
+	}
+	else if (strcmp(key, "lanes_out") == 0) {
+		strncpy(LANES_FILE, value, sizeof(LANES_FILE) - 1);
+	}
+	else if (strcmp(key, "hotspot") == 0) {
+		hotspot_enable();
+		strncpy(HOTSPOT_FILE, value, sizeof(HOTSPOT_FILE) - 1);
+	}
+	else if (strcmp(key, "memtrace") == 0) {
+		access_start(value);
+	}
+	else if (strcmp(key, "memtrace_replay") == 0) {
+		strncpy(ACCESS_REPLAY_FILE, value, sizeof(ACCESS_REPLAY_FILE) - 1);
+	}
+	else if (strcmp(key, "cache") == 0) {
+		/* <size>:<ways>:<line> of each L1 */
+		char *end;
+		CACHE_SIZE = strtoul(value, &end, 0);
+		CACHE_WAYS = *end == ':' ? strtoul(end + 1, &end, 0) : CACHE_DEFAULT_WAYS;
+		CACHE_LINE = *end == ':' ? strtoul(end + 1, &end, 0) : CACHE_DEFAULT_LINE;
+		status = cache_init(&ICACHE, CACHE_SIZE, CACHE_WAYS, CACHE_LINE);
+	}
+	else if (strcmp(key, "intercept") == 0) {
+		/* <address>:<routine> */
+		char *routine = strchr(value, ':');
+		if (routine == NULL) {
+			printf("Error: %s takes <address>:<routine>\n", key);
+			return OPTION_INVALID;
+		}
+		*routine++ = '\0';
+		status = intercept_add(routine, strtoul(value, NULL, 0));
+	}
+	else if (strcmp(key, "intercept_cost") == 0) {
+		/* <cycles>:<bytes per extra cycle> */
+		char *end;
+		INTERCEPT_CYCLES = strtoul(value, &end, 0);
+		INTERCEPT_RATE = *end == ':' ? strtoul(end + 1, NULL, 0) : INTERCEPT_DEFAULT_RATE;
+		checkpoint_restart();
+	}
+	else if (strcmp(key, "mmu") == 0) {
+		status = mmu_enable(strtoul(value, NULL, 0));
+	}
+	else if (strcmp(key, "tlb") == 0) {
+		/* <entries>:<ways>, before mmu= */
+		char *end;
+		MMU.entries = strtoul(value, &end, 0);
+		MMU.ways = *end == ':' ? strtoul(end + 1, NULL, 0) : MMU.entries;
+	}
+	else if (strcmp(key, "tlb_walk") == 0) {
+		MMU.walk = strtoul(value, NULL, 0);
+		checkpoint_restart();
+	}
+	else if (strcmp(key, "interval_cycles") == 0) {
+		INTERVAL_CYCLES = strtoul(value, NULL, 0);
+		if (INTERVAL_CYCLES == 0) {
+			INTERVAL_CYCLES = INTERVAL_DEFAULT;
+		}
+		INTERVAL_LEFT = INTERVAL_CYCLES;
+	}
+	else if (strcmp(key, "interval") == 0) {
+		interval_start(value);
+	}
+	else if (strcmp(key, "live_cycles") == 0) {
+		LIVE_CYCLES = strtoul(value, NULL, 0);
+		LIVE_LEFT = LIVE_CYCLES;
+	}
+	else if (strcmp(key, "live") == 0) {
+		live_start(value);
+	}
+	else if (strcmp(key, "map") == 0 || strcmp(key, "map_cow") == 0) {
+		char *file = strchr(value, ':');
+		if (file == NULL) {
+			printf("Error: %s takes <address>:<file>\n", key);
+			return OPTION_INVALID;
+		}
+		*file++ = '\0';
+		status = mem_map_file(file, strtoul(value, NULL, 0), strcmp(key, "map") == 0 ? MAP_READONLY : MAP_COPY);
 	}
+	else if (strcmp(key, "import") == 0) {
+		status = mem_import(value);
+	}
+	else if (strcmp(key, "export") == 0) {
+		strncpy(EXPORT_FILE, value, sizeof(EXPORT_FILE) - 1);
+	}
+	else if (strcmp(key, "export_range") == 0) {
+		char *stop = strchr(value, ':');
+		if (stop == NULL) {
+			printf("Error: %s takes <start>:<stop>\n", key);
+			return OPTION_INVALID;
+		}
+		EXPORT_START = strtoul(value, NULL, 0);
+		EXPORT_STOP = strtoul(stop + 1, NULL, 0);
+	}
+	else if (strcmp(key, "diff") == 0) {
+		strncpy(DIFF_FILE, value, sizeof(DIFF_FILE) - 1);
+	}
+	else if (strcmp(key, "mode") == 0) {
+		if (strcmp(value, "pipeline") == 0) {
+			SIM_MODE = MODE_PIPELINE;
+		}else if (strcmp(value, "functional") == 0) {
+			SIM_MODE = MODE_FUNCTIONAL;
+		}else {
+			printf("Error: mode is pipeline or functional\n");
+			return OPTION_INVALID;
+		}
+		checkpoint_restart();
+	}
+	else if (strcmp(key, "checkpoint") == 0) {
+		if (strtoul(value, NULL, 0) == 0) {
+			checkpoint_stop();
+		}else {
+			checkpoint_start(strtoul(value, NULL, 0));
+		}
+	}
+	else if (strcmp(key, "device") == 0) {
+		/* <address>:<name> */
+		char *name = strchr(value, ':');
+		if (name == NULL) {
+			printf("Error: %s takes <address>:<device>\n", key);
+			return OPTION_INVALID;
+		}
+		*name++ = '\0';
+		status = device_add(name, strtoul(value, NULL, 0));
+	}
+	else if (strcmp(key, "gdb") == 0) {
+		GDB_PORT = strtol(value, NULL, 0);
+	}
+	else if (strcmp(key, "checkpoint_budget") == 0) {
+		/* megabytes of history kept */
+		CHECKPOINT_BUDGET = (uint64_t)strtoul(value, NULL, 0) << 20;
+	}
+	else {
+		return OPTION_UNKNOWN;
+	}
+	return status ? OPTION_INVALID : OPTION_OK;
 }
 
-void print_instruction(uint32_t addr){
-	/*IMPLEMENT THIS*/
-	uint32_t current_instruction = mem_read_32(addr);
-	uint32_t opcode = (current_instruction & 0xFC000000) >> 26;
-
-	// Other masks
-	uint32_t rs_mask = 0x3E00000, rt_mask = 0x1F0000, immediate_mask = 0xFFFF, rd_mask = 0xF800, shamt_mask = 0x7C0, funct_mask = 0x3F, offset_mask = 0x3FFFFFF;
-	uint32_t rs = (rs_mask & current_instruction) >> 21;
-	uint32_t rt = (rt_mask & current_instruction) >> 16;
-	uint32_t immediate = (immediate_mask & current_instruction);
-	uint32_t rd = (rd_mask & current_instruction) >> 11;
-	uint32_t shamt = (shamt_mask & current_instruction) >> 6;
-	uint32_t function = (funct_mask & current_instruction);
-	uint32_t offset = (offset_mask & current_instruction);
+/***************************************************************/
+/* main                                                                                                                                   */
+/***************************************************************/
+int main(int argc, char *argv[]) {                              
+	char *options[64];
+	char *json_file = NULL;
+	int num_options = 0;
+	int batch = FALSE;
+	int status = 0;
+	int opt, i;
 
-	
-	// Function opcode (R-Type)
-	if (opcode == 0x00) {
-		switch(function) {
-			case 0x00:		//SLL
-				printf("SLL $%d, $%d, 0x%x\n", rd, rt, shamt);
-				break;
-			case 0x02:		//SRL
-				printf("SRL $%d, $%d, 0x%x\n", rd, rt, shamt);
+	while ((opt = getopt(argc, argv, "bqj:o:")) != -1) {
+		switch (opt) {
+			case 'b':
+				batch = TRUE;
 				break;
-			case 0x03:		//SRA
-				printf("SRA $%d, $%d, 0x%x\n", rd, rt, shamt);
+			case 'q':
+				TRACE_LEVEL = 0;
 				break;
-			case 0x08:		//JR
-				printf("JR $%d\n", rs);
+			case 'j':
+				json_file = optarg;
 				break;
-			case 0x09:		//JALR
-				printf("JALR $%d, $%d\n", rs, rd);
-				break;
-			case 0x0C:		//SYSCALL
-				printf("SYSCALL\n");
-				break;
-			case 0x10:		//MFHI
-				printf("MFHI $%d\n", rd);
-				break;
-			case 0x11:		//MTHI
-				printf("MTHI $%d\n", rs);
-				break;
-			case 0x12:		//MFLO
-				printf("MFLO $%d\n", rd);
-				break;
-			case 0x13:		//MTLO
-				printf("MTLO $%d\n", rs);
-				break;
-			case 0x18:		//MULT
-				printf("MULT $%d, $%d\n", rs, rt);
-				break;
-			case 0x19:		//MULT Unsigned
-				printf("MULTU $%d, $%d\n", rs, rt);
-				break;
-			case 0x1A:		//DIV
-				printf("DIV $%d, $%d\n", rs, rt);
-				break;
-			case 0x1B:		//DIVU
-				printf("DIVU $%d, $%d\n", rs, rt);
-				break;
-			case 0x20:		//ADD
-				printf("ADD $%d, $%d, $%d\n", rd, rs, rt);
-				break;
-			case 0x21:		//ADD Unsigned
-				printf("ADDU $%d, $%d, $%d\n", rd, rs, rt);
-				break;
-			case 0x22:		//SUB
-				printf("SUB $%d, $%d, $%d\n", rd, rs, rt);
-				break;
-			case 0x23:		//SUB Unsigned
-				printf("SUBU $%d, $%d, $%d\n", rd, rs, rt);
-				break;
-			case 0x24:		//AND
-				printf("AND $%d, $%d, $%d\n", rd, rs, rt);
-				break;
-			case 0x25:		//OR
-				printf("OR $%d, $%d, $%d\n", rd, rs, rt);
-				break;
-			case 0x26:		//XOR
-				printf("XOR $%d, $%d, $%d\n", rd, rs, rt);
-				break;
-			case 0x27:		//NOR
-				printf("NOR $%d, $%d, $%d\n", rd, rs, rt);
-				break;
-			case 0x2A:		//SLT
-				printf("SLT $%d, $%d, $%d\n", rd, rs, rt);
-				break;
-		}
-	} 
-	// Regular opcode (I-Type)
-	else {
-		switch(opcode) {
-			case 0x8:		//ADDI
-				// make immediate sign extended
-				printf("ADDI $%d, $%d, 0x%x\n", rt, rs, immediate);
-				break;
-			case 0x9:		//ADDIU
-				// should be unsigned?
-				printf("ADDIU $%d, $%d, 0x%x\n", rt, rs, immediate);
-				break;
-			case 0xC:		//ANDI
-				//NEXT_STATE.REGS[rt] = (0000000000000000 | (immediate & (CURRENT_STATE.REGS[rs] & sixteen_bit_mask)));
-				printf("ANDI $%d, $%d, 0x%x\n", rt, rs, immediate);
-				break;
-			case 0xE:		//XORI
-				printf("XORI $%d, $%d, 0x%x\n", rt, rs, immediate);	
-				break;
-			case 0xD:		//ORI
-				printf("ORI $%d, $%d, 0x%x\n", rt, rs, immediate);	
-				break;
-			case 0xA:		//SLTI
-				printf("SLTI $%d, $%d, 0x%x\n", rt, rs, immediate);
-				break;
-			case 0x4:		//BEQ
-				// Immediate is used in the branch instructions since its a 16 bit masked value
-				printf("BEQ $%d, $%d, 0x%x\n", rs, rt, (uint32_t)((int16_t)(immediate * 4)));
-				break;
-			case 0x1:		//BGEZ, BLTZ
-				if (rt == 1) {
-					// BGEZ
-					printf("BGEZ $%d, 0x%x\n", rs, (uint32_t)((int16_t)(immediate * 4)));
-				} else if (rt == 0) {
-					// BLTZ
-					printf("BLTZ $%d, 0x%x\n", rs, (uint32_t)((int16_t)(immediate * 4)));
+			case 'o':
+				if (num_options < 64) {
+					options[num_options++] = optarg;
 				}
 				break;
-			case 0x7:		//BGTZ
-				printf("BGTZ $%d, 0x%x\n", rs, (uint32_t)((int16_t)(immediate * 4)));
-				break;
-			case 0x6:		//BLEZ
-				printf("BLEZ $%d, 0x%x\n", rs, (uint32_t)((int16_t)(immediate * 4)));
-				break;
-			case 0x5:		//BNE
-				printf("BNE $%d, $%d, %d\n", rs, rt, (uint32_t)((int16_t)(immediate * 4)));
-				break;
-			case 0x2:		//J
-				printf("J 0x%x\n", offset);
-				break;
-			case 0x3:		//JAL
-				printf("JAL 0x%x\n", offset);
-				break;
-			case 0x20:		//LB
-				printf("LB $%d, 0x%x($%d)\n", rt, immediate, rs);
-				break;
-			case 0x21:		//LH
-				printf("LH $%d, 0x%x($%d)\n", rt, immediate, rs);
-				break;
-			case 0xF:		//LUI
-				printf("LUI $%d, 0x%x\n", rt, immediate);
-				break;
-			case 0x23:		//LW
-				printf("LW $%d, 0x%x($%d)\n", rt, immediate, rs);
-				break;
-			case 0x29:		//SH
-				printf("SH $%d, 0x%x($%d)\n", rt, immediate, rs);
-				break;
-			case 0x28:		//SB
-				printf("SB $%d, 0x%x($%d)\n", rt, immediate, rs);
-				break;
-			case 0x2B:		//SW
-				printf("SW $%d, 0x%x($%d)\n", rt, immediate, rs);
+			default:
+				argc = 0;
 				break;
 		}
 	}
-}
-
-/************************************************************/
-/* Print the current pipeline                                                                                    */ 
-/************************************************************/
-void show_pipeline(){
-	printf("Current PC: 		%X\n", CURRENT_STATE.PC);
-	printf("IF/ID.IR			%X  ", ID_IF.IR);
-	print_instruction(ID_IF.PC);
-	printf("IF/ID.PC			%X\n", ID_IF.PC);
-	printf("\n");
-
-	printf("ID/EX.IR			%X  ", EX_ID.IR);
-	print_instruction(EX_ID.PC);
-	printf("ID/EX.A				%X\n", EX_ID.A);
-	printf("ID/EX.B				%X\n", EX_ID.B);
-	printf("ID/EX.imm			%X\n", EX_ID.imm);
-	printf("\n");
-
-	printf("EX/MEM.IR			%X  ", MEM_EX.IR);
-	print_instruction(MEM_EX.PC);
-	printf("EX/MEM.A			%X\n", MEM_EX.A);
-	printf("EX/MEM.B			%X\n", MEM_EX.B);
-	printf("EX/MEM.ALUOutput	%X\n", MEM_EX.ALUOutput);
-	printf("EX/MEM.ALUOutput2	%X\n", MEM_EX.ALUOutput2);
-	printf("\n");
-
-	printf("MEM/WEB.IR			%X  ", WB_MEM.IR);
-	print_instruction(WB_MEM.PC);
-	printf("MEM/WEB.A			%X\n", WB_MEM.IR);
-	printf("MEM/WEB.LMD			%X\n", WB_MEM.IR);
-}
 
-/***************************************************************/
-/* main                                                                                                                                   */
-/***************************************************************/
-int main(int argc, char *argv[]) {                              
-	printf("\n**************************\n");
-	printf("Welcome to MU-MIPS SIM...\n");
-	printf("**************************\n\n");
+	if (!batch) {
+		printf("\n**************************\n");
+		printf("Welcome to MU-MIPS SIM...\n");
+		printf("**************************\n\n");
+	}
 	
-	if (argc < 2) {
-		printf("Error: You should provide input file.\nUsage: %s <input program> \n\n",  argv[0]);
+	if (optind >= argc || strlen(argv[optind]) >= sizeof(prog_file)) {
+		printf("Error: You should provide input file.\nUsage: %s [-b] [-q] [-j <stats.json>] [-o key=value]... <input program> \n\n",  argv[0]);
+		printf("\t-b\tbatch mode: run to completion and exit\n");
+		printf("\t-q\tdo not print retired instructions\n");
+		printf("\t-j\twrite statistics as JSON (batch mode)\n");
+		printf("\t-o\tset an option: forwarding, fast_forward, max_cycles, mode, trace_record, trace_replay, lanes,\n\t\tlanes_out=<per-lane CSV, default stdout>, hotspot,\n\t\tinterval, interval_cycles,\n\t\tlive, live_cycles,\n\t\tmap=<address>:<file>, map_cow=<address>:<file>,\n\t\timport=<image>, export=<image>, export_range=<start>:<stop>, diff=<image>,\n\t\tmemtrace, memtrace_replay, cache=<size>:<ways>:<line>,\n\t\ttlb=<entries>:<ways>, tlb_walk=<cycles>, mmu=<page table address>,\n\t\tintercept=<address>:memcpy|memset|strlen, intercept_cost=<cycles>:<bytes per cycle>,\n\t\tcheckpoint=<cycles>, checkpoint_budget=<MB>, gdb=<port>,\n\t\tdevice=<address>:uart|timer|counter\n\n");
 		exit(1);
 	}
 
-	strcpy(prog_file, argv[1]);
+	strcpy(prog_file, argv[optind]);
 	initialize();
 	load_program();
+
+	for (i = 0; i < num_options; i++) {
+		char *value = strchr(options[i], '=');
+		if (value == NULL) {
+			printf("Error: option %s is not of the form key=value\n", options[i]);
+			exit(1);
+		}
+		*value++ = '\0';
+		switch (set_option(options[i], value)) {
+			case OPTION_UNKNOWN:
+				printf("Error: unknown option %s\n", options[i]);
+				exit(1);
+			case OPTION_INVALID:
+				exit(1);
+		}
+	}
+
+	if (GDB_PORT && gdb_serve(GDB_PORT) != 0) {
+		exit(1);
+	}
+
+	if (batch && ACCESS_REPLAY_FILE[0]) {
+		access_replay(ACCESS_REPLAY_FILE);
+		return 0;
+	}
+	if (batch && BATCH.lanes) {
+		batch_run(MAX_CYCLES);
+		batch_dump(LANES_FILE[0] ? LANES_FILE : NULL);
+	}
+	else if (batch) {
+		if (MAX_CYCLES) {
+			run(MAX_CYCLES);
+		}else {
+			runAll();
+		}
+		trace_stop();
+		access_stop();
+		interval_stop();
+		live_stop();
+		if (HOTSPOT_FILE[0]) {
+			hotspot_dump(HOTSPOT_FILE);
+		}
+		if (EXPORT_FILE[0]) {
+			mem_export(EXPORT_FILE, EXPORT_START, EXPORT_STOP);
+		}
+		if (DIFF_FILE[0] && mem_diff(DIFF_FILE, NULL) != 0) {
+			status = 1;
+		}
+	}
+	if (batch) {
+		if (json_file) {
+			FILE *fp = strcmp(json_file, "-") ? fopen(json_file, "w") : stdout;
+			if (fp == NULL) {
+				printf("Error: Can't open %s\n", json_file);
+				exit(1);
+			}
+			print_stats_json(fp);
+			if (fp != stdout) {
+				fclose(fp);
+			}
+		}
+		return status;
+	}
+
 	help();
 	while (1){
 		handle_command();
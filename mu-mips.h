@@ -1,4 +1,7 @@
 #include <stdint.h>
+#include <stdio.h>
+
+#include "mu-mips-stats.h"
 
 #define FALSE 0
 #define TRUE  1
@@ -36,6 +39,38 @@ mem_region_t MEM_REGIONS[] = {
 };
 
 #define NUM_MEM_REGION 4
+
+/***************************************************************/
+/* Host files mapped into the guest data segment                                    */
+/***************************************************************/
+#define MAP_READONLY	0	/* guest stores to the range are dropped */
+#define MAP_COPY		1	/* private copy-on-write, the file is never modified */
+#define MAX_MAPPINGS	8
+#define MAP_PAGE		4096
+
+/***************************************************************/
+/* Memory images: a header, then chunks of guest bytes in address order */
+/***************************************************************/
+#define IMAGE_MAGIC		0x494D554D	/* "MUMI" */
+#define IMAGE_VERSION	1
+
+typedef struct Image_Chunk_Struct {
+	uint32_t address;
+	uint32_t length;		/* bytes that follow this header */
+} Image_Chunk;
+
+typedef struct Image_Page_Struct {
+	uint32_t address;		/* page aligned */
+	uint32_t begin, end;	/* byte offsets of the page an image covers, end exclusive */
+	uint8_t *data;			/* MAP_PAGE bytes */
+} Image_Page;
+
+typedef struct Guest_Mapping_Struct {
+	uint32_t begin, end;	/* guest range, end inclusive */
+	int mode;				/* MAP_READONLY or MAP_COPY */
+	int warned;				/* a dropped store has been reported */
+	char file[256];
+} Guest_Mapping;
 #define MIPS_REGS 32
 
 typedef struct CPU_State_Struct {
@@ -57,34 +92,697 @@ typedef struct CPU_Pipeline_Reg_Struct{
 	uint32_t ALUOutput;
 	uint32_t ALUOutput2;
 	uint32_t LMD;
+	uint32_t EA;		/* effective address (or $v0 for SYSCALL), carried for the trace */
+	uint32_t TARGET;	/* taken branch/jump target, 0 if not taken */
+	uint32_t STALL;		/* for a bubble: the STALL_* cause that inserted it */
+	uint32_t STALL_PC;	/* and the instruction its cycle is charged to */
 	
 } CPU_Pipeline_Reg;
 
+#define HILO_HI	1
+#define HILO_LO	2
+
+/***************************************************************/
+/* Instruction set: one line per instruction, expanded into the decode  */
+/* tables, the disassembler, the hazard unit and every engine that        */
+/* executes instructions (functional_step, EX, MEM, WB).                           */
+/*                                                                                                                                   */
+/*   name      mnemonic, INS_<name> is its decoded id                                */
+/*   op, fn    opcode and function (rt for REGIMM, -1 if unused)                */
+/*   format    FMT_* operand layout for disassembly                                      */
+/*   dest      DEST_* register written                                                          */
+/*   reads     READ_* registers read in ID                                                 */
+/*   mix       MIX_* class                                                                                */
+/*   kind      KIND_* how an engine treats value:                                          */
+/*               ALU     result written to dest                                                 */
+/*               LOAD    value loaded from address                                           */
+/*               STORE   statement storing b at address                                   */
+/*               BRANCH  taken condition, target pc + (simm << 2)                  */
+/*               JUMP    target; dest, if any, gets pc + 4                              */
+/*               SYSCALL service $v0                                                                  */
+/*   value     C expression over a (rs), b (rt), simm, imm (zero extended),  */
+/*             shamt, hi, lo, pc, address (a + simm) and instruction          */
+/***************************************************************/
+#define MIPS_INSTRUCTIONS(X) \
+	X(SLL,     0x00, 0x00, SHIFT,   RD,   READ_RT,           MIX_ALU,     ALU,     b << shamt) \
+	X(SRL,     0x00, 0x02, SHIFT,   RD,   READ_RT,           MIX_ALU,     ALU,     b >> shamt) \
+	X(SRA,     0x00, 0x03, SHIFT,   RD,   READ_RT,           MIX_ALU,     ALU,     (uint32_t)((int32_t)b >> shamt)) \
+	X(JR,      0x00, 0x08, RS,      NONE, READ_RS,           MIX_JUMP,    JUMP,    a) \
+	X(JALR,    0x00, 0x09, JALR,    RD,   READ_RS,           MIX_JUMP,    JUMP,    a) \
+	X(SYSCALL, 0x00, 0x0C, NONE,    NONE, READ_RS,           MIX_SYSCALL, SYSCALL, 0) \
+	X(MFHI,    0x00, 0x10, RD,      RD,   READ_HI,           MIX_MULDIV,  ALU,     hi) \
+	X(MTHI,    0x00, 0x11, RS,      HI,   READ_RS,           MIX_MULDIV,  ALU,     a) \
+	X(MFLO,    0x00, 0x12, RD,      RD,   READ_LO,           MIX_MULDIV,  ALU,     lo) \
+	X(MTLO,    0x00, 0x13, RS,      LO,   READ_RS,           MIX_MULDIV,  ALU,     a) \
+	X(MULT,    0x00, 0x18, RSRT,    HILO, READ_RS | READ_RT, MIX_MULDIV,  ALU,     (uint64_t)((int64_t)(int32_t)a * (int32_t)b)) \
+	X(MULTU,   0x00, 0x19, RSRT,    HILO, READ_RS | READ_RT, MIX_MULDIV,  ALU,     (uint64_t)a * b) \
+	X(DIV,     0x00, 0x1A, RSRT,    HILO, READ_RS | READ_RT, MIX_MULDIV,  ALU,     mips_div(a, b, hi, lo)) \
+	X(DIVU,    0x00, 0x1B, RSRT,    HILO, READ_RS | READ_RT, MIX_MULDIV,  ALU,     mips_divu(a, b, hi, lo)) \
+	X(ADD,     0x00, 0x20, R3,      RD,   READ_RS | READ_RT, MIX_ALU,     ALU,     a + b) \
+	X(ADDU,    0x00, 0x21, R3,      RD,   READ_RS | READ_RT, MIX_ALU,     ALU,     a + b) \
+	X(SUB,     0x00, 0x22, R3,      RD,   READ_RS | READ_RT, MIX_ALU,     ALU,     a - b) \
+	X(SUBU,    0x00, 0x23, R3,      RD,   READ_RS | READ_RT, MIX_ALU,     ALU,     a - b) \
+	X(AND,     0x00, 0x24, R3,      RD,   READ_RS | READ_RT, MIX_ALU,     ALU,     a & b) \
+	X(OR,      0x00, 0x25, R3,      RD,   READ_RS | READ_RT, MIX_ALU,     ALU,     a | b) \
+	X(XOR,     0x00, 0x26, R3,      RD,   READ_RS | READ_RT, MIX_ALU,     ALU,     a ^ b) \
+	X(NOR,     0x00, 0x27, R3,      RD,   READ_RS | READ_RT, MIX_ALU,     ALU,     ~(a | b)) \
+	X(SLT,     0x00, 0x2A, R3,      RD,   READ_RS | READ_RT, MIX_ALU,     ALU,     (int32_t)a < (int32_t)b) \
+	X(BLTZ,    0x01, 0x00, BRANCH1, NONE, READ_RS,           MIX_BRANCH,  BRANCH,  (int32_t)a < 0) \
+	X(BGEZ,    0x01, 0x01, BRANCH1, NONE, READ_RS,           MIX_BRANCH,  BRANCH,  (int32_t)a >= 0) \
+	X(J,       0x02,   -1, JUMP,    NONE, 0,                 MIX_JUMP,    JUMP,    (pc & 0xF0000000) | ((instruction & 0x3FFFFFF) << 2)) \
+	X(JAL,     0x03,   -1, JUMP,    RA,   0,                 MIX_JUMP,    JUMP,    (pc & 0xF0000000) | ((instruction & 0x3FFFFFF) << 2)) \
+	X(BEQ,     0x04,   -1, BRANCH2, NONE, READ_RS | READ_RT, MIX_BRANCH,  BRANCH,  a == b) \
+	X(BNE,     0x05,   -1, BRANCH2, NONE, READ_RS | READ_RT, MIX_BRANCH,  BRANCH,  a != b) \
+	X(BLEZ,    0x06,   -1, BRANCH1, NONE, READ_RS,           MIX_BRANCH,  BRANCH,  (int32_t)a <= 0) \
+	X(BGTZ,    0x07,   -1, BRANCH1, NONE, READ_RS,           MIX_BRANCH,  BRANCH,  (int32_t)a > 0) \
+	X(ADDI,    0x08,   -1, IMM,     RT,   READ_RS,           MIX_ALU,     ALU,     a + simm) \
+	X(ADDIU,   0x09,   -1, IMM,     RT,   READ_RS,           MIX_ALU,     ALU,     a + simm) \
+	X(SLTI,    0x0A,   -1, IMM,     RT,   READ_RS,           MIX_ALU,     ALU,     (int32_t)a < (int32_t)simm) \
+	X(ANDI,    0x0C,   -1, IMM,     RT,   READ_RS,           MIX_ALU,     ALU,     a & imm) \
+	X(ORI,     0x0D,   -1, IMM,     RT,   READ_RS,           MIX_ALU,     ALU,     a | imm) \
+	X(XORI,    0x0E,   -1, IMM,     RT,   READ_RS,           MIX_ALU,     ALU,     a ^ imm) \
+	X(LUI,     0x0F,   -1, LUI,     RT,   0,                 MIX_ALU,     ALU,     imm << 16) \
+	X(LB,      0x20,   -1, MEM,     RT,   READ_RS,           MIX_LOAD,    LOAD,    (uint32_t)(int32_t)(int8_t)mem_read_8(address)) \
+	X(LH,      0x21,   -1, MEM,     RT,   READ_RS,           MIX_LOAD,    LOAD,    (uint32_t)(int32_t)(int16_t)mem_read_16(address)) \
+	X(LW,      0x23,   -1, MEM,     RT,   READ_RS,           MIX_LOAD,    LOAD,    mem_read_32(address)) \
+	X(LBU,     0x24,   -1, MEM,     RT,   READ_RS,           MIX_LOAD,    LOAD,    mem_read_8(address)) \
+	X(LHU,     0x25,   -1, MEM,     RT,   READ_RS,           MIX_LOAD,    LOAD,    mem_read_16(address)) \
+	X(SB,      0x28,   -1, MEM,     NONE, READ_RS | READ_RT, MIX_STORE,   STORE,   mem_write_8(address, b & 0xFF)) \
+	X(SH,      0x29,   -1, MEM,     NONE, READ_RS | READ_RT, MIX_STORE,   STORE,   mem_write_16(address, b & 0xFFFF)) \
+	X(SW,      0x2B,   -1, MEM,     NONE, READ_RS | READ_RT, MIX_STORE,   STORE,   mem_write_32(address, b))
+
+/* decoded ids: INS_INVALID for words the table does not list */
+#define INSTRUCTION_ID(name, op, fn, format, dest, reads, mix, kind, value)	INS_##name,
+enum { INS_INVALID, MIPS_INSTRUCTIONS(INSTRUCTION_ID) NUM_INSTRUCTIONS };
+#undef INSTRUCTION_ID
+
+enum { FMT_INVALID, FMT_SHIFT, FMT_RS, FMT_RD, FMT_RSRT, FMT_R3, FMT_JALR, FMT_NONE, FMT_IMM, FMT_LUI, FMT_MEM,
+	FMT_BRANCH1, FMT_BRANCH2, FMT_JUMP };
+enum { DEST_NONE, DEST_RD, DEST_RT, DEST_RA, DEST_HI, DEST_LO, DEST_HILO };
+enum { KIND_INVALID, KIND_ALU, KIND_LOAD, KIND_STORE, KIND_BRANCH, KIND_JUMP, KIND_SYSCALL };
+
+#define READ_RS		0x1
+#define READ_RT		0x2
+#define READ_HI		0x4
+#define READ_LO		0x8
+
+typedef struct Instruction_Info_Struct {
+	const char *name;
+	uint8_t format;		/* FMT_* */
+	uint8_t dest;		/* DEST_* */
+	uint8_t reads;		/* READ_* */
+	uint8_t mix;		/* MIX_* */
+	uint8_t kind;		/* KIND_* */
+} Instruction_Info;
+
+/***************************************************************/
+/* System calls, SPIM/MARS numbering in $v0                                           */
+/***************************************************************/
+#define SYS_PRINT_INT		1	/* $a0 */
+#define SYS_PRINT_STRING	4	/* $a0 = address of a NUL-terminated string */
+#define SYS_READ_INT		5	/* $v0 = integer read from stdin */
+#define SYS_SBRK			9	/* $a0 = bytes, $v0 = old break or -1 */
+#define SYS_EXIT			10
+#define SYS_PRINT_CHAR		11	/* $a0 */
+#define SYS_OPEN			13	/* $a0 = path, $a1 = 0 read, 1 write, 9 append; $v0 = fd or -1 */
+#define SYS_READ			14	/* $a0 = fd, $a1 = buffer, $a2 = length; $v0 = bytes or -1 */
+#define SYS_WRITE			15	/* $a0 = fd, $a1 = buffer, $a2 = length; $v0 = bytes or -1 */
+#define SYS_CLOSE			16	/* $a0 = fd */
+#define NUM_SYSCALLS		17
+
+#define MAX_GUEST_FILES		16		/* guest fds 0-2 are the console */
+#define CONSOLE_BUFFER		4096	/* guest stdout bytes held before a write */
+
+/***************************************************************/
+/* Simulation modes                                                                                                */
+/***************************************************************/
+#define MODE_PIPELINE	0	/* cycle-accurate five stage pipeline */
+#define MODE_FUNCTIONAL	1	/* one instruction per cycle, no timing */
+
+/***************************************************************/
+/* set_option() results                                                                                            */
+/***************************************************************/
+#define OPTION_OK		0
+#define OPTION_UNKNOWN	-1	/* no such key */
+#define OPTION_INVALID	-2	/* known key, bad value; the error is printed already */
+
+/***************************************************************/
+/* Simulation statistics                                                                                          */
+/***************************************************************/
+#define STALL_NONE		0
+#define STALL_DATA		1	/* RAW dependence on an ALU result */
+#define STALL_LOAD_USE	2	/* RAW dependence on a load result */
+#define STALL_CONTROL	3	/* waiting for a branch/jump to resolve */
+#define STALL_STRUCTURAL	4	/* a shared unit is busy */
+#define STALL_MEMORY	5	/* waiting on a memory access that missed */
+#define STALL_FILL		6	/* pipeline fill/drain, nothing fetched */
+#define NUM_STALL		7	/* CPI stack buckets, STALL_NONE counts retiring cycles */
+
+#define MIX_ALU			0
+#define MIX_MULDIV		1
+#define MIX_LOAD		2
+#define MIX_STORE		3
+#define MIX_BRANCH		4
+#define MIX_JUMP		5
+#define MIX_SYSCALL		6
+#define NUM_MIX			7
+
+typedef struct CPU_Stats_Struct {
+	uint64_t DATA_STALLS;
+	uint64_t LOAD_USE_STALLS;
+	uint64_t CONTROL_STALLS;
+	uint64_t FORWARDS;			/* operands forwarded into EX */
+	uint64_t FLUSHES;			/* taken branch/jump redirects */
+	uint64_t MIX[NUM_MIX];		/* retired instructions by MIX_* class */
+	uint64_t CPI_STACK[NUM_STALL];	/* every cycle, by what reached WB: an instruction or a bubble's cause */
+	uint64_t TLB_LOOKUPS;		/* translated (kseg2) accesses */
+	uint64_t TLB_MISSES;
+	uint64_t TLB_FAULTS;		/* walks that found no valid entry; the access went untranslated */
+	uint64_t SKIPPED_CYCLES;	/* idle cycles accounted in bulk by cycle_skip */
+	uint64_t SPIN_ITERATIONS;	/* spin-loop iterations accounted in bulk by spin_skip */
+	uint64_t INTERCEPTED_CALLS;	/* library calls run on the host by intercept_call */
+	uint64_t INTERCEPTED_BYTES;	/* bytes they copied, set or scanned */
+	double HOST_SECONDS;		/* host time spent in run/runAll */
+} CPU_Stats;
+
+/***************************************************************/
+/* Lockstep batch engine: N program instances, one register file per  */
+/* lane, stored structure-of-arrays so one instruction runs across all   */
+/* lanes with SIMD.                                                                                                          */
+/***************************************************************/
+#if defined(__AVX2__)
+#define LANE_WIDTH	8
+#elif defined(__SSE2__)
+#define LANE_WIDTH	4
+#else
+#define LANE_WIDTH	1
+#endif
+
+#define LANE_RUNNING	0
+#define LANE_EXITED		1
+#define LANE_LIMIT		2
+
+typedef struct Lane_Memory_Struct {
+	uint32_t *addr;		/* word addresses written by this lane, 0 = empty slot */
+	uint32_t *data;
+	uint32_t capacity, count;
+} Lane_Memory;
+
+typedef struct Batch_State_Struct {
+	uint32_t lanes;				/* program instances */
+	uint32_t padded;			/* lanes rounded up to LANE_WIDTH */
+	uint32_t *REGS[MIPS_REGS];	/* REGS[r][lane] */
+	uint32_t *HI, *LO, *PC;
+	uint32_t *ACTIVE;			/* 0xFFFFFFFF if the lane executes the current instruction */
+	uint32_t *STATUS;			/* LANE_RUNNING, LANE_EXITED or LANE_LIMIT */
+	uint32_t *COUNT;			/* instructions retired per lane */
+	Lane_Memory *MEM;			/* private stores of each lane */
+} Batch_State;
+
+/***************************************************************/
+/* Instruction trace (one record per retired instruction). Records are  */
+/* delta encoded and packed into blocks that decode independently, the  */
+/* same framing as memory access traces (Access_Block headers):             */
+/*   tag byte: PC + 4 (bit 0), IR as last seen in its PC slot (1),            */
+/*             address present (2), target present (3)                                   */
+/* followed by the fields the flags do not cover: zigzag PC delta, raw IR */
+/* (4 bytes), zigzag address delta and zigzag target minus PC. The deltas */
+/* are varints; a zero address or target is not stored.                              */
+/***************************************************************/
+#define TRACE_OFF		0
+#define TRACE_RECORD	1
+#define TRACE_REPLAY	2
+
+#define TRACE_NEXT_PC	0x01
+#define TRACE_SAME_IR	0x02
+#define TRACE_ADDR		0x04
+#define TRACE_TARGET	0x08
+
+#define TRACE_MAGIC		0x5254554D	/* "MUTR" */
+#define TRACE_VERSION	2
+#define TRACE_BLOCK		65536		/* encoded bytes per block, at most */
+#define TRACE_BLOCK_RECORDS	16384	/* records per block, at most */
+#define TRACE_MAX_RECORD	20		/* tag + 4-byte IR + three 5-byte deltas */
+#define TRACE_IR_SLOTS	256			/* last IR per (PC >> 2) % TRACE_IR_SLOTS */
+
+typedef struct Trace_Record_Struct {
+	uint32_t PC;
+	uint32_t IR;
+	uint32_t addr;		/* load/store effective address, $v0 for SYSCALL */
+	uint32_t target;	/* taken branch/jump target, 0 if not taken */
+} Trace_Record;
+
+typedef struct Trace_Coder_Struct {
+	uint8_t *block;			/* TRACE_BLOCK bytes */
+	uint32_t bytes, records;	/* encoded so far in this block */
+	uint32_t pc, addr;		/* delta bases, cleared at every block */
+	uint32_t ir[TRACE_IR_SLOTS];
+	uint64_t total;			/* records in the file */
+} Trace_Coder;
+
+/***************************************************************/
+/* Memory access trace: every fetch, load and store with its cycle and  */
+/* PC. Records are delta encoded against the previous record of the same */
+/* kind and packed into blocks that decode independently:                        */
+/*   tag byte: kind (bits 0-1), log2 size (2-3), cycle unchanged (4),        */
+/*             cycle + 1 (5), PC + 4 (6), address + size (7, loads/stores) */
+/* followed by varints for the fields the flags do not cover: cycle delta, */
+/* zigzag PC delta and zigzag address delta. A fetch's address is its PC. */
+/***************************************************************/
+#define ACCESS_FETCH	0
+#define ACCESS_READ		1
+#define ACCESS_WRITE	2
+#define NUM_ACCESS		3
+
+#define ACCESS_SAME_CYCLE	0x10
+#define ACCESS_NEXT_CYCLE	0x20
+#define ACCESS_NEXT_PC		0x40
+#define ACCESS_NEXT_ADDR	0x80
+
+#define ACCESS_MAGIC	0x4D41554D	/* "MUAM" */
+#define ACCESS_VERSION	1
+#define ACCESS_BLOCK	65536		/* encoded bytes per block, at most */
+#define ACCESS_MAX_RECORD	21		/* tag + 10-byte cycle + two 5-byte deltas */
+
+typedef struct Access_Block_Struct {
+	uint32_t records;
+	uint32_t bytes;			/* encoded bytes that follow this header */
+} Access_Block;
+
+typedef struct Access_Coder_Struct {
+	uint8_t *block;			/* ACCESS_BLOCK bytes */
+	uint32_t bytes, records;	/* encoded so far in this block */
+	uint64_t cycle;			/* delta bases, cleared at every block */
+	uint32_t pc[NUM_ACCESS];
+	uint32_t addr;
+	uint64_t total;			/* records in the file */
+} Access_Coder;
+
+/***************************************************************/
+/* Set-associative cache model with LRU replacement                                       */
+/***************************************************************/
+#define CACHE_DEFAULT_SIZE	16384
+#define CACHE_DEFAULT_WAYS	4
+#define CACHE_DEFAULT_LINE	32
+
+typedef struct Cache_Struct {
+	uint32_t sets, ways, line_shift;
+	uint32_t *tags;			/* sets * ways line numbers + 1, 0 = invalid */
+	uint64_t *used;			/* last access of each way, for LRU */
+	uint64_t clock;
+	uint64_t accesses;
+	uint64_t misses;
+} Cache;
+
+/***************************************************************/
+/* MMU for kseg2: addresses from MMU_MAPPED_BEGIN up are translated    */
+/* through a TLB backed by a linear page table in guest memory, one word */
+/* per page: the physical page address | PTE_VALID. kseg0/1 below stay  */
+/* direct. A miss walks the table and holds the pipeline for the walk.     */
+/***************************************************************/
+#define MMU_MAPPED_BEGIN	0xC0000000
+#define MMU_PAGE_SHIFT		12
+#define PTE_VALID			0x1
+
+#define TLB_DEFAULT_ENTRIES	64
+#define TLB_DEFAULT_WAYS	4
+#define TLB_DEFAULT_WALK	20		/* cycles to refill an entry from the page table */
+
+typedef struct TLB_Entry_Struct {
+	uint32_t vpn;			/* virtual page number + 1, 0 = invalid */
+	uint32_t pfn;			/* physical page address */
+	uint64_t used;			/* last lookup, for LRU */
+} TLB_Entry;
+
+typedef struct MMU_State_Struct {
+	int enabled;
+	uint32_t table;			/* physical address of the page table */
+	uint32_t entries, ways, sets;
+	uint32_t walk;			/* miss latency in cycles */
+	TLB_Entry *tlb;
+	uint64_t clock;
+} MMU_State;
+
+/***************************************************************/
+/* Interval statistics: one record of counter deltas every N cycles        */
+/***************************************************************/
+#define INTERVAL_CSV		1
+#define INTERVAL_BINARY		2	/* selected by a .bin file name */
+
+#define INTERVAL_MAGIC		0x534E554D	/* "MUNS" */
+#define INTERVAL_VERSION	1
+#define INTERVAL_DEFAULT	10000
+
+typedef struct Interval_Record_Struct {
+	uint64_t cycle;			/* cycle count at the end of the interval */
+	uint64_t cycles;
+	uint64_t instructions;
+	uint64_t data_stalls;
+	uint64_t load_use_stalls;
+	uint64_t control_stalls;
+	uint64_t flushes;
+	uint64_t forwards;
+	uint64_t mix[NUM_MIX];
+} Interval_Record;
+
+/***************************************************************/
+/* Host profiling (make PROFILE=1)                                                                   */
+/***************************************************************/
+#define PROF_RUN		0	/* whole run/runAll loop */
+#define PROF_WB			1
+#define PROF_MEM		2
+#define PROF_EX			3
+#define PROF_ID			4
+#define PROF_IF			5
+#define PROF_FUNCTIONAL	6	/* functional_step */
+#define PROF_DECODE		7	/* operand read and hazard checks in ID */
+#define PROF_MEM_READ	8	/* mem_read_32 */
+#define PROF_MEM_WRITE	9	/* mem_write_32 */
+#define PROF_TRACE		10	/* printing retired instructions, trace file output */
+#define NUM_PROF		11
+
+typedef struct Prof_Counter_Struct {
+	uint64_t ticks;
+	uint64_t calls;
+} Prof_Counter;
+
+#ifdef HOST_PROFILE
+#define PROF_START()	uint64_t prof_start = prof_ticks()
+#define PROF_STOP(id)	(PROF[id].ticks += prof_ticks() - prof_start, PROF[id].calls++)
+/* charge the time since the last lap to id and start timing the next section */
+#define PROF_LAP(id)	do { uint64_t prof_now = prof_ticks(); PROF[id].ticks += prof_now - prof_start; \
+							PROF[id].calls++; prof_start = prof_now; } while (0)
+#else
+#define PROF_START()
+#define PROF_STOP(id)	((void)0)
+#define PROF_LAP(id)	((void)0)
+#endif
+
+/***************************************************************/
+/* Guest hotspot profile, one entry per text word                                   */
+/***************************************************************/
+typedef struct Hotspot_Counter_Struct {
+	uint64_t retired;
+	uint64_t stalls;		/* bubbles charged: the stalled instruction, or the branch for control stalls */
+	uint64_t flushes;		/* taken branch/jump redirects */
+} Hotspot_Counter;
+
+#define HOTSPOT_INDEX(pc)	(((pc) - MEM_TEXT_BEGIN) >> 2)
+
+/***************************************************************/
+/* Spin loops (functional mode): a backward branch closing a straight-  */
+/* line body that stores nothing and only advances induction registers  */
+/* by a fixed step. spin_skip jumps over all but its last iteration.     */
+/***************************************************************/
+#define SPIN_CACHE		64		/* analysed loops, direct mapped by branch PC */
+#define SPIN_MAX_BODY	64		/* longest body considered, in instructions */
+
+typedef struct Spin_Loop_Struct {
+	uint32_t pc;				/* the backward branch, 0 = empty slot */
+	uint32_t target;			/* first instruction of the body */
+	uint32_t length;			/* instructions per iteration, 0 = not a spin loop */
+	uint32_t inductions;		/* bit r set: REGS[r] advances by a step each iteration */
+	uint8_t step_reg[MIPS_REGS];	/* register holding the step, 0 = step_imm */
+	uint8_t step_negate[MIPS_REGS];	/* SUBU: the step is subtracted */
+	uint32_t step_imm[MIPS_REGS];
+	uint32_t mix[NUM_MIX];		/* instructions per iteration by MIX_* class */
+} Spin_Loop;
+
+/***************************************************************/
+/* Guest library routines run on the host: control reaching an entry  */
+/* point in the intercept table executes the routine directly on guest */
+/* memory, sets $v0 and returns to $ra. The pipeline first lets older   */
+/* instructions retire, then freezes for the modelled cost.                    */
+/***************************************************************/
+#define INTERCEPT_MEMCPY	0	/* $a2 bytes from $a1 to $a0, $v0 = $a0 */
+#define INTERCEPT_MEMSET	1	/* $a2 bytes of $a1 at $a0, $v0 = $a0 */
+#define INTERCEPT_STRLEN	2	/* $v0 = length of the string at $a0 */
+#define NUM_INTERCEPT_ROUTINES	3
+#define MAX_INTERCEPTS		16
+
+#define INTERCEPT_DEFAULT_CYCLES	10	/* modelled cost of a call */
+#define INTERCEPT_DEFAULT_RATE		4	/* plus a cycle per this many bytes */
+
+typedef struct Intercept_Struct {
+	uint32_t pc;			/* entry point */
+	int routine;			/* INTERCEPT_* */
+} Intercept;
+
+/***************************************************************/
+/* Debugging stops, tested between cycles only while one is armed:      */
+/*   breakpoints  one bit per text word; the run stops before the cycle  */
+/*                that would retire the instruction                                 */
+/*   watchpoints  guest ranges, a flag byte per page keeps the test on   */
+/*                each load and store to one lookup                                */
+/*   run until    a condition compiled once to postfix bytecode            */
+/***************************************************************/
+#define MAX_WATCHPOINTS		16
+#define WATCH_READ			0x1
+#define WATCH_WRITE			0x2
+
+typedef struct Watchpoint_Struct {
+	uint32_t begin, end;	/* guest range, end inclusive */
+	int mode;				/* WATCH_READ | WATCH_WRITE */
+} Watchpoint;
+
+typedef struct Watch_Hit_Struct {
+	int mode;				/* WATCH_READ or WATCH_WRITE, 0 = no hit */
+	uint32_t pc, address, size;
+} Watch_Hit;
+
+/* run until bytecode: operands push a value, the other ops pop two and push one */
+enum { UNTIL_REG, UNTIL_CONST, UNTIL_PC, UNTIL_HI, UNTIL_LO, UNTIL_CYCLES, UNTIL_INSTRUCTIONS,
+	UNTIL_EQ, UNTIL_NE, UNTIL_LT, UNTIL_LE, UNTIL_GT, UNTIL_GE, UNTIL_AND, UNTIL_OR };
+#define MAX_UNTIL		64		/* ops in a condition */
+#define UNTIL_STACK		4		/* deepest a condition can need */
+
+typedef struct Until_Op_Struct {
+	uint32_t op;			/* UNTIL_* */
+	uint32_t arg;			/* register or constant */
+} Until_Op;
+
+/***************************************************************/
+/* Memory-mapped devices, a 4 KB page each, on pages with no memory     */
+/* behind them (0xFFFF0000 up by default). Accesses only look for a     */
+/* device once no memory region matched, through DEVICE_PAGES, so         */
+/* ordinary loads and stores never see them. A device asks for a tick   */
+/* at cycle <next>; cycle() runs it once CYCLE_COUNT gets there.               */
+/***************************************************************/
+#define MAX_DEVICES		8
+#define DEVICE_REGS		4
+#define DEVICE_NEVER	UINT64_MAX
+
+enum { DEVICE_UART, DEVICE_TIMER, DEVICE_COUNTER, NUM_DEVICE_TYPES };
+
+/* device_polled(): what a spin loop loading from an address sees */
+enum { DEVICE_NONE, DEVICE_STEADY, DEVICE_VOLATILE };
+
+/* uart, as SPIM lays it out: receiver control and data, transmitter control and data */
+#define UART_RX_CONTROL		0x0
+#define UART_RX_DATA		0x4
+#define UART_TX_CONTROL		0x8
+#define UART_TX_DATA		0xC
+
+/* timer: expires <period> cycles after it is enabled, again every period if periodic */
+#define TIMER_CONTROL		0x0		/* bit 0 enable, bit 1 periodic */
+#define TIMER_PERIOD		0x4
+#define TIMER_STATUS		0x8		/* bit 0 expired, cleared by any write */
+#define TIMER_EXPIRED		0xC		/* expirations since reset */
+
+/* counter: read-only */
+#define COUNTER_CYCLES		0x0
+#define COUNTER_CYCLES_HI	0x4
+#define COUNTER_INSTRUCTIONS	0x8
+
+typedef struct Device_Struct {
+	int type;					/* DEVICE_* */
+	uint32_t address;			/* its page */
+	uint32_t regs[DEVICE_REGS];	/* state, as the type uses it */
+	uint64_t next;				/* cycle of the next tick, DEVICE_NEVER for none */
+} Device;
+
+typedef struct Device_Type_Struct {
+	const char *name;
+	uint32_t (*read)(Device *device, uint32_t offset);		/* word at a word offset */
+	void (*write)(Device *device, uint32_t offset, uint32_t value);
+	void (*tick)(Device *device);	/* at device->next, which it moves on; NULL if never */
+} Device_Type;
+
+/***************************************************************/
+/* Reverse execution: the whole simulator is checkpointed every N       */
+/* cycles. Memory is copy-on-write: after a checkpoint, the first store */
+/* to a page saves the page as it was, so restoring a checkpoint puts   */
+/* back the saved pages of it and every later one, newest first. rstep  */
+/* and rcontinue restore the nearest earlier checkpoint and replay        */
+/* forward without repeating guest output. The oldest checkpoints are  */
+/* dropped to keep the saved state within the budget.                           */
+/***************************************************************/
+#define CHECKPOINT_DEFAULT_BUDGET	64		/* MB */
+
+typedef struct Checkpoint_Struct {
+	uint32_t cycle;				/* CYCLE_COUNT when taken */
+	uint32_t instructions;
+	CPU_State state;			/* both buffers are equal between cycles */
+	CPU_Pipeline_Reg latches[4];	/* ID_IF, EX_ID, MEM_EX, WB_MEM */
+	CPU_Stats stats;
+	int run_flag, control_hazard, jump_stall, syscall_pending;
+	uint32_t memory_wait, memory_wait_pc, heap_break, spin_branch, spin_last;
+	TLB_Entry *tlb;				/* MMU.entries, NULL without the MMU */
+	uint64_t tlb_clock;
+	Device devices[MAX_DEVICES];
+	uint64_t device_next;
+	Image_Page *pages;			/* pages as they were before their first store since */
+	uint32_t num_pages, capacity;
+	uint64_t bytes;				/* held by this checkpoint */
+} Checkpoint;
+
+/***************************************************************/
+/* gdb remote serial protocol stub: one client on a localhost TCP port. */
+/* Registers are numbered as gdb numbers a 32-bit MIPS: $0-$31, sr, lo, */
+/* hi, bad, cause, pc; the FPU is reported as unavailable.                     */
+/***************************************************************/
+#define GDB_NUM_REGS	38
+#define GDB_REG_LO		33
+#define GDB_REG_HI		34
+#define GDB_REG_PC		37
+#define GDB_PACKET		4096	/* largest packet either way */
+#define GDB_POLL		65536	/* cycles between checks for an interrupt while running */
+
+/***************************************************************/
+/* Per-instruction CPI stack, indexed like the hotspot profile                 */
+/***************************************************************/
+typedef struct Cpi_Counter_Struct {
+	uint64_t cycles[NUM_STALL];
+} Cpi_Counter;
+
 /***************************************************************/
 /* CPU State info.                                                                                                               */
 /***************************************************************/
 
-CPU_State CURRENT_STATE, NEXT_STATE;
+/* architectural state, double buffered: cycle() swaps the two and copies */
+/* forward only the registers written during the cycle (STATE_DIRTY)      */
+CPU_State STATE_BUFFERS[2];
+CPU_State *CURRENT_STATE_PTR = &STATE_BUFFERS[0], *NEXT_STATE_PTR = &STATE_BUFFERS[1];
+uint32_t STATE_DIRTY;	/* GPRs written to NEXT_STATE this cycle, one bit each */
+#define CURRENT_STATE	(*CURRENT_STATE_PTR)
+#define NEXT_STATE		(*NEXT_STATE_PTR)
 int RUN_FLAG;	/* run flag*/
 int ENABLE_FORWARDING;						//Forwarding Flag
-int ForwardA;
-int ForwardB;
 int controlHazard = 0;
 int jumpStall = 0;
 uint32_t INSTRUCTION_COUNT;
 uint32_t CYCLE_COUNT;
 uint32_t PROGRAM_SIZE; /*in words*/
+uint32_t MAX_CYCLES;	/* batch mode cycle limit, 0 = run to completion */
+int TRACE_LEVEL = 1;	/* 0 = silent, 1 = print retired instructions */
+int FAST_FORWARD = 1;	/* skip idle pipeline cycles and spin loops in bulk */
+int ID_STALL;			/* cause of the bubble ID inserted this cycle */
+int SIM_MODE;			/* MODE_PIPELINE or MODE_FUNCTIONAL */
+int SYSCALL_PENDING;	/* a SYSCALL was fetched and has not retired: fetch waits */
+void (*PIPELINE_CYCLE)();	/* handle_pipeline specialised for the current configuration */
+uint32_t MEMORY_WAIT;	/* cycles the pipeline stays frozen on a memory event */
+uint32_t MEMORY_WAIT_PC;	/* instruction those cycles are charged to */
+MMU_State MMU = { 0, 0, TLB_DEFAULT_ENTRIES, TLB_DEFAULT_WAYS, 0, TLB_DEFAULT_WALK, NULL, 0 };
+uint32_t HEAP_BREAK;	/* end of the sbrk heap, grows up from MEM_DATA_BEGIN */
+int GUEST_FILES[MAX_GUEST_FILES];	/* host fd behind each guest fd, -1 if closed */
+Guest_Mapping MAPPINGS[MAX_MAPPINGS];
+int NUM_MAPPINGS;
+int READONLY_MAPPINGS;	/* MAP_READONLY entries, stores are checked while non-zero */
+uint8_t *MEM_TOUCHED;	/* page stored to since the last reset, a byte per 4 KB page */
+CPU_Stats STATS;
+Prof_Counter PROF[NUM_PROF];
+Hotspot_Counter *HOTSPOT;	/* PROGRAM_SIZE entries while profiling, else NULL */
+Cpi_Counter *CPI_PC;		/* PROGRAM_SIZE entries while attributing, else NULL */
+Batch_State BATCH;
+Spin_Loop SPIN_LOOPS[SPIN_CACHE];
+uint32_t SPIN_BRANCH;		/* functional mode: PC of the control transfer taken this cycle, else 0 */
+uint32_t SPIN_LAST;			/* the one taken before it */
+Intercept INTERCEPTS[MAX_INTERCEPTS];
+int NUM_INTERCEPTS;
+uint32_t INTERCEPT_CYCLES = INTERCEPT_DEFAULT_CYCLES;	/* pipeline cost of an intercepted call */
+uint32_t INTERCEPT_RATE = INTERCEPT_DEFAULT_RATE;		/* bytes per extra cycle, 0 = flat cost */
+int DEBUG_ARMED;				/* breakpoints, watchpoints or a run until condition are set */
+uint64_t *BREAKPOINTS;			/* bit per text word, NULL until the first breakpoint */
+int NUM_BREAKPOINTS;
+uint32_t BREAK_PC;				/* last breakpoint stopped at, passed over when run again */
+uint32_t BREAK_COUNT;			/* INSTRUCTION_COUNT at that stop */
+Watchpoint WATCHPOINTS[MAX_WATCHPOINTS];
+int NUM_WATCHPOINTS;
+uint8_t *WATCH_PAGES;			/* WATCH_* of every 4 KB guest page, NULL without watchpoints */
+Watch_Hit WATCH_HIT;			/* access that hit a watchpoint this cycle */
+Until_Op UNTIL[MAX_UNTIL];		/* condition of the current run until */
+int UNTIL_LENGTH;				/* ops in UNTIL, 0 = none */
+uint32_t CHECKPOINT_CYCLES;		/* cycles between checkpoints, 0 = reverse execution off */
+uint32_t CHECKPOINT_LEFT;		/* cycles until the next one */
+uint64_t CHECKPOINT_BUDGET = (uint64_t)CHECKPOINT_DEFAULT_BUDGET << 20;	/* bytes of checkpoints kept */
+uint64_t CHECKPOINT_BYTES;		/* held now */
+Checkpoint *CHECKPOINTS;		/* oldest first */
+uint32_t NUM_CHECKPOINTS, CHECKPOINT_CAPACITY;
+uint8_t *CHECKPOINT_PAGES;		/* page saved since the newest checkpoint, a byte per 4 KB page */
+int REPLAYING;					/* re-executing history: guest output is not repeated */
+int GDB_PORT;					/* serve gdb on this port before running, 0 = no */
+Device DEVICES[MAX_DEVICES];
+int NUM_DEVICES;
+uint8_t *DEVICE_PAGES;			/* 1 + DEVICES index of every 4 KB page, 0 for none; NULL without devices */
+uint64_t DEVICE_NEXT = DEVICE_NEVER;	/* earliest tick any device asked for */
+uint64_t DEVICE_TICKED;			/* cycle count when devices last ticked */
+
+#define INSTRUCTION_INFO(name, op, fn, format, dest, reads, mix, kind, value) \
+	[INS_##name] = { #name, FMT_##format, DEST_##dest, reads, mix, KIND_##kind },
+const Instruction_Info INSTRUCTIONS[NUM_INSTRUCTIONS] = {
+	[INS_INVALID] = { "", FMT_INVALID, DEST_NONE, 0, MIX_ALU, KIND_INVALID },
+	MIPS_INSTRUCTIONS(INSTRUCTION_INFO)
+};
+#undef INSTRUCTION_INFO
+uint8_t DECODE_PRIMARY[64], DECODE_SPECIAL[64], DECODE_REGIMM[32];	/* INS_* by opcode, function, rt */
 
 
 /***************************************************************/
-/* Pipeline Registers.                                                                                                        */
+/* Pipeline Registers. Unlike the architectural state these are single */
+/* buffered: the stages run WB to IF, so each reads its input latch      */
+/* before the stage upstream overwrites it. ID forwards the results EX   */
+/* and MEM produce in the same cycle, and a taken branch in EX squashes */
+/* ID_IF and EX_ID, so the order is part of the timing model.              */
 /***************************************************************/
 CPU_Pipeline_Reg ID_IF;
 CPU_Pipeline_Reg EX_ID;
 CPU_Pipeline_Reg MEM_EX;
 CPU_Pipeline_Reg WB_MEM;
 
-char prog_file[32];
+char prog_file[256];
+char HOTSPOT_FILE[256];		/* batch mode: folded hotspot output */
+char LANES_FILE[256];		/* batch mode with lanes: per-lane CSV, stdout if empty */
+char EXPORT_FILE[256];		/* batch mode: memory image written at the end */
+uint32_t EXPORT_START, EXPORT_STOP;	/* its range, both 0 for all touched pages */
+char DIFF_FILE[256];		/* batch mode: image compared with memory at the end */
+
+int TRACE_MODE;					/* TRACE_OFF, TRACE_RECORD or TRACE_REPLAY */
+FILE *TRACE_FILE;				/* trace being recorded or replayed */
+Trace_Coder TRACE_CODER;
+Trace_Record *TRACE_BUFFER;		/* decoded block while replaying, TRACE_BLOCK_RECORDS */
+uint32_t TRACE_LENGTH;			/* records in TRACE_BUFFER, 0 at the end of the trace */
+uint32_t TRACE_CURSOR;			/* next record to fetch */
+uint64_t TRACE_FETCHED;			/* records fetched in IF */
+uint64_t TRACE_RETIRED;			/* records retired in WB */
+
+FILE *INTERVAL_FILE;			/* time series output, NULL when off */
+int INTERVAL_FORMAT;			/* INTERVAL_CSV or INTERVAL_BINARY */
+int INTERVAL_HEADER;			/* binary header not written yet */
+uint32_t INTERVAL_CYCLES;		/* cycles per interval */
+uint32_t INTERVAL_LEFT;			/* cycles until the next sample */
+Interval_Record INTERVAL_LAST;	/* counters at the previous sample */
+
+FILE *ACCESS_FILE;				/* memory access trace output, NULL when off */
+Access_Coder ACCESS;
+char ACCESS_REPLAY_FILE[256];	/* batch mode: replay this access trace instead of running */
+uint32_t CACHE_SIZE = CACHE_DEFAULT_SIZE;	/* geometry of each L1 in the cache model */
+uint32_t CACHE_WAYS = CACHE_DEFAULT_WAYS;
+uint32_t CACHE_LINE = CACHE_DEFAULT_LINE;
+Cache ICACHE, DCACHE;
+
+Live_Stats *LIVE;				/* mapped live statistics file, NULL when off */
+uint32_t LIVE_CYCLES;			/* cycles between updates */
+uint32_t LIVE_LEFT;				/* cycles until the next update */
 
 
 /***************************************************************/
@@ -93,6 +791,13 @@ char prog_file[32];
 void help();
 uint32_t mem_read_32(uint32_t address);
 void mem_write_32(uint32_t address, uint32_t value);
+uint8_t mem_read_8(uint32_t address);
+uint16_t mem_read_16(uint32_t address);
+void mem_write_8(uint32_t address, uint8_t value);
+void mem_write_16(uint32_t address, uint16_t value);
+void syscall_execute(uint32_t number);
+void syscall_reset();
+void console_flush();
 void cycle();
 void run(int num_cycles);
 void runAll();
@@ -101,14 +806,76 @@ void rdump();
 void handle_command();
 void reset();
 void init_memory();
+int mem_map_file(char *filename, uint32_t address, int mode);
+void mem_unmap_all();
+int mem_export(char *filename, uint32_t start, uint32_t stop);
+int mem_import(char *filename);
+long mem_diff(char *filename, char *other);
 void load_program();
-void handle_pipeline(); /*IMPLEMENT THIS*/
-void WB();/*IMPLEMENT THIS*/
-void MEM();/*IMPLEMENT THIS*/
-void EX();/*IMPLEMENT THIS*/
-void ID();/*IMPLEMENT THIS*/
-void IF();/*IMPLEMENT THIS*/
+void pipeline_select();
+uint32_t cycle_skip(uint32_t limit);
+uint32_t spin_skip(uint32_t limit);
+int intercept_add(char *routine, uint32_t pc);
+void intercept_clear();
+int break_add(uint32_t pc);
+void break_remove(uint32_t pc);
+void break_clear();
+int watch_add(uint32_t address, uint32_t size, int mode);
+void watch_clear();
+int until_compile(char *condition);
+void until_clear();
+int debug_stop();
+void checkpoint_start(uint32_t cycles);
+void checkpoint_stop();
+void checkpoint_take();
+void checkpoint_forget();
+void checkpoint_restart();
+void checkpoint_page(uint32_t address);
+void reverse_step(uint32_t cycles);
+void reverse_continue();
+int gdb_serve(int port);
+int device_add(char *name, uint32_t address);
+uint32_t device_read(uint32_t address);
+void device_write(uint32_t address, uint32_t value);
+void device_clear();
+void device_reset();
+void device_tick();
+int device_polled(uint32_t address);
+void decode_init();
+void functional_step();
 void show_pipeline();/*IMPLEMENT THIS*/
 void initialize();
 void print_program(); /*IMPLEMENT THIS*/
 void print_instruction(uint32_t addr);
+void print_instruction_word(uint32_t instruction);
+void reset_pipeline();
+void trace_record(char *filename);
+void trace_replay(char *filename);
+void trace_stop();
+void access_start(char *filename);
+void access_stop();
+void access_replay(char *filename);
+int cache_init(Cache *cache, uint32_t size, uint32_t ways, uint32_t line);
+int mmu_enable(uint32_t table);
+void mmu_disable();
+void mmu_flush();
+void cache_free(Cache *cache);
+void interval_start(char *filename);
+void interval_sample();
+void interval_stop();
+void live_start(char *filename);
+void live_publish();
+void live_stop();
+int batch_load(char *filename);
+void batch_run(uint32_t max_steps);
+void batch_dump(char *filename);
+int set_option(char *key, char *value);	/* OPTION_OK, OPTION_UNKNOWN or OPTION_INVALID */
+void print_stats();
+void print_stats_json(FILE *fp);
+void print_profile();
+void hotspot_enable();
+void hotspot_report(int top);
+void hotspot_dump(char *filename);
+void cpi_enable();
+void cpi_report(uint32_t start, uint32_t stop);
+void cpi_functions();
@@ -0,0 +1,35 @@
+#!/bin/sh
+# Run each test program in functional mode and in the pipeline with and
+# without forwarding, and compare the registers it ends with against the
+# expected rdump.
+#
+# usage: sh test.sh
+#
+# SIM        simulator binary (./mu-mips)
+
+SIM=${SIM:-./mu-mips}
+DIR=$(dirname "$0")
+
+expected=$(mktemp)
+actual=$(mktemp)
+trap 'rm -f "$expected" "$actual"' EXIT
+
+failed=0
+for test in testHazards:resultsSimRDump testZero:resultsZeroRDump; do
+	program=$DIR/${test%%:*}.in
+	results=$DIR/${test#*:}.txt
+	sed -n '/^\[R0\]/,/^\[LO\]/p' "$results" | tr -d '\r' > "$expected"
+	for config in "mode=functional forwarding=0" "mode=pipeline forwarding=0" "mode=pipeline forwarding=1"; do
+		set -- $config
+		printf 'run 100000\nrdump\nquit\n' | "$SIM" -q -o "$1" -o "$2" "$program" 2>&1 |
+			sed -n '/^\[R0\]/,/^\[LO\]/p' > "$actual"
+		if cmp -s "$expected" "$actual"; then
+			echo "${test%%:*} ($1 $2): ok"
+		else
+			echo "${test%%:*} ($1 $2): FAILED"
+			diff "$expected" "$actual"
+			failed=1
+		fi
+	done
+done
+exit $failed